@@ -0,0 +1,529 @@
+//  bench/bench.cpp
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <new>
+#include <sstream>
+
+#include "../src/cfa.h"
+#include "../src/classify.h"
+
+//----------------------------------------------------
+//  [ SECTION ALLOCATIONS ]   Heap allocation counter
+//----------------------------------------------------
+
+// Every heap allocation in the process goes through here, so a case can be
+// checked for allocations on its hot path. Over-aligned types such as
+// CharMap arrive through the align_val_t overloads, so those are replaced
+// too; every delete frees through one out-of-line function, which keeps
+// the compiler from pairing an inlined free() with operator new.
+std::atomic<uint64_t> g_allocations {0};
+
+static void *counted_alloc (size_t size, size_t alignment)
+{
+  ++g_allocations;
+  size = size ? size : 1;
+  void *p = alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__
+            ? std::malloc (size)
+            : std::aligned_alloc (alignment, (size + alignment - 1) / alignment * alignment);
+  if (!p)
+    {
+      throw std::bad_alloc ();
+    }
+  return p;
+}
+
+__attribute__((noinline)) static void counted_free (void *p) noexcept
+{
+  std::free (p);
+}
+
+void *operator new (size_t size)
+{
+  return counted_alloc (size, 0);
+}
+
+void *operator new[] (size_t size)
+{
+  return counted_alloc (size, 0);
+}
+
+void *operator new (size_t size, std::align_val_t alignment)
+{
+  return counted_alloc (size, (size_t) alignment);
+}
+
+void *operator new[] (size_t size, std::align_val_t alignment)
+{
+  return counted_alloc (size, (size_t) alignment);
+}
+
+void operator delete (void *p) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete[] (void *p) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete (void *p, size_t) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete[] (void *p, size_t) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete (void *p, std::align_val_t) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete[] (void *p, std::align_val_t) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete (void *p, size_t, std::align_val_t) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete[] (void *p, size_t, std::align_val_t) noexcept
+{
+  counted_free (p);
+}
+
+//----------------------------------------------------
+//  [ SECTION BENCH ]   Throughput benchmarks
+//----------------------------------------------------
+
+namespace cfa::bench
+{
+    struct Options {
+        std::vector<size_t> sizes {1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 256 * 1024 * 1024};
+        std::vector<unsigned> threads {1, 2, 4};
+        std::vector<std::string> corpora;
+        std::string json_path;
+        std::filesystem::path temp_dir = std::filesystem::temp_directory_path ();
+        int reps = 5;
+        double min_seconds = 0.02;
+    };
+
+    struct Result {
+        std::string corpus;
+        std::string op;
+        std::string source;
+        std::string parse;
+        unsigned threads = 1;
+        size_t bytes = 0;
+        double mean_bps = 0;
+        double stddev_bps = 0;
+        double ns_per_byte = 0;
+        uint64_t allocations = 0;
+    };
+
+    // One measured case; returns a value derived from the result so the work
+    // cannot be optimized away.
+    using Case = std::function<uint64_t ()>;
+
+    bool parse_options (int argc, char **argv, Options &options);
+    std::string synthetic_corpus (size_t size);
+    Result measure (const Case &run, size_t bytes, const Options &options);
+    std::string json_string (const std::string &text);
+    std::string json_number (double value);
+    void write_json (const std::string &path, const std::vector<Result> &results);
+    void bench_classify (const Options &options);
+    int run (int argc, char **argv);
+}
+
+namespace cfa::bench
+{
+    bool parse_options (int argc, char **argv, Options &options)
+    {
+      for (int i = 1; i < argc; ++i)
+        {
+          std::string arg (argv[i]), key, value;
+          if (!utils::parse_option (arg, key, value))
+            {
+              return false;
+            }
+
+          std::stringstream list (value);
+          std::string item;
+          if (key == "sizes")
+            {
+              options.sizes.clear ();
+              while (std::getline (list, item, ','))
+                {
+                  size_t size;
+                  if (!utils::parse_size (item, size) || size == 0)
+                    {
+                      return false;
+                    }
+                  options.sizes.push_back (size);
+                }
+            }
+          else if (key == "threads")
+            {
+              options.threads.clear ();
+              while (std::getline (list, item, ','))
+                {
+                  unsigned threads;
+                  if (!utils::parse_number (item, threads))
+                    {
+                      return false;
+                    }
+                  options.threads.push_back (threads);
+                }
+            }
+          else if (key == "corpus")
+            {
+              options.corpora.push_back (value);
+            }
+          else if (key == "json")
+            {
+              options.json_path = value;
+            }
+          else if (key == "tmpdir")
+            {
+              options.temp_dir = value;
+            }
+          else if (key == "reps" && utils::parse_number (value, options.reps))
+            {
+              options.reps = std::max (1, options.reps);
+            }
+          else
+            {
+              return false;
+            }
+        }
+      return true;
+    }
+
+    std::string synthetic_corpus (size_t size)
+    {
+      // Uniform printable ASCII, the same distribution as `tests::generate_test_file`.
+      generate::Options corpus;
+      corpus.seed = 42;
+      auto table = generate::make_sample_table (generate::distribution_weights (corpus));
+
+      std::string data (size, ' ');
+      for (size_t offset = 0; offset < size; offset += generate::CHUNK_SIZE)
+        {
+          generate::fill_chunk (&data[offset], std::min (generate::CHUNK_SIZE, size - offset),
+                                offset / generate::CHUNK_SIZE, corpus, table);
+        }
+      return data;
+    }
+
+    Result measure (const Case &run, size_t bytes, const Options &options)
+    {
+      using clock = std::chrono::steady_clock;
+      volatile uint64_t sink = run ();
+
+      // Allocations of one call, after the warm-up has sized any reused storage.
+      uint64_t allocations = g_allocations;
+      sink = sink + run ();
+      allocations = g_allocations - allocations;
+
+      // Small inputs are repeated until a sample is long enough to time.
+      size_t iterations = 1;
+      for (;;)
+        {
+          auto start = clock::now ();
+          for (size_t i = 0; i < iterations; ++i)
+            {
+              sink = sink + run ();
+            }
+          if (std::chrono::duration<double> (clock::now () - start).count () >= options.min_seconds)
+            {
+              break;
+            }
+          iterations *= 2;
+        }
+
+      std::vector<double> samples;
+      for (int rep = 0; rep < options.reps; ++rep)
+        {
+          auto start = clock::now ();
+          for (size_t i = 0; i < iterations; ++i)
+            {
+              sink = sink + run ();
+            }
+          double seconds = std::chrono::duration<double> (clock::now () - start).count ();
+          samples.push_back ((double) bytes * (double) iterations / seconds);
+        }
+
+      Result result;
+      result.bytes = bytes;
+      result.allocations = allocations;
+      for (double bps: samples)
+        {
+          result.mean_bps += bps / (double) samples.size ();
+        }
+      for (double bps: samples)
+        {
+          result.stddev_bps += (bps - result.mean_bps) * (bps - result.mean_bps) / (double) samples.size ();
+        }
+      result.stddev_bps = std::sqrt (result.stddev_bps);
+      result.ns_per_byte = 1e9 / result.mean_bps;
+      return result;
+    }
+
+    // A quoted JSON string; corpus paths may hold quotes, backslashes or
+    // control characters.
+    std::string json_string (const std::string &text)
+    {
+      std::string quoted = "\"";
+      for (unsigned char c: text)
+        {
+          if (c == '"' || c == '\\')
+            {
+              quoted += '\\';
+              quoted += (char) c;
+            }
+          else if (c < 0x20)
+            {
+              char escape[8];
+              snprintf (escape, sizeof (escape), "\\u%04x", c);
+              quoted += escape;
+            }
+          else
+            {
+              quoted += (char) c;
+            }
+        }
+      return quoted + '"';
+    }
+
+    // JSON has no inf or nan; those are written as null.
+    std::string json_number (double value)
+    {
+      if (!std::isfinite (value))
+        {
+          return "null";
+        }
+      std::ostringstream out;
+      out << value;
+      return out.str ();
+    }
+
+    void write_json (const std::string &path, const std::vector<Result> &results)
+    {
+      std::ofstream out (path);
+      out << "{\n  \"isa\": \"" << utils::simd::isa_name (utils::simd::active_isa ()) << "\",\n"
+          << "  \"hardware_threads\": " << std::thread::hardware_concurrency () << ",\n"
+          << "  \"results\": [\n";
+      for (size_t i = 0; i < results.size (); ++i)
+        {
+          const Result &r = results[i];
+          out << "    {\"corpus\": " << json_string (r.corpus) << ", \"op\": " << json_string (r.op)
+              << ", \"source\": " << json_string (r.source) << ", \"parse\": " << json_string (r.parse)
+              << ", \"threads\": " << r.threads << ", \"bytes\": " << r.bytes
+              << ", \"bytes_per_sec\": " << json_number (r.mean_bps)
+              << ", \"stddev_bytes_per_sec\": " << json_number (r.stddev_bps)
+              << ", \"ns_per_byte\": " << json_number (r.ns_per_byte) << ", \"allocations\": " << r.allocations << "}"
+              << (i + 1 < results.size () ? ",\n" : "\n");
+        }
+      out << "  ]\n}\n";
+    }
+
+    // Scores random distributions against a set of random profiles; here
+    // `measure` counts comparisons instead of bytes.
+    void bench_classify (const Options &options)
+    {
+      const size_t profiles = 512, queries = 1024;
+      uint64_t state = 42;
+      auto random_ranks = [&state]
+      {
+          CharMap<uint64_t> counts;
+          for (auto &n: counts.Data)
+            {
+              n = generate::splitmix64 (state) % 1000;
+            }
+          return counts.ranks ();
+      };
+
+      classify::ProfileSet set;
+      for (size_t i = 0; i < profiles; ++i)
+        {
+          set.add (std::to_string (i), random_ranks ());
+        }
+      std::vector<classify::Query> batch;
+      for (size_t i = 0; i < queries; ++i)
+        {
+          batch.push_back (classify::prepare (random_ranks ()));
+        }
+
+      printf ("\n%-10s %-8s %3s %12s %14s %9s %7s\n", "op", "metric", "thr", "profiles", "compares/s", "ns/cmp", "cv%");
+      for (auto metric: {classify::Metric::ChiSquare, classify::Metric::Cosine, classify::Metric::KullbackLeibler})
+        {
+          for (unsigned threads: options.threads)
+            {
+              Result result = measure ([&set, &batch, metric, threads]
+                                       {
+                                           auto results = set.best (batch, metric, classify::DEFAULT_TOP, threads);
+                                           return (uint64_t) results.back ().front ().profile;
+                                       }, profiles * queries, options);
+              printf ("%-10s %-8s %3u %12zu %14.0f %9.2f %7.2f\n", "classify", classify::metric_name (metric), threads,
+                      profiles, result.mean_bps, result.ns_per_byte, 100 * result.stddev_bps / result.mean_bps);
+            }
+        }
+    }
+
+    int run (int argc, char **argv)
+    {
+      Options options;
+      if (!parse_options (argc, argv, options))
+        {
+          printf ("Usage: cfa_bench [--sizes=1K,1M,1G] [--threads=1,2,4] [--corpus=FILE]... [--reps=N]\n"
+                  "                 [--json=FILE] [--tmpdir=DIR]\n");
+          return 1;
+        }
+
+      // Synthetic data at every size, then the real corpora as they are. Only
+      // one corpus is held in memory at a time.
+      std::vector<std::pair<std::string, std::function<std::string ()>>> corpora;
+      for (size_t size: options.sizes)
+        {
+          corpora.emplace_back ("synthetic", [size]
+          { return synthetic_corpus (size); });
+        }
+      for (auto &path: options.corpora)
+        {
+          if (std::ifstream file (path, std::ios::binary); !file || file.peek () == EOF)
+            {
+              fprintf (stderr, "cfa_bench: cannot read corpus '%s', or it is empty\n", path.c_str ());
+              return 1;
+            }
+          corpora.emplace_back (path, [path]
+          {
+              std::ifstream file (path, std::ios::binary);
+              return std::string ((std::istreambuf_iterator<char> (file)), {});
+          });
+        }
+
+      std::vector<Result> results;
+      printf ("isa: %s\n\n", utils::simd::isa_name (utils::simd::active_isa ()));
+      printf ("%-10s %-6s %-9s %-7s %3s %12s %10s %9s %7s %6s\n",
+              "corpus", "op", "source", "parse", "thr", "bytes", "MB/s", "ns/byte", "cv%", "allocs");
+
+      int status = 0;
+
+      for (auto &[name, load]: corpora)
+        {
+          std::string data = load ();
+
+          // The file-backed sources read the corpus from a temporary copy.
+          std::filesystem::path temp_path = options.temp_dir / "cfa_bench.tmp";
+          {
+            std::ofstream out (temp_path, std::ios::binary);
+            out.write (data.data (), (std::streamsize) data.size ());
+          }
+          utils::file::MappedFile mapped (temp_path.string ());
+          CharVec<float> rank_vec;
+
+          for (ParseType type: {ParseType::Alpha, ParseType::Digit, ParseType::Symbol, ParseType::AlNum,
+                                ParseType::Ascii})
+            {
+              std::vector<std::tuple<std::string, std::string, unsigned, Case>> cases;
+              cases.emplace_back ("count", "string", 1, [&data, type]
+              {
+                  return get_char_count_map<uint64_t> (data, type)->Data[65];
+              });
+              cases.emplace_back ("count", "ifstream", 1, [&temp_path, type]
+              {
+                  std::ifstream file (temp_path, std::ios::binary);
+                  return get_char_count_map<uint64_t> (file, type)->Data[65];
+              });
+              cases.emplace_back ("count", "async", 1, [&temp_path, type]
+              {
+                  utils::aio::AsyncReader reader;
+                  reader.open (temp_path.string ());
+                  return get_char_count_map<uint64_t> (reader, type)->Data[65];
+              });
+              cases.emplace_back ("count", "mmap", 1, [&mapped, type]
+              {
+                  return get_char_count_map<uint64_t> (mapped, type)->Data[65];
+              });
+              cases.emplace_back ("count", "stream", 1, [&data, type]
+              {
+                  CharCounter counter (type);
+                  for (size_t i = 0; i < data.size (); i += utils::file::DEFAULT_BLOCK_SIZE)
+                    {
+                      counter.feed (data.data () + i, std::min (utils::file::DEFAULT_BLOCK_SIZE, data.size () - i));
+                    }
+                  return counter.counts ().Data[65];
+              });
+              for (unsigned threads: options.threads)
+                {
+                  cases.emplace_back ("count", "parallel", threads, [&mapped, type, threads]
+                  {
+                      return get_char_count_map_parallel<uint64_t> (mapped, type, threads)->Data[65];
+                  });
+                }
+              cases.emplace_back ("rank", "string", 1, [&data, type]
+              {
+                  return (uint64_t) get_char_rank_vec (data, type)->Data.size ();
+              });
+              cases.emplace_back ("count", "view", 1, [&data, type]
+              {
+                  return count_chars<uint64_t> (data, type).Data[65];
+              });
+              cases.emplace_back ("rank", "view", 1, [&data, type, &rank_vec]
+              {
+                  rank_chars (data, type).copy_to (rank_vec);
+                  return (uint64_t) rank_vec.Data.size ();
+              });
+
+              for (auto &[op, source, threads, run_case]: cases)
+                {
+                  Result result = measure (run_case, data.size (), options);
+                  result.corpus = name;
+                  result.op = op;
+                  result.source = source;
+                  result.parse = parse_type_name (type);
+                  result.threads = threads;
+                  results.push_back (result);
+
+                  printf ("%-10s %-6s %-9s %-7s %3u %12zu %10.1f %9.3f %7.2f %6llu\n", name.c_str (), op.c_str (),
+                          source.c_str (), result.parse.c_str (), threads, result.bytes, result.mean_bps / 1e6,
+                          result.ns_per_byte, 100 * result.stddev_bps / result.mean_bps,
+                          (unsigned long long) result.allocations);
+
+                  // Cases that must not allocate once their storage is set up.
+                  if (source == "view" && result.allocations != 0)
+                    {
+                      fprintf (stderr, "cfa_bench: %s/%s allocated %llu times\n", op.c_str (), source.c_str (),
+                               (unsigned long long) result.allocations);
+                      status = 1;
+                    }
+                }
+            }
+
+          mapped.close ();
+          std::filesystem::remove (temp_path);
+        }
+
+      bench_classify (options);
+
+      if (!options.json_path.empty ())
+        {
+          write_json (options.json_path, results);
+          printf ("\nWrote %s\n", options.json_path.c_str ());
+        }
+      return status;
+    }
+}
+
+int main (int argc, char **argv)
+{
+  return cfa::bench::run (argc, argv);
+}
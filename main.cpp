@@ -1,6 +1,97 @@
 //  main.cpp
 
 #include "src/cfa.h"
+#include "src/batch.h"
+#include "src/classify.h"
+#include "src/follow.h"
+#include "src/generate.h"
+#include "src/serve.h"
+#include "src/shard.h"
+#include "src/window.h"
+
+// Every allocation is counted for `--stats`; with stats off this is one
+// untaken branch in front of malloc. Over-aligned types such as CharMap and
+// ByteHistogram arrive through the align_val_t overloads, so those are
+// replaced too; every delete frees through one out-of-line function, which
+// keeps the compiler from pairing an inlined free() with operator new.
+static void *counted_alloc (size_t size, size_t alignment)
+{
+  utils::stats::add (utils::stats::Counter::Allocations);
+  size = size ? size : 1;
+  void *p = alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__
+            ? std::malloc (size)
+            : std::aligned_alloc (alignment, (size + alignment - 1) / alignment * alignment);
+  if (!p)
+    {
+      throw std::bad_alloc ();
+    }
+  return p;
+}
+
+__attribute__((noinline)) static void counted_free (void *p) noexcept
+{
+  std::free (p);
+}
+
+void *operator new (size_t size)
+{
+  return counted_alloc (size, 0);
+}
+
+void *operator new[] (size_t size)
+{
+  return counted_alloc (size, 0);
+}
+
+void *operator new (size_t size, std::align_val_t alignment)
+{
+  return counted_alloc (size, (size_t) alignment);
+}
+
+void *operator new[] (size_t size, std::align_val_t alignment)
+{
+  return counted_alloc (size, (size_t) alignment);
+}
+
+void operator delete (void *p) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete[] (void *p) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete (void *p, size_t) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete[] (void *p, size_t) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete (void *p, std::align_val_t) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete[] (void *p, std::align_val_t) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete (void *p, size_t, std::align_val_t) noexcept
+{
+  counted_free (p);
+}
+
+void operator delete[] (void *p, size_t, std::align_val_t) noexcept
+{
+  counted_free (p);
+}
 
 int main (int argc, char **argv)
 {
@@ -25,6 +116,43 @@ int main (int argc, char **argv)
                 {
                   cfa::tests::run_test_program ();
                 }
+              else if (comm_arg == "batch")
+                {
+                  // Everything after `-batch` belongs to the batch program.
+                  return cfa::batch::batch_program (argc - i - 1, argv + i + 1);
+                }
+              else if (comm_arg == "follow")
+                {
+                  return cfa::follow::follow_program (argc - i - 1, argv + i + 1);
+                }
+              else if (comm_arg == "window")
+                {
+                  return cfa::window::window_program (argc - i - 1, argv + i + 1);
+                }
+              else if (comm_arg == "merge")
+                {
+                  return cfa::shard::merge_program (argc - i - 1, argv + i + 1);
+                }
+              else if (comm_arg == "serve")
+                {
+                  return cfa::serve::serve_program (argc - i - 1, argv + i + 1);
+                }
+              else if (comm_arg == "client")
+                {
+                  return cfa::serve::client_program (argc - i - 1, argv + i + 1);
+                }
+              else if (comm_arg == "loadtest")
+                {
+                  return cfa::serve::load_test_program (argc - i - 1, argv + i + 1);
+                }
+              else if (comm_arg == "classify")
+                {
+                  return cfa::classify::classify_program (argc - i - 1, argv + i + 1);
+                }
+              else if (comm_arg == "generate")
+                {
+                  return cfa::generate::generate_program (argc - i - 1, argv + i + 1);
+                }
               else
                 {
                   printf ("Could not start program: `%s` not a recognized argument.\n", comm_arg.c_str ());
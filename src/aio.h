@@ -0,0 +1,675 @@
+// src/aio.h
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <thread>
+
+#include "utils.h"
+
+#if defined(__linux__) && defined(UTILS_HAS_MMAP) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define UTILS_HAS_IO_URING 1
+#endif
+#endif
+
+//----------------------------------------------------
+//  [ SECTION AIO ]   Read-ahead input
+//----------------------------------------------------
+
+namespace utils::aio
+{
+    // Reads kept in flight ahead of the consumer.
+    const size_t DEFAULT_DEPTH = 4;
+
+    enum class Backend {
+        Auto,
+        Uring,
+        Thread,
+    };
+
+    struct Buffer {
+        std::vector<char> data;
+        size_t size = 0;
+    };
+
+    class BufferRing;
+    class AsyncReader;
+
+    const char *backend_name (Backend backend);
+}
+
+namespace utils::aio
+{
+    // A fixed set of buffers passed from one producer to one consumer. The
+    // producer fills a free buffer and publishes it; the consumer reads it
+    // and releases it for reuse. Either side blocks only when the other has
+    // fallen a whole ring behind.
+    class BufferRing {
+     public:
+        BufferRing (size_t count, size_t size)
+            : m_buffers (std::max<size_t> (count, 2))
+        {
+          for (auto &buffer: m_buffers)
+            {
+              buffer.data.resize (size);
+            }
+        }
+
+        // Producer: waits for a free buffer.
+        Buffer &acquire ()
+        {
+          std::unique_lock<std::mutex> lock (m_mutex);
+          m_space.wait (lock, [this]
+          { return m_filled < m_buffers.size (); });
+          Buffer &buffer = m_buffers[m_tail];
+          buffer.size = 0;
+          return buffer;
+        }
+
+        // Producer: hands the buffer from `acquire` to the consumer.
+        void publish ()
+        {
+          {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            m_tail = (m_tail + 1) % m_buffers.size ();
+            ++m_filled;
+          }
+          m_data.notify_one ();
+        }
+
+        // Producer: nothing more will be published.
+        void finish ()
+        {
+          {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            m_finished = true;
+          }
+          m_data.notify_one ();
+        }
+
+        // Consumer: waits for the next published buffer, or returns nullptr
+        // once the producer has finished and every buffer was read.
+        const Buffer *next ()
+        {
+          std::unique_lock<std::mutex> lock (m_mutex);
+          m_data.wait (lock, [this]
+          { return m_filled > 0 || m_finished; });
+          return m_filled > 0 ? &m_buffers[m_head] : nullptr;
+        }
+
+        // Consumer: returns the buffer from `next` to the producer.
+        void release ()
+        {
+          {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            m_head = (m_head + 1) % m_buffers.size ();
+            --m_filled;
+          }
+          m_space.notify_one ();
+        }
+
+     private:
+        std::vector<Buffer> m_buffers;
+        std::mutex m_mutex;
+        std::condition_variable m_space;
+        std::condition_variable m_data;
+        size_t m_head = 0;
+        size_t m_tail = 0;
+        size_t m_filled = 0;
+        bool m_finished = false;
+    };
+
+#ifdef UTILS_HAS_IO_URING
+    // The submission and completion rings of one io_uring instance, set up
+    // with the raw system calls so no liburing is needed.
+    class Uring {
+     public:
+        Uring () = default;
+        Uring (const Uring &) = delete;
+        Uring &operator= (const Uring &) = delete;
+
+        ~Uring ()
+        {
+          close ();
+        }
+
+        // Fails where the kernel lacks io_uring or a sandbox forbids it.
+        bool setup (unsigned entries)
+        {
+          io_uring_params params {};
+          m_fd = (int) syscall (__NR_io_uring_setup, entries, &params);
+          if (m_fd < 0)
+            {
+              return false;
+            }
+
+          m_sq_size = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+          m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof (io_uring_cqe);
+          bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+          if (single)
+            {
+              m_sq_size = m_cq_size = std::max (m_sq_size, m_cq_size);
+            }
+          m_sqes_size = params.sq_entries * sizeof (io_uring_sqe);
+
+          m_sq = map (m_sq_size, IORING_OFF_SQ_RING);
+          m_cq = single ? m_sq : map (m_cq_size, IORING_OFF_CQ_RING);
+          m_sqes = (io_uring_sqe *) map (m_sqes_size, IORING_OFF_SQES);
+          if (!m_sq || !m_cq || !m_sqes)
+            {
+              close ();
+              return false;
+            }
+
+          m_sq_tail = (unsigned *) (m_sq + params.sq_off.tail);
+          m_sq_mask = (unsigned *) (m_sq + params.sq_off.ring_mask);
+          m_sq_array = (unsigned *) (m_sq + params.sq_off.array);
+          m_cq_head = (unsigned *) (m_cq + params.cq_off.head);
+          m_cq_tail = (unsigned *) (m_cq + params.cq_off.tail);
+          m_cq_mask = (unsigned *) (m_cq + params.cq_off.ring_mask);
+          m_cqes = (io_uring_cqe *) (m_cq + params.cq_off.cqes);
+          return true;
+        }
+
+        void close ()
+        {
+          if (m_sqes)
+            {
+              munmap (m_sqes, m_sqes_size);
+            }
+          if (m_cq && m_cq != m_sq)
+            {
+              munmap (m_cq, m_cq_size);
+            }
+          if (m_sq)
+            {
+              munmap (m_sq, m_sq_size);
+            }
+          if (m_fd >= 0)
+            {
+              ::close (m_fd);
+            }
+          m_fd = -1;
+          m_sq = m_cq = nullptr;
+          m_sqes = nullptr;
+          m_queued = 0;
+        }
+
+        // Queues a vectored read; `submit` passes it to the kernel.
+        void queue_read (int fd, const iovec *iov, uint64_t offset, uint64_t user_data)
+        {
+          unsigned tail = *m_sq_tail;
+          unsigned index = tail & *m_sq_mask;
+          io_uring_sqe &sqe = m_sqes[index];
+          std::memset (&sqe, 0, sizeof (sqe));
+          sqe.opcode = IORING_OP_READV;
+          sqe.fd = fd;
+          sqe.addr = (uint64_t) (uintptr_t) iov;
+          sqe.len = 1;
+          sqe.off = offset;
+          sqe.user_data = user_data;
+          m_sq_array[index] = index;
+          __atomic_store_n (m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+          ++m_queued;
+        }
+
+        bool submit ()
+        {
+          while (m_queued > 0)
+            {
+              int submitted = enter (m_queued, 0, 0);
+              if (submitted < 0)
+                {
+                  return false;
+                }
+              m_queued -= (unsigned) submitted;
+            }
+          return true;
+        }
+
+        // Reads queued but not yet passed to the kernel.
+        [[nodiscard]] unsigned queued () const
+        {
+          return m_queued;
+        }
+
+        // Waits for the next completion.
+        bool wait (uint64_t &user_data, int &result)
+        {
+          for (;;)
+            {
+              unsigned head = *m_cq_head;
+              if (head != __atomic_load_n (m_cq_tail, __ATOMIC_ACQUIRE))
+                {
+                  const io_uring_cqe &cqe = m_cqes[head & *m_cq_mask];
+                  user_data = cqe.user_data;
+                  result = cqe.res;
+                  __atomic_store_n (m_cq_head, head + 1, __ATOMIC_RELEASE);
+                  return true;
+                }
+              if (enter (0, 1, IORING_ENTER_GETEVENTS) < 0)
+                {
+                  return false;
+                }
+            }
+        }
+
+     private:
+        char *map (size_t size, off_t offset)
+        {
+          void *addr = mmap (nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+          return addr == MAP_FAILED ? nullptr : (char *) addr;
+        }
+
+        int enter (unsigned to_submit, unsigned min_complete, unsigned flags)
+        {
+          for (;;)
+            {
+              int result = (int) syscall (__NR_io_uring_enter, m_fd, to_submit, min_complete, flags, nullptr, 0);
+              if (result >= 0 || errno != EINTR)
+                {
+                  return result;
+                }
+            }
+        }
+
+        int m_fd = -1;
+        char *m_sq = nullptr;
+        char *m_cq = nullptr;
+        io_uring_sqe *m_sqes = nullptr;
+        size_t m_sq_size = 0;
+        size_t m_cq_size = 0;
+        size_t m_sqes_size = 0;
+        unsigned *m_sq_tail = nullptr;
+        unsigned *m_sq_mask = nullptr;
+        unsigned *m_sq_array = nullptr;
+        unsigned *m_cq_head = nullptr;
+        unsigned *m_cq_tail = nullptr;
+        unsigned *m_cq_mask = nullptr;
+        io_uring_cqe *m_cqes = nullptr;
+        unsigned m_queued = 0;
+    };
+#endif
+
+    // Reads a file in blocks with several reads in flight, so the disk (or
+    // the network) works on the next blocks while the caller counts the
+    // current one. Regular files use io_uring where the kernel allows it;
+    // anything else, or a kernel without it, is read ahead by a thread into
+    // a ring of buffers. Blocks come back in file order and stay valid until
+    // the next call to `next`.
+    class AsyncReader {
+     public:
+        explicit AsyncReader (size_t block_size = file::DEFAULT_BLOCK_SIZE, size_t depth = DEFAULT_DEPTH,
+                              Backend backend = Backend::Auto)
+            : m_block_size (block_size > 0 ? block_size : file::DEFAULT_BLOCK_SIZE),
+              m_depth (std::max<size_t> (depth, 2)), m_requested (backend)
+        {
+        }
+
+        AsyncReader (const AsyncReader &) = delete;
+        AsyncReader &operator= (const AsyncReader &) = delete;
+
+        ~AsyncReader ()
+        {
+          close ();
+        }
+
+        bool open (const std::string &filename)
+        {
+          close ();
+#ifdef UTILS_HAS_MMAP
+          stats::Timer timer (stats::Phase::Open);
+          if ((m_fd = ::open (filename.c_str (), O_RDONLY | O_CLOEXEC)) < 0)
+            {
+              return false;
+            }
+#ifdef UTILS_HAS_IO_URING
+          struct stat info {};
+          // Reads are sized from st_size, so files that report 0 yet have
+          // content, as in /proc and /sys, go to the reader thread.
+          if (m_requested != Backend::Thread && fstat (m_fd, &info) == 0 && S_ISREG (info.st_mode)
+              && info.st_size > 0 && start_uring ((uint64_t) info.st_size))
+            {
+              return true;
+            }
+#endif
+          start_thread ();
+          return true;
+#else
+          m_stream.open (filename, std::ios::binary);
+          if (!m_stream.is_open ())
+            {
+              return false;
+            }
+          start_thread ();
+          return true;
+#endif
+        }
+
+        // The next block, or an empty view at the end of the file or after a
+        // read error (see `failed`).
+        std::string_view next ()
+        {
+#ifdef UTILS_HAS_IO_URING
+          if (m_backend == Backend::Uring)
+            {
+              return next_uring ();
+            }
+#endif
+          if (!m_ring)
+            {
+              return {};
+            }
+          if (m_holding)
+            {
+              m_ring->release ();
+              m_holding = false;
+            }
+          stats::Timer timer (stats::Phase::Read);
+          const Buffer *buffer = m_ring->next ();
+          if (!buffer)
+            {
+              return {};
+            }
+          m_holding = true;
+          return {buffer->data.data (), buffer->size};
+        }
+
+        void close ()
+        {
+          if (m_producer.joinable ())
+            {
+              // Let the producer run into the stop flag, then drain what it
+              // already published.
+              m_stop = true;
+              if (m_holding)
+                {
+                  m_ring->release ();
+                }
+              while (m_ring->next ())
+                {
+                  m_ring->release ();
+                }
+              m_producer.join ();
+            }
+          m_ring.reset ();
+          m_holding = false;
+          m_stop = false;
+#ifdef UTILS_HAS_IO_URING
+          if (m_backend == Backend::Uring)
+            {
+              stop_uring ();
+            }
+#endif
+#ifdef UTILS_HAS_MMAP
+          if (m_fd >= 0)
+            {
+              ::close (m_fd);
+              m_fd = -1;
+            }
+#else
+          m_stream.close ();
+#endif
+          m_backend = Backend::Auto;
+          m_failed = false;
+        }
+
+        [[nodiscard]] Backend backend () const
+        {
+          return m_backend;
+        }
+
+        // True when reading stopped early because of an I/O error.
+        [[nodiscard]] bool failed () const
+        {
+          return m_failed;
+        }
+
+        explicit operator bool () const
+        {
+          return m_backend != Backend::Auto;
+        }
+
+     private:
+        void start_thread ()
+        {
+          m_backend = Backend::Thread;
+          m_ring = std::make_unique<BufferRing> (m_depth, m_block_size);
+          m_producer = std::thread ([this]
+                                    {
+                                        for (;;)
+                                          {
+                                            Buffer &buffer = m_ring->acquire ();
+                                            if (m_stop)
+                                              {
+                                                break;
+                                              }
+                                            buffer.size = read_block (buffer.data.data (), buffer.data.size ());
+                                            if (buffer.size == 0)
+                                              {
+                                                break;
+                                              }
+                                            m_ring->publish ();
+                                          }
+                                        m_ring->finish ();
+                                    });
+        }
+
+        // One read on the producer thread; 0 at the end or on an error.
+        size_t read_block (char *buffer, size_t size)
+        {
+          stats::add (stats::Counter::ReadCalls);
+#ifdef UTILS_HAS_MMAP
+          for (;;)
+            {
+              ssize_t result = ::read (m_fd, buffer, size);
+              if (result < 0 && errno == EINTR)
+                {
+                  continue;
+                }
+              m_failed = result < 0;
+              stats::add (stats::Counter::BytesRead, result > 0 ? (uint64_t) result : 0);
+              return result > 0 ? (size_t) result : 0;
+            }
+#else
+          m_stream.read (buffer, (std::streamsize) size);
+          stats::add (stats::Counter::BytesRead, (uint64_t) m_stream.gcount ());
+          return (size_t) m_stream.gcount ();
+#endif
+        }
+
+#ifdef UTILS_HAS_IO_URING
+        // One block of the file and the read that fills it.
+        struct Slot {
+            std::vector<char> buffer;
+            iovec iov {};
+            uint64_t offset = 0;
+            size_t length = 0;
+            size_t filled = 0;
+            bool done = false;
+        };
+
+        bool start_uring (uint64_t size)
+        {
+          if (!m_uring.setup ((unsigned) m_depth))
+            {
+              return false;
+            }
+          m_backend = Backend::Uring;
+          m_file_size = size;
+          m_submit_offset = 0;
+          m_next_slot = 0;
+          m_slots.assign (m_depth, Slot ());
+          for (auto &slot: m_slots)
+            {
+              slot.buffer.resize (m_block_size);
+            }
+          for (auto &slot: m_slots)
+            {
+              queue (slot);
+            }
+          if (!m_uring.submit ())
+            {
+              stop_uring ();
+              return false;
+            }
+          return true;
+        }
+
+        // Waits for the reads the kernel already has, since they write into
+        // the slots, then drops the ring.
+        void stop_uring ()
+        {
+          for (size_t pending = m_in_flight - m_uring.queued (); pending > 0; --pending)
+            {
+              uint64_t slot;
+              int result;
+              if (!m_uring.wait (slot, result))
+                {
+                  break;
+                }
+            }
+          m_uring.close ();
+          m_slots.clear ();
+          m_in_flight = 0;
+          m_backend = Backend::Auto;
+        }
+
+        // Points `slot` at the next block of the file and queues its read.
+        void queue (Slot &slot)
+        {
+          slot.offset = m_submit_offset;
+          slot.length = (size_t) std::min<uint64_t> (m_block_size, m_file_size - m_submit_offset);
+          slot.filled = 0;
+          slot.done = slot.length == 0;
+          m_submit_offset += slot.length;
+          if (!slot.done)
+            {
+              queue_rest (slot);
+            }
+        }
+
+        void queue_rest (Slot &slot)
+        {
+          slot.iov.iov_base = slot.buffer.data () + slot.filled;
+          slot.iov.iov_len = slot.length - slot.filled;
+          m_uring.queue_read (m_fd, &slot.iov, slot.offset + slot.filled, (uint64_t) (&slot - m_slots.data ()));
+          ++m_in_flight;
+        }
+
+        std::string_view next_uring ()
+        {
+          if (m_holding)
+            {
+              // The block handed out last time is done with; reuse its slot
+              // for the next block not yet asked for.
+              m_holding = false;
+              queue (m_slots[m_next_slot]);
+              m_next_slot = (m_next_slot + 1) % m_slots.size ();
+              if (!m_uring.submit ())
+                {
+                  m_failed = true;
+                  return {};
+                }
+            }
+
+          Slot &slot = m_slots[m_next_slot];
+          stats::Timer timer (stats::Phase::Read);
+          while (!slot.done && !m_failed)
+            {
+              uint64_t index;
+              int result;
+              if (!m_uring.wait (index, result))
+                {
+                  m_failed = true;
+                  break;
+                }
+              --m_in_flight;
+              complete (m_slots[index], result);
+            }
+          if (m_failed || slot.filled == 0)
+            {
+              return {};
+            }
+          m_holding = true;
+          return {slot.buffer.data (), slot.filled};
+        }
+
+        void complete (Slot &slot, int result)
+        {
+          stats::add (stats::Counter::ReadCalls);
+          if (result == -EINTR || result == -EAGAIN)
+            {
+              queue_rest (slot);
+              m_failed = !m_uring.submit ();
+              return;
+            }
+          if (result < 0)
+            {
+              m_failed = true;
+              return;
+            }
+
+          stats::add (stats::Counter::BytesRead, (uint64_t) result);
+          slot.filled += (size_t) result;
+          if (result > 0 && slot.filled < slot.length)
+            {
+              // A short read, e.g. from a network filesystem: ask for the rest.
+              queue_rest (slot);
+              m_failed = !m_uring.submit ();
+              return;
+            }
+          // A read of 0 means the file shrank; stop at what was read.
+          slot.done = true;
+          if (slot.filled < slot.length)
+            {
+              m_file_size = m_submit_offset = slot.offset + slot.filled;
+            }
+        }
+
+        Uring m_uring;
+        std::vector<Slot> m_slots;
+        uint64_t m_file_size = 0;
+        uint64_t m_submit_offset = 0;
+        size_t m_next_slot = 0;
+        size_t m_in_flight = 0;
+#endif
+
+        size_t m_block_size;
+        size_t m_depth;
+        Backend m_requested;
+        Backend m_backend = Backend::Auto;
+#ifdef UTILS_HAS_MMAP
+        int m_fd = -1;
+#else
+        std::ifstream m_stream;
+#endif
+        std::unique_ptr<BufferRing> m_ring;
+        std::thread m_producer;
+        std::atomic<bool> m_stop {false};
+        bool m_holding = false;
+        bool m_failed = false;
+    };
+
+    const char *backend_name (Backend backend)
+    {
+      switch (backend)
+        {
+          case Backend::Uring:
+            return "io_uring";
+          case Backend::Thread:
+            return "thread";
+          default:
+            return "auto";
+        }
+    }
+}
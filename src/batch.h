@@ -0,0 +1,565 @@
+// src/batch.h
+
+#pragma once
+
+#include <optional>
+
+#include "cache.h"
+#include "cfa.h"
+#include "ngram.h"
+#include "shard.h"
+#include "sketch.h"
+#include "thread_pool.h"
+#include "utf8.h"
+
+//----------------------------------------------------
+//  [ SECTION BATCH ]   Non-interactive analysis
+//----------------------------------------------------
+
+namespace cfa::batch
+{
+    struct Options {
+        ParseType type = ParseType::Alpha;
+        SortMethod sort = SortMethod::Char_Ascending;
+        bool rank = false;
+        bool utf8 = false;
+        unsigned ngram = 1;
+        size_t top = 0;
+        double epsilon = 1e-4;
+        double delta = 0.01;
+        bool per_file = true;
+        unsigned threads = 0;
+        bool cache = false;
+        std::string cache_path;
+        bool verify_cache = false;
+        std::string save;
+        bool stats = false;
+        bool stats_json = false;
+        bool hardware = false;
+        bool async_io = false;
+        utils::aio::Backend io_backend = utils::aio::Backend::Auto;
+    };
+
+    struct FileResult {
+        std::filesystem::path path;
+        uintmax_t size = 0;
+        CharCounter counter;
+        ByteHistogram bytes;
+        utf8::CodePointCounter code_points;
+        std::optional<ngram::NGramCounter> ngrams;
+        std::optional<sketch::HeavyHitters> hitters;
+        cache::Lookup lookup = cache::Lookup::Uncached;
+        bool ok = false;
+    };
+
+    void print_usage ();
+    bool parse_options (int argc, char **argv, Options &options, std::vector<std::string> &inputs);
+    void analyze_file (FileResult &result, const Options &options, cache::HistogramCache *cache = nullptr);
+    void print_result (const std::string &title, const CharCounter &counter, const Options &options);
+    void print_result (const std::string &title, const utf8::CodePointCounter &counter, const Options &options);
+    void print_result (const std::string &title, const ngram::NGramCounter &counter, const Options &options);
+    void print_result (const std::string &title, const sketch::HeavyHitters &hitters, const Options &options);
+    sketch::HeavyHitters make_heavy_hitters (const Options &options);
+    int batch_program (int argc, char **argv);
+}
+
+namespace cfa::batch
+{
+    void print_usage ()
+    {
+      printf ("Usage: cfa -batch [options] <file|directory|glob>...\n"
+              "\t--type=alpha|digit|symbol|alnum|ascii   (default: alpha)\n"
+              "\t--sort=char|char-desc|value|value-desc|none   (default: char)\n"
+              "\t--rank          print ranks instead of counts\n"
+              "\t--utf8          count UTF-8 code points instead of bytes (ignores --type)\n"
+              "\t--ngram=N       count n-grams of N consecutive accepted characters,\n"
+              "\t                2 to 4, or 2 to 32 with --top\n"
+              "\t--top=K         approximate mode: the K most frequent words, or n-grams\n"
+              "\t                of any length up to 32 with --ngram, in bounded memory\n"
+              "\t--epsilon=E     approximate mode: overestimate at most E * items, 0 < E < 1\n"
+              "\t                (default: 1e-4)\n"
+              "\t--delta=D       approximate mode: ... with probability 1 - D, 0 < D < 1\n"
+              "\t                (default: 0.01)\n"
+              "\t--threads=N     worker threads (default: all cores)\n"
+              "\t--cache[=FILE]  reuse byte counts of unchanged files and scan only what was\n"
+              "\t                appended since the last run (byte counts only)\n"
+              "\t--verify-cache  re-hash cached bytes to catch files rewritten in place\n"
+              "\t--save=FILE     also write the raw byte counts of all files as a histogram\n"
+              "\t                file for `cfa -merge` (byte counts only)\n"
+              "\t--total-only    print only the aggregate over all files\n"
+              "\t--stats[=json]  report time per phase, bytes read and accepted, read calls\n"
+              "\t                and allocations on stderr, as text or JSON\n"
+              "\t--hw-counters   add CPU cycles, instructions, cache and branch misses of\n"
+              "\t                the counting loop to --stats (Linux perf events)\n"
+              "\t--io=mmap|async|uring|thread   map files (default), or read them ahead\n"
+              "\t                asynchronously while counting: io_uring where available,\n"
+              "\t                else a reader thread\n"
+              "gzip and zstd files are decompressed as they are read.\n");
+    }
+
+    bool parse_options (int argc, char **argv, Options &options, std::vector<std::string> &inputs)
+    {
+      bool sorted = false;
+      bool ngram_given = false;
+      for (int i = 0; i < argc; ++i)
+        {
+          std::string arg (argv[i]), key, value;
+          if (!utils::parse_option (arg, key, value))
+            {
+              inputs.push_back (arg);
+              continue;
+            }
+
+          if (key == "type" && parse_type_from_name (value, options.type))
+            {
+              continue;
+            }
+          if (key == "sort" && sort_method_from_name (value, options.sort))
+            {
+              sorted = true;
+              continue;
+            }
+          if (key == "rank")
+            {
+              options.rank = true;
+            }
+          else if (key == "utf8")
+            {
+              options.utf8 = true;
+            }
+          else if (key == "total-only")
+            {
+              options.per_file = false;
+            }
+          else if (key == "ngram" && utils::parse_number (value, options.ngram))
+            {
+              ngram_given = true;
+            }
+          else if (key == "top" && utils::parse_number (value, options.top))
+            {
+              continue;
+            }
+          else if (key == "epsilon" && utils::parse_number (value, options.epsilon)
+                   && options.epsilon > 0 && options.epsilon < 1)
+            {
+              continue;
+            }
+          else if (key == "delta" && utils::parse_number (value, options.delta)
+                   && options.delta > 0 && options.delta < 1)
+            {
+              continue;
+            }
+          else if (key == "threads" && utils::parse_number (value, options.threads))
+            {
+              continue;
+            }
+          else if (key == "cache")
+            {
+              options.cache = true;
+              options.cache_path = value;
+            }
+          else if (key == "verify-cache")
+            {
+              options.verify_cache = true;
+            }
+          else if (key == "save" && !value.empty ())
+            {
+              options.save = value;
+            }
+          else if (key == "stats" && (value.empty () || value == "text" || value == "json"))
+            {
+              options.stats = true;
+              options.stats_json = value == "json";
+            }
+          else if (key == "hw-counters")
+            {
+              options.stats = true;
+              options.hardware = true;
+            }
+          else if (key == "io" && (value == "mmap" || value == "async" || value == "uring" || value == "thread"))
+            {
+              options.async_io = value != "mmap";
+              options.io_backend = value == "uring" ? utils::aio::Backend::Uring
+                                                    : value == "thread" ? utils::aio::Backend::Thread
+                                                                        : utils::aio::Backend::Auto;
+            }
+          else
+            {
+              fprintf (stderr, "cfa: invalid option '%s'\n", arg.c_str ());
+              return false;
+            }
+        }
+
+      // Exact n-grams are limited to what fits a packed key; approximate
+      // results are most useful most frequent first.
+      unsigned max_n = options.top == 0 ? ngram::MAX_N : sketch::MAX_N;
+      if (ngram_given && (options.ngram < ngram::MIN_N || options.ngram > max_n))
+        {
+          fprintf (stderr, "cfa: --ngram must be from %u to %u, or to %u with --top\n", ngram::MIN_N, ngram::MAX_N,
+                   sketch::MAX_N);
+          return false;
+        }
+      if (options.top > 0 && !sorted)
+        {
+          options.sort = SortMethod::Value_Descending;
+        }
+      if (options.top > 0)
+        {
+          size_t bytes = sketch::CountMinSketch::bytes_for (options.epsilon, options.delta);
+          if (bytes > sketch::MAX_SKETCH_BYTES)
+            {
+              fprintf (stderr, "cfa: --epsilon=%g and --delta=%g need a %zu MiB sketch per file, over the %zu MiB limit\n",
+                       options.epsilon, options.delta, bytes >> 20, sketch::MAX_SKETCH_BYTES >> 20);
+              return false;
+            }
+        }
+      if (!options.save.empty () && (options.utf8 || options.top > 0 || options.ngram > 1))
+        {
+          fprintf (stderr, "cfa: --save applies to byte counts only\n");
+          return false;
+        }
+      return !inputs.empty ();
+    }
+
+    sketch::HeavyHitters make_heavy_hitters (const Options &options)
+    {
+      sketch::Item item = options.ngram > 1 ? sketch::Item::NGram : sketch::Item::Word;
+      return {options.type, item, options.ngram, options.top, options.epsilon, options.delta};
+    }
+
+    void analyze_file (FileResult &result, const Options &options, cache::HistogramCache *cache)
+    {
+      utils::file::MappedFile file;
+      if (!file.open (result.path.string ()))
+        {
+          return;
+        }
+
+      // The cache holds counts of the bytes as stored, so compressed files
+      // are always decompressed and counted again.
+      if (cache && compress::is_plain (file) && !options.utf8 && options.top == 0 && options.ngram < 2)
+        {
+          file = utils::file::MappedFile ();
+          ByteHistogram histogram;
+          result.lookup = cache->histogram (result.path, histogram, options.verify_cache);
+          result.counter.feed (histogram);
+          if (!options.save.empty ())
+            {
+              result.bytes = histogram;
+            }
+          result.ok = result.lookup != cache::Lookup::Failed;
+          return;
+        }
+
+      if (options.top > 0)
+        {
+          result.hitters.emplace (make_heavy_hitters (options));
+        }
+      else if (options.ngram > 1)
+        {
+          result.ngrams.emplace (options.type, options.ngram);
+        }
+
+      auto feed = [&result, &options] (const char *data, size_t size)
+      {
+          if (options.utf8)
+            {
+              result.code_points.feed (data, size);
+            }
+          else if (result.hitters)
+            {
+              result.hitters->feed (data, size);
+            }
+          else if (result.ngrams)
+            {
+              result.ngrams->feed (data, size);
+            }
+          else if (!options.save.empty ())
+            {
+              // The typed counts are derived after the whole file is read.
+              result.bytes.feed (data, size);
+            }
+          else
+            {
+              result.counter.feed (data, size);
+            }
+      };
+
+      // Plain files on disk may be read ahead instead of mapped; pipes and
+      // compressed files keep the path below.
+      if (options.async_io && file.is_mapped () && compress::is_plain (file))
+        {
+          file = utils::file::MappedFile ();
+          utils::aio::AsyncReader reader (utils::file::DEFAULT_BLOCK_SIZE, utils::aio::DEFAULT_DEPTH,
+                                          options.io_backend);
+          if (!reader.open (result.path.string ()))
+            {
+              return;
+            }
+          for (std::string_view block = reader.next (); !block.empty (); block = reader.next ())
+            {
+              feed (block.data (), block.size ());
+            }
+          if (reader.failed ())
+            {
+              fprintf (stderr, "cfa: '%s': read error\n", result.path.string ().c_str ());
+              return;
+            }
+        }
+      else
+        {
+          compress::Format format;
+          compress::Status status = compress::feed_file (file, feed, &format);
+          if (status == compress::Status::Unsupported || status == compress::Status::Corrupt)
+            {
+              fprintf (stderr, "cfa: '%s': %s\n", result.path.string ().c_str (),
+                       compress::status_message (status, format));
+              return;
+            }
+        }
+      result.code_points.finish ();
+      if (!options.save.empty ())
+        {
+          result.counter.feed (result.bytes);
+        }
+      if (result.hitters)
+        {
+          result.hitters->break_run ();
+        }
+      result.ok = true;
+    }
+
+    void print_result (const std::string &title, const CharCounter &counter, const Options &options)
+    {
+      printf ("==> %s (%llu bytes) <==", title.c_str (), (unsigned long long) counter.bytes_fed ());
+      if (options.rank)
+        {
+          auto vec = counter.rank_vec ();
+          vec->sort (options.sort);
+          print_char_rank (vec);
+        }
+      else
+        {
+          auto vec = counter.count_vec<uint64_t> ();
+          vec->sort (options.sort);
+          print_char_count (vec);
+        }
+    }
+
+    void print_result (const std::string &title, const utf8::CodePointCounter &counter, const Options &options)
+    {
+      printf ("==> %s (%llu bytes, %llu malformed) <==", title.c_str (), (unsigned long long) counter.bytes_fed (),
+              (unsigned long long) counter.invalid ());
+      if (options.rank)
+        {
+          auto vec = counter.rank_vec ();
+          vec->sort (options.sort);
+          utf8::print_code_point_rank (vec);
+        }
+      else
+        {
+          auto vec = counter.count_vec<uint64_t> ();
+          vec->sort (options.sort);
+          utf8::print_code_point_count (vec);
+        }
+    }
+
+    void print_result (const std::string &title, const ngram::NGramCounter &counter, const Options &options)
+    {
+      printf ("==> %s <==", title.c_str ());
+      if (options.rank)
+        {
+          auto vec = counter.rank_vec ();
+          vec->sort (options.sort);
+          ngram::print_ngram_rank (vec);
+        }
+      else
+        {
+          auto vec = counter.count_vec<uint64_t> ();
+          vec->sort (options.sort);
+          ngram::print_ngram_count (vec);
+        }
+    }
+
+    void print_result (const std::string &title, const sketch::HeavyHitters &hitters, const Options &options)
+    {
+      printf ("==> %s <==", title.c_str ());
+      if (options.rank)
+        {
+          auto vec = hitters.rank_vec ();
+          vec->sort (options.sort);
+          ngram::print_ngram_rank (vec);
+        }
+      else
+        {
+          auto vec = hitters.count_vec<uint64_t> ();
+          vec->sort (options.sort);
+          sketch::print_heavy_hitters (hitters, vec);
+        }
+    }
+
+    int batch_program (int argc, char **argv)
+    {
+      Options options;
+      std::vector<std::string> inputs;
+      if (!parse_options (argc, argv, options, inputs))
+        {
+          print_usage ();
+          return 1;
+        }
+
+      if (options.stats)
+        {
+          utils::stats::enable (options.hardware);
+        }
+
+      std::vector<std::filesystem::path> paths;
+      for (auto &input: inputs)
+        {
+          utils::file::collect_files (input, paths);
+        }
+
+      std::vector<FileResult> results (paths.size ());
+      for (size_t i = 0; i < paths.size (); ++i)
+        {
+          std::error_code error;
+          results[i].path = paths[i];
+          results[i].counter = CharCounter (options.type);
+          if (auto size = std::filesystem::file_size (paths[i], error); !error)
+            {
+              results[i].size = size;
+            }
+        }
+
+      // Largest files first, so no worker is left with a big file at the end.
+      std::vector<FileResult *> schedule;
+      for (auto &result: results)
+        {
+          schedule.push_back (&result);
+        }
+      std::stable_sort (schedule.begin (), schedule.end (), [] (const FileResult *a, const FileResult *b)
+      {
+          return a->size > b->size;
+      });
+
+      std::optional<cache::HistogramCache> cache;
+      if (options.cache)
+        {
+          cache.emplace (options.cache_path.empty () ? cache::default_path () : std::filesystem::path (options.cache_path));
+          cache->load ();
+        }
+
+      {
+        utils::WorkStealingPool pool (resolve_thread_count (options.threads));
+        cache::HistogramCache *shared = cache ? &*cache : nullptr;
+        for (FileResult *result: schedule)
+          {
+            pool.submit ([result, &options, shared]
+                         { analyze_file (*result, options, shared); });
+          }
+        pool.wait ();
+      }
+
+      if (cache)
+        {
+          size_t lookups[5] {};
+          for (auto &result: results)
+            {
+              ++lookups[(int) result.lookup];
+            }
+          fprintf (stderr, "cfa: cache: %zu unchanged, %zu appended, %zu scanned\n",
+                   lookups[(int) cache::Lookup::Hit], lookups[(int) cache::Lookup::Appended],
+                   lookups[(int) cache::Lookup::Scanned] + lookups[(int) cache::Lookup::Uncached]);
+          if (!cache->save ())
+            {
+              fprintf (stderr, "cfa: could not write cache '%s'\n", cache->file ().string ().c_str ());
+            }
+        }
+
+      CharCounter total (options.type);
+      ByteHistogram byte_total;
+      utf8::CodePointCounter code_point_total;
+      ngram::NGramCounter ngram_total (options.type, std::max (options.ngram, ngram::MIN_N));
+      std::optional<sketch::HeavyHitters> hitter_total;
+      if (options.top > 0)
+        {
+          hitter_total.emplace (make_heavy_hitters (options));
+        }
+      size_t analyzed = 0;
+      for (auto &result: results)
+        {
+          if (!result.ok)
+            {
+              fprintf (stderr, "cfa: could not read '%s'\n", result.path.string ().c_str ());
+              continue;
+            }
+          if (options.per_file && options.utf8)
+            {
+              print_result (result.path.string (), result.code_points, options);
+            }
+          else if (options.per_file && result.hitters)
+            {
+              print_result (result.path.string (), *result.hitters, options);
+            }
+          else if (options.per_file && result.ngrams)
+            {
+              print_result (result.path.string (), *result.ngrams, options);
+            }
+          else if (options.per_file)
+            {
+              print_result (result.path.string (), result.counter, options);
+            }
+          total.merge (result.counter);
+          byte_total.merge (result.bytes);
+          code_point_total.merge (result.code_points);
+          if (result.ngrams)
+            {
+              ngram_total.merge (*result.ngrams);
+            }
+          if (result.hitters)
+            {
+              hitter_total->merge (*result.hitters);
+            }
+          ++analyzed;
+        }
+
+      std::string title = "total: " + std::to_string (analyzed) + " files";
+      if (options.utf8)
+        {
+          print_result (title, code_point_total, options);
+        }
+      else if (hitter_total)
+        {
+          print_result (title, *hitter_total, options);
+        }
+      else if (options.ngram > 1)
+        {
+          print_result (title, ngram_total, options);
+        }
+      else
+        {
+          print_result (title, total, options);
+        }
+
+      if (options.stats)
+        {
+          fflush (stdout);
+          utils::stats::print_report (stderr, options.stats_json);
+        }
+
+      if (!options.save.empty ())
+        {
+          shard::Shard shard;
+          shard.counts = byte_total.raw ();
+          shard.bytes = byte_total.bytes_fed ();
+          shard.sources = analyzed;
+          shard.source = "cfa -batch of " + std::to_string (analyzed) + " files";
+          if (!shard::write (options.save, shard))
+            {
+              fprintf (stderr, "cfa: could not write '%s'\n", options.save.c_str ());
+              return 1;
+            }
+        }
+      return analyzed == results.size () ? 0 : 1;
+    }
+}
@@ -0,0 +1,340 @@
+// src/cache.h
+
+#pragma once
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#include "cfa.h"
+
+//----------------------------------------------------
+//  [ SECTION CACHE ]   Persistent histogram cache
+//----------------------------------------------------
+
+namespace cfa::cache
+{
+    const char MAGIC[8] = {'C', 'F', 'A', 'C', 'A', 'C', 'H', 'E'};
+    const uint32_t VERSION = 1;
+
+    // Bytes hashed at the start of a file and just before the cached offset
+    // to notice a file rewritten under the same name.
+    const size_t FINGERPRINT_WINDOW = 1024 * 4;
+
+    // Longest path a record may carry; a longer one marks a corrupt cache.
+#ifdef PATH_MAX
+    const uint32_t MAX_PATH_LENGTH = PATH_MAX;
+#else
+    const uint32_t MAX_PATH_LENGTH = 4096;
+#endif
+
+    enum class Lookup {
+        Hit,
+        Appended,
+        Scanned,
+        Uncached,
+        Failed,
+    };
+
+    class PrefixHash;
+    class HistogramCache;
+
+    std::filesystem::path default_path ();
+    uint64_t fingerprint (const char *data, size_t size);
+}
+
+namespace cfa::cache
+{
+    // Hash of a byte stream that can be saved and continued later, so the
+    // hash of a growing file is extended with just its new bytes. Words are
+    // mixed 8 bytes at a time; a partial word is carried between updates.
+    class PrefixHash {
+     public:
+        void update (const char *data, size_t size)
+        {
+          while (m_pending_size > 0 && size > 0)
+            {
+              m_pending |= (uint64_t) (unsigned char) *data++ << (8 * m_pending_size);
+              --size;
+              if (++m_pending_size == 8)
+                {
+                  m_state = mix (m_state, m_pending);
+                  m_pending = 0;
+                  m_pending_size = 0;
+                }
+            }
+
+          uint64_t state = m_state;
+          for (; size >= 8; data += 8, size -= 8)
+            {
+              uint64_t word;
+              std::memcpy (&word, data, 8);
+              state = mix (state, word);
+            }
+          m_state = state;
+
+          for (; size > 0; --size)
+            {
+              m_pending |= (uint64_t) (unsigned char) *data++ << (8 * m_pending_size++);
+            }
+        }
+
+        [[nodiscard]] uint64_t digest () const
+        {
+          return mix (mix (m_state, m_pending), m_pending_size);
+        }
+
+     private:
+        // The cache stores and restores the raw state.
+        friend class HistogramCache;
+
+        static uint64_t mix (uint64_t state, uint64_t word)
+        {
+          state = (state ^ word) * 0x9E3779B97F4A7C15ull;
+          return state ^ (state >> 29);
+        }
+
+        uint64_t m_state = 0xCBF29CE484222325ull;
+        uint64_t m_pending = 0;
+        uint64_t m_pending_size = 0;
+    };
+
+    // Maps absolute paths to the raw histogram of the bytes they held when
+    // last scanned. A file whose identity and fingerprint still match is
+    // either returned as is or, if it has grown, extended by scanning only
+    // the appended bytes. Lookups may come from several threads at once.
+    class HistogramCache {
+     public:
+        explicit HistogramCache (std::filesystem::path file = default_path ())
+            : m_file (std::move (file))
+        {
+        }
+
+        // Reads the cache file. A missing, foreign or older-version file
+        // leaves the cache empty.
+        bool load ()
+        {
+          std::ifstream in (m_file, std::ios::binary);
+          char magic[sizeof (MAGIC)];
+          uint32_t version = 0, reserved = 0;
+          uint64_t count = 0;
+          in.read (magic, sizeof (magic));
+          in.read ((char *) &version, sizeof (version));
+          in.read ((char *) &reserved, sizeof (reserved));
+          in.read ((char *) &count, sizeof (count));
+          if (!in || std::memcmp (magic, MAGIC, sizeof (MAGIC)) != 0 || version != VERSION)
+            {
+              return false;
+            }
+
+          std::lock_guard<std::mutex> lock (m_mutex);
+          for (uint64_t i = 0; i < count; ++i)
+            {
+              uint32_t length = 0;
+              in.read ((char *) &length, sizeof (length));
+              if (!in || length > MAX_PATH_LENGTH)
+                {
+                  m_records.clear ();
+                  return false;
+                }
+              std::string path (length, '\0');
+              in.read (path.data (), length);
+              Record record;
+              in.read ((char *) &record, sizeof (record));
+              if (!in)
+                {
+                  m_records.clear ();
+                  return false;
+                }
+              m_records[path] = record;
+            }
+          return true;
+        }
+
+        // Writes the cache through a temporary file, so a crash never leaves
+        // a torn cache behind.
+        bool save ()
+        {
+          std::lock_guard<std::mutex> lock (m_mutex);
+          if (!m_dirty)
+            {
+              return true;
+            }
+
+          std::error_code error;
+          if (m_file.has_parent_path ())
+            {
+              std::filesystem::create_directories (m_file.parent_path (), error);
+            }
+          std::filesystem::path temp = m_file;
+          temp += ".tmp";
+          {
+            std::ofstream out (temp, std::ios::binary | std::ios::trunc);
+            uint32_t version = VERSION, reserved = 0;
+            uint64_t count = m_records.size ();
+            out.write (MAGIC, sizeof (MAGIC));
+            out.write ((const char *) &version, sizeof (version));
+            out.write ((const char *) &reserved, sizeof (reserved));
+            out.write ((const char *) &count, sizeof (count));
+            for (auto &[path, record]: m_records)
+              {
+                auto length = (uint32_t) path.size ();
+                out.write ((const char *) &length, sizeof (length));
+                out.write (path.data (), length);
+                out.write ((const char *) &record, sizeof (record));
+              }
+            if (!out)
+              {
+                return false;
+              }
+          }
+          std::filesystem::rename (temp, m_file, error);
+          m_dirty = error.value () != 0;
+          return !m_dirty;
+        }
+
+        // Fills `histogram` with the raw counts of the whole file at `path`,
+        // scanning only what the cache does not cover. With `verify`, the
+        // cached bytes are also re-hashed, which catches rewrites the
+        // fingerprint misses at the cost of reading them again.
+        Lookup histogram (const std::filesystem::path &path, ByteHistogram &histogram, bool verify = false)
+        {
+          std::error_code error;
+          std::string key = std::filesystem::absolute (path, error).lexically_normal ().string ();
+
+          utils::file::MappedFile file;
+          if (!file.open (key))
+            {
+              return Lookup::Failed;
+            }
+
+          utils::file::FileIdentity identity;
+          if (!file.is_mapped () || !utils::file::identify (key, identity))
+            {
+              // Pipes and devices have nothing stable to key on.
+              histogram = get_byte_histogram (file);
+              return Lookup::Uncached;
+            }
+
+          const char *data = file.data ();
+          size_t size = file.size ();
+
+          Record record;
+          bool found;
+          {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            auto it = m_records.find (key);
+            found = it != m_records.end ();
+            if (found)
+              {
+                record = it->second;
+              }
+          }
+
+          found = found && record.identity.device == identity.device && record.identity.inode == identity.inode
+                  && record.offset <= size && fingerprint (data, record.offset) == record.fingerprint;
+          if (found && verify)
+            {
+              PrefixHash hash;
+              hash.update (data, record.offset);
+              found = hash.digest () == restore (record).digest ();
+            }
+
+          // Same length but a new modification time means it was rewritten.
+          if (found && record.offset == size && record.identity.mtime_ns != identity.mtime_ns)
+            {
+              found = false;
+            }
+
+          if (found && record.offset == size)
+            {
+              histogram = ByteHistogram (record.counts, record.offset);
+              return Lookup::Hit;
+            }
+
+          Lookup lookup = found ? Lookup::Appended : Lookup::Scanned;
+          size_t offset = found ? record.offset : 0;
+          PrefixHash hash = found ? restore (record) : PrefixHash ();
+          histogram = found ? ByteHistogram (record.counts, record.offset) : ByteHistogram ();
+
+          histogram.feed (data + offset, size - offset);
+          hash.update (data + offset, size - offset);
+
+          record.identity = identity;
+          record.identity.size = size;
+          record.offset = size;
+          record.fingerprint = fingerprint (data, size);
+          record.hash_state = hash.m_state;
+          record.hash_pending = hash.m_pending;
+          record.hash_pending_size = hash.m_pending_size;
+          record.counts = histogram.raw ();
+          {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            m_records[key] = record;
+            m_dirty = true;
+          }
+          return lookup;
+        }
+
+        [[nodiscard]] const std::filesystem::path &file () const
+        {
+          return m_file;
+        }
+
+     private:
+        // Stored as is; the cache is only ever read back on the same machine.
+        struct Record {
+            utils::file::FileIdentity identity;
+            uint64_t offset = 0;
+            uint64_t fingerprint = 0;
+            uint64_t hash_state = 0;
+            uint64_t hash_pending = 0;
+            uint64_t hash_pending_size = 0;
+            CharMap<uint64_t> counts;
+        };
+
+        static PrefixHash restore (const Record &record)
+        {
+          PrefixHash hash;
+          hash.m_state = record.hash_state;
+          hash.m_pending = record.hash_pending;
+          hash.m_pending_size = record.hash_pending_size;
+          return hash;
+        }
+
+        std::filesystem::path m_file;
+        std::mutex m_mutex;
+        std::unordered_map<std::string, Record> m_records;
+        bool m_dirty = false;
+    };
+
+    // $CFA_CACHE, else the user's cache directory.
+    std::filesystem::path default_path ()
+    {
+      if (const char *path = std::getenv ("CFA_CACHE"); path && *path)
+        {
+          return path;
+        }
+      if (const char *home = std::getenv ("XDG_CACHE_HOME"); home && *home)
+        {
+          return std::filesystem::path (home) / "cfa" / "histograms.cache";
+        }
+      if (const char *home = std::getenv ("HOME"); home && *home)
+        {
+          return std::filesystem::path (home) / ".cache" / "cfa" / "histograms.cache";
+        }
+      return "cfa_histograms.cache";
+    }
+
+    // Hashes the first and the last FINGERPRINT_WINDOW bytes of `size`.
+    uint64_t fingerprint (const char *data, size_t size)
+    {
+      size_t window = std::min (size, FINGERPRINT_WINDOW);
+      PrefixHash head, tail;
+      head.update (data, window);
+      tail.update (data + size - window, window);
+      return head.digest () ^ (tail.digest () * 31) ^ size;
+    }
+}
@@ -1,15 +1,22 @@
 // src/cfa.h
 
+#pragma once
+
 #include <cassert>
 #include <algorithm>
+#include <array>
 #include <vector>
-#include <unordered_map>
 #include <fstream>
 #include <iostream>
 #include <filesystem>
-#include <random>
+#include <string_view>
+#include <thread>
 
 #include "utils.h"
+#include "aio.h"
+#include "simd.h"
+#include "compress.h"
+#include "generate.h"
 
 //----------------------------------------------------//
 //----------------------------------------------------//
@@ -23,6 +30,10 @@ namespace cfa
 {
     const int MAX_STRING_LENGTH = 1024 * 4;
 
+    // Inputs are never split into chunks smaller than this, so small inputs
+    // are not spread over threads that would spend longer starting than counting.
+    const size_t MIN_PARALLEL_CHUNK_SIZE = 1024 * 1024;
+
     enum class SortMethod {
         None = 0,
         Char_Ascending,
@@ -40,6 +51,11 @@ namespace cfa
         Ascii = AlNum | Symbol,
     };
 
+    constexpr unsigned parse_type_classes (ParseType type);
+    const char *parse_type_name (ParseType type);
+    bool parse_type_from_name (const std::string &name, ParseType &type);
+    bool sort_method_from_name (const std::string &name, SortMethod &method);
+
     //--------------------------------------------
     //  [ SECTION TYPES ]
     //--------------------------------------------
@@ -47,39 +63,107 @@ namespace cfa
     template<typename Num>
     struct CharMap;
 
-    template<typename Num>
+    // `Key` is `char` for byte histograms; other engines reuse the same
+    // sorting with wider keys.
+    template<typename Num, typename Key = char>
     struct CharVec;
 
+    class ByteHistogram;
+    class CharCounter;
+
+    //----------------------------------------------------
+    //  [ SECTION FUNCTIONS ]   Value API
+    //----------------------------------------------------
+
+    template<typename Num>
+    CharMap<Num> count_chars (std::string_view str, ParseType type);
+    template<typename Num>
+    void count_chars (std::string_view str, ParseType type, CharMap<Num> &map);
+    CharMap<float> rank_chars (std::string_view str, ParseType type);
+
     //----------------------------------------------------
     //  [ SECTION FUNCTIONS ]   Character Count
     //----------------------------------------------------
 
     template<typename Num>
-    std::unique_ptr <CharMap<Num>> get_char_count_map (std::string &str, ParseType type);
+    std::unique_ptr <CharMap<Num>> get_char_count_map (std::string_view str, ParseType type);
+    template<typename Num>
+    std::unique_ptr <CharMap<Num>> get_char_count_map (std::ifstream &opened_file, ParseType type,
+                                                       size_t block_size = utils::file::DEFAULT_BLOCK_SIZE);
+    template<typename Num>
+    std::unique_ptr <CharMap<Num>> get_char_count_map (utils::file::MappedFile &file, ParseType type,
+                                                       size_t block_size = utils::file::DEFAULT_BLOCK_SIZE);
+    template<typename Num>
+    std::unique_ptr <CharMap<Num>> get_char_count_map (utils::aio::AsyncReader &reader, ParseType type);
+    template<typename Num>
+    std::unique_ptr <CharVec<Num>> get_char_count_vec (std::string_view str, ParseType type);
+    template<typename Num>
+    std::unique_ptr <CharVec<Num>> get_char_count_vec (std::ifstream &opened_file, ParseType type,
+                                                       size_t block_size = utils::file::DEFAULT_BLOCK_SIZE);
+    template<typename Num>
+    std::unique_ptr <CharVec<Num>> get_char_count_vec (utils::file::MappedFile &file, ParseType type,
+                                                       size_t block_size = utils::file::DEFAULT_BLOCK_SIZE);
+    template<typename Num>
+    std::unique_ptr <CharVec<Num>> get_char_count_vec (utils::aio::AsyncReader &reader, ParseType type);
+
+    //----------------------------------------------------
+    //  [ SECTION FUNCTIONS ]   Parallel character count
+    //----------------------------------------------------
+
+    unsigned resolve_thread_count (unsigned threads);
+    template<typename Num>
+    std::unique_ptr <CharMap<Num>> get_char_count_map_parallel (const char *data, size_t size, ParseType type,
+                                                                unsigned threads = 0);
     template<typename Num>
-    std::unique_ptr <CharMap<Num>> get_char_count_map (std::ifstream &opened_file, ParseType type);
+    std::unique_ptr <CharMap<Num>> get_char_count_map_parallel (std::string_view str, ParseType type,
+                                                                unsigned threads = 0);
     template<typename Num>
-    std::unique_ptr <CharVec<Num>> get_char_count_vec (std::string &str, ParseType type);
+    std::unique_ptr <CharMap<Num>> get_char_count_map_parallel (utils::file::MappedFile &file, ParseType type,
+                                                                unsigned threads = 0);
     template<typename Num>
-    std::unique_ptr <CharVec<Num>> get_char_count_vec (std::ifstream &opened_file, ParseType type);
+    std::unique_ptr <CharVec<Num>> get_char_count_vec_parallel (std::string_view str, ParseType type,
+                                                                unsigned threads = 0);
+    template<typename Num>
+    std::unique_ptr <CharVec<Num>> get_char_count_vec_parallel (utils::file::MappedFile &file, ParseType type,
+                                                                unsigned threads = 0);
 
     //----------------------------------------------------
     //  [ SECTION FUNCTIONS ]   Character ranks
     //----------------------------------------------------
 
-    std::unique_ptr <CharMap<float>> get_char_rank_map (std::string &str, ParseType type);
-    std::unique_ptr <CharMap<float>> get_char_rank_map (std::ifstream &opened_file, ParseType type);
-    std::unique_ptr <CharVec<float>> get_char_rank_vec (std::string &str, ParseType type);
-    std::unique_ptr <CharVec<float>> get_char_rank_vec (std::ifstream &opened_file, ParseType type);
+    std::unique_ptr <CharMap<float>> get_char_rank_map (std::string_view str, ParseType type);
+    std::unique_ptr <CharMap<float>> get_char_rank_map (std::ifstream &opened_file, ParseType type,
+                                                        size_t block_size = utils::file::DEFAULT_BLOCK_SIZE);
+    std::unique_ptr <CharMap<float>> get_char_rank_map (utils::file::MappedFile &file, ParseType type,
+                                                        size_t block_size = utils::file::DEFAULT_BLOCK_SIZE);
+    std::unique_ptr <CharMap<float>> get_char_rank_map (utils::aio::AsyncReader &reader, ParseType type);
+    std::unique_ptr <CharVec<float>> get_char_rank_vec (std::string_view str, ParseType type);
+    std::unique_ptr <CharVec<float>> get_char_rank_vec (std::ifstream &opened_file, ParseType type,
+                                                        size_t block_size = utils::file::DEFAULT_BLOCK_SIZE);
+    std::unique_ptr <CharVec<float>> get_char_rank_vec (utils::file::MappedFile &file, ParseType type,
+                                                        size_t block_size = utils::file::DEFAULT_BLOCK_SIZE);
+    std::unique_ptr <CharVec<float>> get_char_rank_vec (utils::aio::AsyncReader &reader, ParseType type);
+
+    //----------------------------------------------------
+    //  [ SECTION FUNCTIONS ]   Byte histograms
+    //----------------------------------------------------
+
+    ByteHistogram get_byte_histogram (std::string_view str);
+    ByteHistogram get_byte_histogram (std::istream &stream, size_t block_size = utils::file::DEFAULT_BLOCK_SIZE);
+    ByteHistogram get_byte_histogram (utils::file::MappedFile &file,
+                                      size_t block_size = utils::file::DEFAULT_BLOCK_SIZE);
+    ByteHistogram get_byte_histogram (utils::aio::AsyncReader &reader);
 
     //----------------------------------------------------
     //  [ SECTION FUNCTIONS ]   Display
     //----------------------------------------------------
 
     void header_prompt ();
+    bool count_compressed (utils::file::MappedFile &file, CharCounter &counter);
     void file_count_program ();
     void file_rank_program ();
     void print_char_count (std::unique_ptr <CharVec<int>> &vec);
+    void print_char_count (std::unique_ptr <CharVec<uint64_t>> &vec);
     void print_char_rank (std::unique_ptr <CharVec<float>> &vec);
 }
 
@@ -95,6 +179,7 @@ namespace cfa::tests
         SortMethod get_sort_method ();
         ParseType get_parse_selection ();
         int get_display_value ();
+        bool prompt_another_view ();
 
         // Tests
         void run_test_program ();
@@ -112,135 +197,314 @@ namespace cfa::tests
 
 namespace cfa
 {
+    // Translates a ParseType into the byte classes the SIMD kernels accept.
+    constexpr unsigned parse_type_classes (ParseType type)
+    {
+      unsigned classes = utils::simd::CLASS_NONE;
+      if ((int) type & (int) ParseType::Alpha)
+        {
+          classes |= utils::simd::CLASS_ALPHA;
+        }
+      if ((int) type & (int) ParseType::Digit)
+        {
+          classes |= utils::simd::CLASS_DIGIT;
+        }
+      if ((int) type & (int) ParseType::Symbol)
+        {
+          classes |= utils::simd::CLASS_SYMBOL;
+        }
+      return classes;
+    }
+
+    const char *parse_type_name (ParseType type)
+    {
+      switch (type)
+        {
+          case ParseType::Alpha:
+            return "alpha";
+          case ParseType::Digit:
+            return "digit";
+          case ParseType::Symbol:
+            return "symbol";
+          case ParseType::AlNum:
+            return "alnum";
+          case ParseType::Ascii:
+            return "ascii";
+          default:
+            return "none";
+        }
+    }
+
+    // Names accepted on the command line, e.g. `--type=alnum`.
+    bool parse_type_from_name (const std::string &name, ParseType &type)
+    {
+      for (ParseType candidate: {ParseType::Alpha, ParseType::Digit, ParseType::Symbol, ParseType::AlNum,
+                                 ParseType::Ascii, ParseType::None})
+        {
+          if (name == parse_type_name (candidate))
+            {
+              type = candidate;
+              return true;
+            }
+        }
+      return false;
+    }
+
+    bool sort_method_from_name (const std::string &name, SortMethod &method)
+    {
+      if (name == "char")
+        {
+          method = SortMethod::Char_Ascending;
+        }
+      else if (name == "char-desc")
+        {
+          method = SortMethod::Char_Descending;
+        }
+      else if (name == "value")
+        {
+          method = SortMethod::Value_Ascending;
+        }
+      else if (name == "value-desc")
+        {
+          method = SortMethod::Value_Descending;
+        }
+      else if (name == "none")
+        {
+          method = SortMethod::None;
+        }
+      else
+        {
+          return false;
+        }
+      return true;
+    }
+
     //--------------------------------------------
     //  [ SECTION TYPES ]
     //--------------------------------------------:w
 
     template<typename Num>
     struct CharMap {
-        std::unordered_map<char, Num> Data;
+        // Dense histogram indexed by the unsigned value of each byte. The table
+        // is only turned into a sparse `CharVec` when results are produced.
+        static constexpr size_t SIZE = 256;
+        alignas (64) std::array<Num, SIZE> Data {};
 
         CharMap<Num> () = default;
 
-        explicit CharMap<Num> (std::unique_ptr <CharMap<Num>> map)
+        explicit CharMap<Num> (const std::unique_ptr <CharMap<Num>> &map)
         {
-          if (this != map)
+          if (map)
             {
-              if (!this)
-                {
-                  this = std::unique_ptr<CharMap<Num>> (new CharMap<Num>);
-                }
-
               this->Data = map->Data;
             }
         }
 
         [[maybe_unused]] void increment (char c)
         {
-          ++Data[c];
+          ++Data[(unsigned char) c];
         }
 
         [[maybe_unused]] void decrement (char c)
         {
-          --Data[c];
+          --Data[(unsigned char) c];
+        }
+
+        [[maybe_unused]] Num get (char c) const
+        {
+          return Data[(unsigned char) c];
         }
 
         void increment_if (char c, ParseType type)
         {
           // Count number of times a particular char is read.
-          if (utils::valid_utf8 (c))
+          const auto &table = utils::simd::FOLD_TABLES[parse_type_classes (type)];
+          if (unsigned char key = table[(unsigned char) c]; key != utils::simd::REJECTED_KEY)
             {
-              switch (type)
+              ++Data[key];
+            }
+        }
+
+        void increment_if (const char *data, size_t size, ParseType type)
+        {
+          utils::stats::Timer timer (utils::stats::Phase::Count);
+          utils::stats::HardwareScope hardware;
+
+          // Pick the specialized loop once per call rather than once per byte.
+          switch (type)
+            {
+              case ParseType::None:
+                break;
+              case ParseType::Alpha:
+                increment_if<ParseType::Alpha> (data, size);
+              break;
+              case ParseType::Digit:
+                increment_if<ParseType::Digit> (data, size);
+              break;
+              case ParseType::Symbol:
+                increment_if<ParseType::Symbol> (data, size);
+              break;
+              case ParseType::AlNum:
+                increment_if<ParseType::AlNum> (data, size);
+              break;
+              case ParseType::Ascii:
+                increment_if<ParseType::Ascii> (data, size);
+              break;
+            }
+        }
+
+        template<ParseType Type>
+        void increment_if (const char *data, size_t size)
+        {
+          constexpr unsigned classes = parse_type_classes (Type);
+          if constexpr (classes != utils::simd::CLASS_NONE)
+            {
+              // Rejected bytes all land in one slot that is put back
+              // afterwards, which keeps the counting loops free of branches.
+              Num rejected = Data[utils::simd::REJECTED_KEY];
+              size_t total = size;
+
+              bool scalar = utils::simd::active_isa () == utils::simd::Isa::Scalar;
+              if (scalar && size < utils::simd::COUNT_BANKED_MIN)
                 {
-                  case ParseType::None:
-                    break;
-                  case ParseType::Alpha:
-                    if (std::isalpha (c))
-                      {
-                        c = (char) std::toupper (c);
-                        increment (c);
-                      }
-                  break;
-                  case ParseType::Digit:
-                    if (std::isdigit (c))
-                      {
-                        increment (c);
-                      }
-                  break;
-                  case ParseType::Symbol:
-                    if (!std::isalnum (c))
-                      {
-                        increment (c);
-                      }
-                  break;
-                  case ParseType::AlNum:
-                    if (std::isalnum (c))
-                      {
-                        if (std::isalpha (c))
-                          {
-                            c = (char) std::toupper (c);
-                          }
-                        increment (c);
-                      }
-                  break;
-                  case ParseType::Ascii:
-                    if (std::isalpha (c))
-                      {
-                        c = (char) std::toupper (c);
-                      }
-                  increment (c);
-                  break;
+                  constexpr const auto &table = utils::simd::FOLD_TABLES[classes];
+                  for (size_t i = 0; i < size; ++i)
+                    {
+                      ++Data[table[(unsigned char) data[i]]];
+                    }
                 }
+              else if (scalar)
+                {
+                  utils::simd::KeyCounter counter;
+                  counter.add (data, size, utils::simd::FOLD_TABLES[classes], Data.data ());
+                  counter.flush (Data.data ());
+                }
+              else if (size < utils::simd::COUNT_BANKED_MIN)
+                {
+                  // Classify and case-fold a block with the vector kernel,
+                  // then count the keys.
+                  alignas (64) unsigned char keys[utils::simd::FOLD_BLOCK_SIZE];
+                  while (size > 0)
+                    {
+                      size_t length = std::min (size, sizeof (keys));
+                      utils::simd::fold (data, keys, length, classes);
+                      for (size_t i = 0; i < length; ++i)
+                        {
+                          ++Data[keys[i]];
+                        }
+                      data += length;
+                      size -= length;
+                    }
+                }
+              else
+                {
+                  alignas (64) unsigned char keys[utils::simd::FOLD_BLOCK_SIZE];
+                  utils::simd::KeyCounter counter;
+                  while (size > 0)
+                    {
+                      size_t length = std::min (size, sizeof (keys));
+                      utils::simd::fold (data, keys, length, classes);
+                      counter.add (keys, length, Data.data ());
+                      data += length;
+                      size -= length;
+                    }
+                  counter.flush (Data.data ());
+                }
+
+              utils::stats::add (utils::stats::Counter::BytesCounted, total);
+              utils::stats::add (utils::stats::Counter::BytesAccepted,
+                                 total - (uint64_t) (Data[utils::simd::REJECTED_KEY] - rejected));
+              Data[utils::simd::REJECTED_KEY] = rejected;
+            }
+        }
+
+        // Adds the counts of `other` into this map.
+        template<typename Other>
+        void merge (const CharMap<Other> &other)
+        {
+          for (size_t i = 0; i < SIZE; ++i)
+            {
+              Data[i] += (Num) other.Data[i];
             }
         }
 
-        std::unique_ptr <CharMap<Num>> ranks_to_map ()
+        // Counts normalized by their sum, by value.
+        [[nodiscard]] CharMap<float> ranks () const
         {
-          CharMap<Num> tmp (*this);
+          CharMap<float> map;
 
           // We use _sum_ to normalize the results.
-          [[maybe_unused]] float sum = 0;
-          for ([[maybe_unused]] auto &[c, n]: tmp.Data)
+          double sum = 0;
+          for (Num n: Data)
             {
-              sum += n;
+              sum += (double) n;
             }
 
-          for ([[maybe_unused]] auto &[c, n]: tmp.Data)
+          for (size_t i = 0; i < SIZE; ++i)
             {
-              tmp.Data[c] = n / (float) sum;
+              map.Data[i] = sum > 0 ? (float) ((double) Data[i] / sum) : (float) Data[i];
             }
+          return map;
+        }
 
-          return std::make_unique<CharMap<Num>> (tmp);
+        // Replaces the contents of `vec` with the non-zero slots. A vector that
+        // is reused keeps its capacity, so this does not allocate after the
+        // first call.
+        void copy_to (CharVec<Num> &vec) const
+        {
+          utils::stats::Timer timer (utils::stats::Phase::Copy);
+          vec.Data.clear ();
+          for (size_t i = 0; i < SIZE; ++i)
+            {
+              if (Data[i] != 0)
+                {
+                  vec.emplace_back ((char) i, Data[i]);
+                }
+            }
         }
 
-        std::unique_ptr <CharVec<Num>> ranks_to_vec ()
+        std::unique_ptr <CharMap<Num>> ranks_to_map () const
         {
-          return ranks_to_map ()->copy_to_vec ();
+          auto map = std::make_unique<CharMap<Num>> ();
+          map->merge (ranks ());
+          return map;
         }
 
-        std::unique_ptr <CharVec<Num>> copy_to_vec ()
+        std::unique_ptr <CharVec<Num>> ranks_to_vec () const
         {
-          CharVec<Num> vec;
-          for ([[maybe_unused]] auto pair: Data)
-            {
-              vec.emplace_back (pair);
-            }
+          auto vec = std::make_unique<CharVec<Num>> ();
+          CharMap<Num> map;
+          map.merge (ranks ());
+          map.copy_to (*vec);
+          return vec;
+        }
 
-          return std::make_unique<CharVec<Num>> (vec);
+        std::unique_ptr <CharVec<Num>> copy_to_vec () const
+        {
+          // Only the slots that were touched make it into the vector.
+          auto vec = std::make_unique<CharVec<Num>> ();
+          copy_to (*vec);
+          return vec;
         }
     };
 
-    template<typename Num>
+    template<typename Num, typename Key>
     struct CharVec {
-        std::vector <std::pair<char, Num>> Data;
+        std::vector <std::pair<Key, Num>> Data;
 
-        void emplace_back (std::pair<const char, Num> &pair)
+        void emplace_back (std::pair<const Key, Num> &pair)
         {
           Data.emplace_back (pair);
         }
 
+        void emplace_back (Key c, Num n)
+        {
+          Data.emplace_back (c, n);
+        }
+
         void sort (SortMethod method)
         {
+          utils::stats::Timer timer (utils::stats::Phase::Sort);
           for (;;)
             {
               switch (method)
@@ -267,7 +531,7 @@ namespace cfa
         {
           // Sort in ascending order
           std::sort (Data.begin (), Data.end (), [&]
-              (const std::pair<char, Num> &a, const std::pair<char, Num> &b)
+              (const std::pair<Key, Num> &a, const std::pair<Key, Num> &b)
           {
               return a.first < b.first;
           });
@@ -277,7 +541,7 @@ namespace cfa
         {
           // Sort in descending order
           std::sort (Data.begin (), Data.end (), [&]
-              (const std::pair<char, Num> &a, const std::pair<char, Num> &b)
+              (const std::pair<Key, Num> &a, const std::pair<Key, Num> &b)
           {
               return a.first > b.first;
           });
@@ -287,7 +551,7 @@ namespace cfa
         {
           // Sort in ascending order
           std::sort (Data.begin (), Data.end (), [&]
-              (const std::pair<char, Num> &a, const std::pair<char, Num> &b)
+              (const std::pair<Key, Num> &a, const std::pair<Key, Num> &b)
           {
               return a.second < b.second;
           });
@@ -297,81 +561,581 @@ namespace cfa
         {
           // Sort in descending order
           std::sort (Data.begin (), Data.end (), [&]
-              (const std::pair<char, Num> &a, const std::pair<char, Num> &b)
+              (const std::pair<Key, Num> &a, const std::pair<Key, Num> &b)
           {
               return a.second > b.second;
           });
         }
     };
 
+    // Raw counts of all 256 byte values. Every ParseType is a fixed mapping
+    // of bytes to keys, so the counts and ranks of any number of ParseTypes
+    // can be derived from one scan without touching the input again.
+    class ByteHistogram {
+     public:
+        ByteHistogram () = default;
+
+        // Resumes from counts saved earlier, e.g. in a cache.
+        ByteHistogram (const CharMap<uint64_t> &counts, uint64_t bytes)
+            : m_counts (counts), m_bytes (bytes)
+        {
+        }
+
+        // Instrumented like CharMap::increment_if. A raw histogram keeps
+        // every byte, so all of them count as accepted; a ParseType is only
+        // applied to the 256 totals afterwards.
+        void feed (const char *data, size_t size)
+        {
+          utils::stats::Timer timer (utils::stats::Phase::Count);
+          utils::stats::HardwareScope hardware;
+
+          auto *p = (const unsigned char *) data;
+          if (size < utils::simd::COUNT_BANKED_MIN)
+            {
+              for (size_t i = 0; i < size; ++i)
+                {
+                  ++m_counts.Data[p[i]];
+                }
+            }
+          else
+            {
+              utils::simd::KeyCounter counter;
+              counter.add (p, size, m_counts.Data.data ());
+              counter.flush (m_counts.Data.data ());
+            }
+          m_bytes += size;
+          utils::stats::add (utils::stats::Counter::BytesCounted, size);
+          utils::stats::add (utils::stats::Counter::BytesAccepted, size);
+        }
+
+        void feed (std::string_view str)
+        {
+          feed (str.data (), str.size ());
+        }
+
+        // Reads `stream` from its current position until it is exhausted.
+        size_t feed (std::istream &stream, size_t block_size = utils::file::DEFAULT_BLOCK_SIZE)
+        {
+          utils::file::BlockReader reader (block_size);
+          size_t total = 0;
+          while (size_t size = reader.read (stream))
+            {
+              feed (reader.data (), size);
+              total += size;
+            }
+          return total;
+        }
+
+        // Reads the rest of an opened asynchronous reader.
+        size_t feed (utils::aio::AsyncReader &reader)
+        {
+          size_t total = 0;
+          for (std::string_view block = reader.next (); !block.empty (); block = reader.next ())
+            {
+              feed (block.data (), block.size ());
+              total += block.size ();
+            }
+          return total;
+        }
+
+        void merge (const ByteHistogram &other)
+        {
+          m_counts.merge (other.m_counts);
+          m_bytes += other.m_bytes;
+        }
+
+        void reset ()
+        {
+          m_counts = CharMap<uint64_t> ();
+          m_bytes = 0;
+        }
+
+        [[nodiscard]] uint64_t bytes_fed () const
+        {
+          return m_bytes;
+        }
+
+        [[nodiscard]] const CharMap<uint64_t> &raw () const
+        {
+          return m_counts;
+        }
+
+        // The counts `get_char_count_map` would produce for `type`.
+        template<typename Num>
+        [[nodiscard]] CharMap<Num> view (ParseType type) const
+        {
+          CharMap<Num> map;
+          const auto &table = utils::simd::FOLD_TABLES[parse_type_classes (type)];
+          for (size_t c = 0; c < CharMap<Num>::SIZE; ++c)
+            {
+              map.Data[table[c]] += (Num) m_counts.Data[c];
+            }
+          map.Data[utils::simd::REJECTED_KEY] = 0;
+          return map;
+        }
+
+        [[nodiscard]] CharMap<float> rank_view (ParseType type) const
+        {
+          return view<uint64_t> (type).ranks ();
+        }
+
+        template<typename Num>
+        std::unique_ptr <CharVec<Num>> count_vec (ParseType type) const
+        {
+          auto vec = std::make_unique<CharVec<Num>> ();
+          view<Num> (type).copy_to (*vec);
+          return vec;
+        }
+
+        std::unique_ptr <CharVec<float>> rank_vec (ParseType type) const
+        {
+          auto vec = std::make_unique<CharVec<float>> ();
+          rank_view (type).copy_to (*vec);
+          return vec;
+        }
+
+     private:
+        CharMap<uint64_t> m_counts;
+        uint64_t m_bytes = 0;
+    };
+
+    // Accumulates counts over any number of buffers fed in order, e.g. from a
+    // socket, a pipe or a decompressor. The state is a single fixed-size
+    // histogram, so memory does not grow with the length of the stream, and
+    // snapshots can be taken at any point without disturbing it.
+    class CharCounter {
+     public:
+        explicit CharCounter (ParseType type = ParseType::Ascii)
+            : m_type (type)
+        {
+        }
+
+        void feed (const char *data, size_t size)
+        {
+          m_counts.increment_if (data, size, m_type);
+          m_bytes += size;
+        }
+
+        void feed (std::string_view str)
+        {
+          feed (str.data (), str.size ());
+        }
+
+        // Adds a histogram of bytes counted elsewhere, e.g. loaded from a cache.
+        void feed (const ByteHistogram &histogram)
+        {
+          m_counts.merge (histogram.view<uint64_t> (m_type));
+          m_bytes += histogram.bytes_fed ();
+        }
+
+        // Reads `stream` from its current position until it is exhausted. The
+        // stream is neither rewound nor closed. Returns the number of bytes read.
+        size_t feed (std::istream &stream, size_t block_size = utils::file::DEFAULT_BLOCK_SIZE)
+        {
+          utils::file::BlockReader reader (block_size);
+          size_t total = 0;
+          while (size_t size = reader.read (stream))
+            {
+              feed (reader.data (), size);
+              total += size;
+            }
+          return total;
+        }
+
+        // Reads the rest of an opened asynchronous reader, which is left at
+        // its end. Returns the number of bytes read.
+        size_t feed (utils::aio::AsyncReader &reader)
+        {
+          size_t total = 0;
+          for (std::string_view block = reader.next (); !block.empty (); block = reader.next ())
+            {
+              feed (block.data (), block.size ());
+              total += block.size ();
+            }
+          return total;
+        }
+
+        // Adds the counts of another accumulator using the same ParseType.
+        void merge (const CharCounter &other)
+        {
+          assert (m_type == other.m_type);
+
+          m_counts.merge (other.m_counts);
+          m_bytes += other.m_bytes;
+        }
+
+        void reset ()
+        {
+          m_counts = CharMap<uint64_t> ();
+          m_bytes = 0;
+        }
+
+        [[nodiscard]] ParseType type () const
+        {
+          return m_type;
+        }
+
+        // Total bytes fed so far, accepted or not.
+        [[nodiscard]] uint64_t bytes_fed () const
+        {
+          return m_bytes;
+        }
+
+        [[nodiscard]] const CharMap<uint64_t> &counts () const
+        {
+          return m_counts;
+        }
+
+        template<typename Num>
+        std::unique_ptr <CharMap<Num>> count_map () const
+        {
+          std::unique_ptr <CharMap<Num>> char_map (new CharMap<Num>);
+          char_map->merge (m_counts);
+          return char_map;
+        }
+
+        template<typename Num>
+        std::unique_ptr <CharVec<Num>> count_vec () const
+        {
+          auto vec = std::make_unique<CharVec<Num>> ();
+          CharMap<Num> map;
+          map.merge (m_counts);
+          map.copy_to (*vec);
+          return vec;
+        }
+
+        std::unique_ptr <CharMap<float>> rank_map () const
+        {
+          return std::make_unique<CharMap<float>> (m_counts.ranks ());
+        }
+
+        std::unique_ptr <CharVec<float>> rank_vec () const
+        {
+          auto vec = std::make_unique<CharVec<float>> ();
+          m_counts.ranks ().copy_to (*vec);
+          return vec;
+        }
+
+     private:
+        ParseType m_type;
+        CharMap<uint64_t> m_counts;
+        uint64_t m_bytes = 0;
+    };
+
+    //----------------------------------------------------
+    //  [ SECTION FUNCTIONS ]   Value API
+    //----------------------------------------------------
+
+    // The histogram lives in the returned value, so counting a string never
+    // touches the heap.
+    template<typename Num>
+    CharMap<Num> count_chars (std::string_view str, ParseType type)
+    {
+      CharMap<Num> map;
+      map.increment_if (str.data (), str.size (), type);
+      return map;
+    }
+
+    // Adds the counts of `str` to a caller-owned map.
+    template<typename Num>
+    void count_chars (std::string_view str, ParseType type, CharMap<Num> &map)
+    {
+      map.increment_if (str.data (), str.size (), type);
+    }
+
+    CharMap<float> rank_chars (std::string_view str, ParseType type)
+    {
+      return count_chars<uint64_t> (str, type).ranks ();
+    }
+
     //----------------------------------------------------
     //  [ SECTION FUNCTIONS ]   Character Count
     //----------------------------------------------------
 
     template<typename Num>
-    std::unique_ptr <CharMap<Num>> get_char_count_map (std::string &str, ParseType type)
+    std::unique_ptr <CharMap<Num>> get_char_count_map (std::string_view str, ParseType type)
     {
       std::unique_ptr <CharMap<Num>> char_map (new CharMap<Num>);
 
-      for (char c: str)
-        {
-          char_map->increment_if (c, type);
-        }
+      count_chars (str, type, *char_map);
       return char_map;
     }
 
     template<typename Num>
-    std::unique_ptr <CharMap<Num>> get_char_count_map (std::ifstream &opened_file, ParseType type)
+    std::unique_ptr <CharMap<Num>> get_char_count_map (std::ifstream &opened_file, ParseType type, size_t block_size)
     {
       assert (opened_file.is_open ());
 
       std::unique_ptr <CharMap<Num>> char_map (new CharMap<Num>);
+      utils::file::BlockReader reader (block_size);
 
+      // Count whole blocks at a time; `read` stops at the last real byte, so
+      // nothing past the end of the file is ever counted. The file is left
+      // open, so it can be counted again.
+      opened_file.clear ();
       opened_file.seekg (0);
-      while (!opened_file.eof ())
+      while (size_t size = reader.read (opened_file))
+        {
+          char_map->increment_if (reader.data (), size, type);
+        }
+
+      return char_map;
+    }
+
+    template<typename Num>
+    std::unique_ptr <CharMap<Num>> get_char_count_map (utils::file::MappedFile &file, ParseType type, size_t block_size)
+    {
+      assert (file.is_open ());
+
+      std::unique_ptr <CharMap<Num>> char_map (new CharMap<Num>);
+
+      if (file.is_mapped ())
+        {
+          // Count straight out of the mapping, no copies.
+          char_map->increment_if (file.data (), file.size (), type);
+        }
+      else
+        {
+          utils::file::BlockReader reader (block_size);
+          while (size_t size = reader.read (file))
+            {
+              char_map->increment_if (reader.data (), size, type);
+            }
+        }
+
+      return char_map;
+    }
+
+    // Counts what is left of `reader`; blocks are counted as they arrive,
+    // while the following ones are still being read.
+    template<typename Num>
+    std::unique_ptr <CharMap<Num>> get_char_count_map (utils::aio::AsyncReader &reader, ParseType type)
+    {
+      assert (reader);
+
+      std::unique_ptr <CharMap<Num>> char_map (new CharMap<Num>);
+      for (std::string_view block = reader.next (); !block.empty (); block = reader.next ())
         {
-          char c = (char) opened_file.get ();
-          char_map->increment_if (c, type);
+          char_map->increment_if (block.data (), block.size (), type);
         }
-      opened_file.close ();
 
       return char_map;
     }
 
     template<typename Num>
-    std::unique_ptr <CharVec<Num>> get_char_count_vec (std::string &str, ParseType type)
+    std::unique_ptr <CharVec<Num>> get_char_count_vec (std::string_view str, ParseType type)
     {
-      return get_char_count_map<Num> (str, type)->copy_to_vec ();
+      auto vec = std::make_unique<CharVec<Num>> ();
+      count_chars<Num> (str, type).copy_to (*vec);
+      return vec;
+    }
 
+    template<typename Num>
+    std::unique_ptr <CharVec<Num>> get_char_count_vec (std::ifstream &opened_file, ParseType type, size_t block_size)
+    {
+      return get_char_count_map<Num> (opened_file, type, block_size)->copy_to_vec ();
+    }
+
+    template<typename Num>
+    std::unique_ptr <CharVec<Num>> get_char_count_vec (utils::file::MappedFile &file, ParseType type, size_t block_size)
+    {
+      return get_char_count_map<Num> (file, type, block_size)->copy_to_vec ();
     }
+
     template<typename Num>
-    std::unique_ptr <CharVec<Num>> get_char_count_vec (std::ifstream &opened_file, ParseType type)
+    std::unique_ptr <CharVec<Num>> get_char_count_vec (utils::aio::AsyncReader &reader, ParseType type)
     {
-      return get_char_count_map<Num> (opened_file, type)->copy_to_vec ();
+      return get_char_count_map<Num> (reader, type)->copy_to_vec ();
+    }
+
+    //----------------------------------------------------
+    //  [ SECTION FUNCTIONS ]   Parallel character count
+    //----------------------------------------------------
+
+    unsigned resolve_thread_count (unsigned threads)
+    {
+      if (threads == 0)
+        {
+          threads = std::thread::hardware_concurrency ();
+        }
+      return threads > 0 ? threads : 1;
+    }
+
+    template<typename Num>
+    std::unique_ptr <CharMap<Num>> get_char_count_map_parallel (const char *data, size_t size, ParseType type,
+                                                                unsigned threads)
+    {
+      size_t max_chunks = std::max<size_t> (1, size / MIN_PARALLEL_CHUNK_SIZE);
+      size_t chunks = std::min<size_t> (resolve_thread_count (threads), max_chunks);
+      size_t chunk_size = (size + chunks - 1) / std::max<size_t> (chunks, 1);
+
+      // Every chunk gets its own histogram, so the workers never touch shared
+      // counters. The 64-bit partial counts keep the reduction exact.
+      std::vector <CharMap<uint64_t>> partials (chunks);
+      std::vector <std::thread> workers;
+      workers.reserve (chunks);
+
+      for (size_t i = 1; i < chunks; ++i)
+        {
+          size_t begin = std::min (i * chunk_size, size);
+          size_t length = std::min (chunk_size, size - begin);
+          workers.emplace_back ([&partials, data, begin, length, type, i]
+                                {
+                                    partials[i].increment_if (data + begin, length, type);
+                                });
+        }
+
+      // The calling thread takes the first chunk rather than sitting idle.
+      partials[0].increment_if (data, std::min (chunk_size, size), type);
+
+      for (auto &worker: workers)
+        {
+          worker.join ();
+        }
+
+      std::unique_ptr <CharMap<Num>> char_map (new CharMap<Num>);
+      CharMap<uint64_t> total;
+      for (auto &partial: partials)
+        {
+          total.merge (partial);
+        }
+      char_map->merge (total);
+
+      return char_map;
+    }
+
+    template<typename Num>
+    std::unique_ptr <CharMap<Num>> get_char_count_map_parallel (std::string_view str, ParseType type, unsigned threads)
+    {
+      return get_char_count_map_parallel<Num> (str.data (), str.size (), type, threads);
+    }
+
+    template<typename Num>
+    std::unique_ptr <CharMap<Num>> get_char_count_map_parallel (utils::file::MappedFile &file, ParseType type,
+                                                                unsigned threads)
+    {
+      assert (file.is_open ());
+
+      if (!file.is_mapped ())
+        {
+          // A stream can only be consumed in order.
+          return get_char_count_map<Num> (file, type);
+        }
+      return get_char_count_map_parallel<Num> (file.data (), file.size (), type, threads);
+    }
+
+    template<typename Num>
+    std::unique_ptr <CharVec<Num>> get_char_count_vec_parallel (std::string_view str, ParseType type, unsigned threads)
+    {
+      return get_char_count_map_parallel<Num> (str, type, threads)->copy_to_vec ();
+    }
+
+    template<typename Num>
+    std::unique_ptr <CharVec<Num>> get_char_count_vec_parallel (utils::file::MappedFile &file, ParseType type,
+                                                                unsigned threads)
+    {
+      return get_char_count_map_parallel<Num> (file, type, threads)->copy_to_vec ();
     }
 
     //----------------------------------------------------
     //  [ SECTION FUNCTIONS ]   Character ranks
     //----------------------------------------------------
 
-    std::unique_ptr <CharMap<float>> get_char_rank_map (std::string &str, ParseType type)
+    std::unique_ptr <CharMap<float>> get_char_rank_map (std::string_view str, ParseType type)
+    {
+      return std::make_unique<CharMap<float>> (rank_chars (str, type));
+    }
+
+    std::unique_ptr <CharMap<float>> get_char_rank_map (std::ifstream &opened_file, ParseType type, size_t block_size)
+    {
+      return std::make_unique<CharMap<float>> (get_char_count_map<uint64_t> (opened_file, type, block_size)->ranks ());
+    }
+
+    std::unique_ptr <CharMap<float>> get_char_rank_map (utils::file::MappedFile &file, ParseType type, size_t block_size)
     {
-      return get_char_count_map<float> (str, type)->ranks_to_map ();
+      return std::make_unique<CharMap<float>> (get_char_count_map<uint64_t> (file, type, block_size)->ranks ());
     }
 
-    std::unique_ptr <CharMap<float>> get_char_rank_map (std::ifstream &opened_file, ParseType type)
+    std::unique_ptr <CharMap<float>> get_char_rank_map (utils::aio::AsyncReader &reader, ParseType type)
     {
-      return get_char_count_map<float> (opened_file, type)->ranks_to_map ();
+      return std::make_unique<CharMap<float>> (get_char_count_map<uint64_t> (reader, type)->ranks ());
     }
 
-    std::unique_ptr <CharVec<float>> get_char_rank_vec (std::string &str, ParseType type)
+    std::unique_ptr <CharVec<float>> get_char_rank_vec (std::string_view str, ParseType type)
     {
-      return get_char_count_map<float> (str, type)->ranks_to_vec ();
+      auto vec = std::make_unique<CharVec<float>> ();
+      rank_chars (str, type).copy_to (*vec);
+      return vec;
     }
 
-    std::unique_ptr <CharVec<float>> get_char_rank_vec (std::ifstream &opened_file, ParseType type)
+    std::unique_ptr <CharVec<float>> get_char_rank_vec (std::ifstream &opened_file, ParseType type, size_t block_size)
     {
-      return get_char_count_map<float> (opened_file, type)->ranks_to_vec ();
+      auto vec = std::make_unique<CharVec<float>> ();
+      get_char_count_map<uint64_t> (opened_file, type, block_size)->ranks ().copy_to (*vec);
+      return vec;
+    }
+
+    std::unique_ptr <CharVec<float>> get_char_rank_vec (utils::file::MappedFile &file, ParseType type, size_t block_size)
+    {
+      auto vec = std::make_unique<CharVec<float>> ();
+      get_char_count_map<uint64_t> (file, type, block_size)->ranks ().copy_to (*vec);
+      return vec;
+    }
+
+    std::unique_ptr <CharVec<float>> get_char_rank_vec (utils::aio::AsyncReader &reader, ParseType type)
+    {
+      auto vec = std::make_unique<CharVec<float>> ();
+      get_char_count_map<uint64_t> (reader, type)->ranks ().copy_to (*vec);
+      return vec;
+    }
+
+    //----------------------------------------------------
+    //  [ SECTION FUNCTIONS ]   Byte histograms
+    //----------------------------------------------------
+
+    ByteHistogram get_byte_histogram (std::string_view str)
+    {
+      ByteHistogram histogram;
+      histogram.feed (str);
+      return histogram;
+    }
+
+    ByteHistogram get_byte_histogram (std::istream &stream, size_t block_size)
+    {
+      ByteHistogram histogram;
+      stream.clear ();
+      stream.seekg (0);
+      histogram.feed (stream, block_size);
+      return histogram;
+    }
+
+    ByteHistogram get_byte_histogram (utils::file::MappedFile &file, size_t block_size)
+    {
+      assert (file.is_open ());
+
+      ByteHistogram histogram;
+      if (file.is_mapped ())
+        {
+          histogram.feed (file.data (), file.size ());
+        }
+      else
+        {
+          utils::file::BlockReader reader (block_size);
+          while (size_t size = reader.read (file))
+            {
+              histogram.feed (reader.data (), size);
+            }
+        }
+      return histogram;
+    }
+
+    ByteHistogram get_byte_histogram (utils::aio::AsyncReader &reader)
+    {
+      assert (reader);
+
+      ByteHistogram histogram;
+      histogram.feed (reader);
+      return histogram;
     }
 
     //----------------------------------------------------
@@ -385,6 +1149,20 @@ namespace cfa
               "----------------------------\n");
     }
 
+    // Counts a gzip or zstd file (or a pipe) as it is decompressed.
+    bool count_compressed (utils::file::MappedFile &file, CharCounter &counter)
+    {
+      compress::Format format;
+      compress::Status status = compress::feed_file (file, [&counter] (const char *data, size_t size)
+      { counter.feed (data, size); }, &format);
+      if (status == compress::Status::Unsupported || status == compress::Status::Corrupt)
+        {
+          printf ("Could not read file: %s\n", compress::status_message (status, format));
+          return false;
+        }
+      return true;
+    }
+
     void file_count_program ()
     {
       cfa::header_prompt ();
@@ -404,12 +1182,22 @@ namespace cfa
                 }
             }
 
-          if (auto file = utils::file::get_file (filename); file)
+          if (auto file = utils::file::map_file (filename); file && compress::is_plain (file))
             {
-              auto char_counts = cfa::get_char_count_vec<int> (file, cfa::ParseType::Alpha);
+              auto char_counts = cfa::get_char_count_vec_parallel<uint64_t> (file, cfa::ParseType::Alpha);
               char_counts->sort (SortMethod::Char_Ascending);
               cfa::print_char_count (char_counts);
             }
+          else if (file)
+            {
+              CharCounter counter (cfa::ParseType::Alpha);
+              if (count_compressed (file, counter))
+                {
+                  auto char_counts = counter.count_vec<uint64_t> ();
+                  char_counts->sort (SortMethod::Char_Ascending);
+                  cfa::print_char_count (char_counts);
+                }
+            }
         }
     }
 
@@ -432,17 +1220,28 @@ namespace cfa
                 }
             }
 
-          if (auto file = utils::file::get_file (filename); file)
+          if (auto file = utils::file::map_file (filename); file && compress::is_plain (file))
             {
               auto char_ranks = cfa::get_char_rank_vec (file, cfa::ParseType::Alpha);
               char_ranks->sort (SortMethod::Char_Ascending);
               cfa::print_char_rank (char_ranks);
             }
+          else if (file)
+            {
+              CharCounter counter (cfa::ParseType::Alpha);
+              if (count_compressed (file, counter))
+                {
+                  auto char_ranks = counter.rank_vec ();
+                  char_ranks->sort (SortMethod::Char_Ascending);
+                  cfa::print_char_rank (char_ranks);
+                }
+            }
         }
     }
 
     void print_char_count (std::unique_ptr <CharVec<int>> &vec)
     {
+      utils::stats::Timer timer (utils::stats::Phase::Print);
       printf ("\n"
               "------------------\n"
               "   Char   Count\n"
@@ -456,8 +1255,25 @@ namespace cfa
       printf ("\n");
     }
 
+    void print_char_count (std::unique_ptr <CharVec<uint64_t>> &vec)
+    {
+      utils::stats::Timer timer (utils::stats::Phase::Print);
+      printf ("\n"
+              "------------------\n"
+              "   Char   Count\n"
+              "------------------\n");
+
+      // Print the results
+      for (auto &[c, n]: vec->Data)
+        {
+          printf ("    %c     %llu\n", c, (unsigned long long) n);
+        }
+      printf ("\n");
+    }
+
     void print_char_rank (std::unique_ptr <CharVec<float>> &vec)
     {
+      utils::stats::Timer timer (utils::stats::Phase::Print);
       printf ("\n"
               "---------------------\n"
               "   Char    Rank\n"
@@ -511,23 +1327,13 @@ namespace cfa::tests
                     return "";
                   case 'Y':
                     {
-                      std::string filename = "test.cfa";
-                      if (std::ofstream file (filename, std::ios::binary | std::ios::out); file)
+                      generate::Options options;
+                      options.out = "test.cfa";
+                      if (generate::write_corpus (options))
                         {
-                          std::random_device dev;
-                          std::mt19937 generator (dev ());
-                          std::uniform_int_distribution <std::mt19937::result_type> range (32, 126);
-
-                          for (size_t i = 0; i < 1000 * 1000; ++i)
-                            {
-                              // Generate random ascii from 32 - 126 ('SPACE' - '~')
-                              unsigned char c = range (generator);
-                              file << c;
-                            }
-                          file.close ();
-                          printf ("Created '%s'\n", filename.c_str ());
+                          printf ("Created '%s'\n", options.out.c_str ());
                         }
-                      return filename;
+                      return options.out;
                     }
                   default:
                     printf ("Invalid choice\n");
@@ -614,6 +1420,29 @@ namespace cfa::tests
       return selection;
     }
 
+    bool prompt_another_view ()
+    {
+      for (;;)
+        {
+          printf ("Show another view of this file (y/n)? ");
+          std::string input;
+          std::getline (std::cin, input);
+          if (input.size () == 1)
+            {
+              switch ((char) std::toupper (input.front ()))
+                {
+                  case 'Y':
+                    return true;
+                  case 'N':
+                    return false;
+                  default:
+                    break;
+                }
+            }
+          printf ("Invalid choice\n");
+        }
+    }
+
     void run_test_program ()
     {
       header_prompt ();
@@ -701,6 +1530,8 @@ namespace cfa::tests
               utils::file::trim_filename (filename);
               printf ("Opened '%s'\n", filename.c_str ());
 
+              // One pass over the file; every view below is derived from it.
+              ByteHistogram histogram = get_byte_histogram (file);
               for (;;)
                 {
                   switch (get_display_value ())
@@ -708,23 +1539,27 @@ namespace cfa::tests
                       case 1:
                         {
                           ParseType parse = get_parse_selection ();
-                          auto count_vec = get_char_count_vec<int> (file, parse);
+                          auto count_vec = histogram.count_vec<uint64_t> (parse);
                           count_vec->sort (get_sort_method ());
                           print_char_count (count_vec);
                         }
-                      return;
+                      break;
                       case 2:
                         {
                           ParseType parse = get_parse_selection ();
-                          auto rank_vec = get_char_rank_vec (file, parse);
+                          auto rank_vec = histogram.rank_vec (parse);
                           rank_vec->sort (get_sort_method ());
                           print_char_rank (rank_vec);
                         }
-                      return;
+                      break;
                       default:
                         printf ("Invalid selection\n");
                       continue;
                     }
+                  if (!prompt_another_view ())
+                    {
+                      return;
+                    }
                 }
             }
         }
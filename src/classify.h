@@ -0,0 +1,589 @@
+// src/classify.h
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <optional>
+#include <thread>
+
+#include "cfa.h"
+#include "shard.h"
+#include "thread_pool.h"
+
+//----------------------------------------------------
+//  [ SECTION CLASSIFY ]   Profile classification
+//----------------------------------------------------
+
+namespace cfa::classify
+{
+    // Each distribution is one row of 256 floats, one per byte value.
+    const size_t WIDTH = CharMap<float>::SIZE;
+
+    // Probability given to keys a profile never saw, so no score divides by
+    // zero or takes the log of zero.
+    const float SMOOTHING = 1e-6f;
+
+    const size_t DEFAULT_TOP = 3;
+
+    // All three scores are distances: 0 for identical distributions, larger
+    // for less alike ones.
+    enum class Metric {
+        ChiSquare,
+        Cosine,
+        KullbackLeibler,
+    };
+
+    struct Match {
+        size_t profile = 0;
+        float score = 0;
+    };
+
+    // A distribution prepared for scoring against every profile.
+    struct Query {
+        alignas (64) std::array<float, WIDTH> p {};
+        float norm = 0;
+        float entropy = 0;      // sum of p * log p, the part of KL not involving the profile.
+    };
+
+    struct Options {
+        std::vector<std::string> profiles;
+        std::vector<std::string> inputs;
+        ParseType type = ParseType::Alpha;
+        Metric metric = Metric::ChiSquare;
+        size_t top = DEFAULT_TOP;
+        unsigned threads = 0;
+    };
+
+    class ProfileSet;
+
+    Query prepare (const CharMap<float> &ranks);
+    bool read_ranks (const std::string &path, ParseType type, CharMap<float> &ranks, std::string &error);
+    bool metric_from_name (const std::string &name, Metric &metric);
+    const char *metric_name (Metric metric);
+
+    float dot_scalar (const float *a, const float *b);
+    float chi_square_scalar (const float *q, const float *p, const float *inverse);
+#ifdef UTILS_HAS_X86_SIMD
+    float dot_avx2 (const float *a, const float *b);
+    float chi_square_avx2 (const float *q, const float *p, const float *inverse);
+    float dot_avx512 (const float *a, const float *b);
+    float chi_square_avx512 (const float *q, const float *p, const float *inverse);
+#endif
+
+    void print_usage ();
+    bool parse_options (int argc, char **argv, Options &options);
+    int classify_program (int argc, char **argv);
+}
+
+namespace cfa::classify
+{
+    //----------------------------------------------------
+    //  [ SECTION CLASSIFY ]   Kernels
+    //----------------------------------------------------
+
+    // Every score is a pass over two or three rows of WIDTH floats. The
+    // scalar kernels keep eight partial sums so the compiler can vectorize
+    // them for the baseline target; the others use AVX2/FMA or AVX-512 where
+    // `utils::simd::active_isa` allows.
+
+    float dot_scalar (const float *a, const float *b)
+    {
+      float sums[8] {};
+      for (size_t i = 0; i < WIDTH; i += 8)
+        {
+          for (size_t j = 0; j < 8; ++j)
+            {
+              sums[j] += a[i + j] * b[i + j];
+            }
+        }
+      return ((sums[0] + sums[1]) + (sums[2] + sums[3])) + ((sums[4] + sums[5]) + (sums[6] + sums[7]));
+    }
+
+    float chi_square_scalar (const float *q, const float *p, const float *inverse)
+    {
+      float sums[8] {};
+      for (size_t i = 0; i < WIDTH; i += 8)
+        {
+          for (size_t j = 0; j < 8; ++j)
+            {
+              float d = q[i + j] - p[i + j];
+              sums[j] += d * d * inverse[i + j];
+            }
+        }
+      return ((sums[0] + sums[1]) + (sums[2] + sums[3])) + ((sums[4] + sums[5]) + (sums[6] + sums[7]));
+    }
+
+#ifdef UTILS_HAS_X86_SIMD
+    __attribute__((target("avx2,fma")))
+    inline float sum_avx2 (__m256 v)
+    {
+      __m128 x = _mm_add_ps (_mm256_castps256_ps128 (v), _mm256_extractf128_ps (v, 1));
+      x = _mm_add_ps (x, _mm_movehl_ps (x, x));
+      x = _mm_add_ss (x, _mm_movehdup_ps (x));
+      return _mm_cvtss_f32 (x);
+    }
+
+    __attribute__((target("avx2,fma")))
+    float dot_avx2 (const float *a, const float *b)
+    {
+      __m256 s0 = _mm256_setzero_ps (), s1 = _mm256_setzero_ps ();
+      __m256 s2 = _mm256_setzero_ps (), s3 = _mm256_setzero_ps ();
+      for (size_t i = 0; i < WIDTH; i += 32)
+        {
+          s0 = _mm256_fmadd_ps (_mm256_loadu_ps (a + i), _mm256_loadu_ps (b + i), s0);
+          s1 = _mm256_fmadd_ps (_mm256_loadu_ps (a + i + 8), _mm256_loadu_ps (b + i + 8), s1);
+          s2 = _mm256_fmadd_ps (_mm256_loadu_ps (a + i + 16), _mm256_loadu_ps (b + i + 16), s2);
+          s3 = _mm256_fmadd_ps (_mm256_loadu_ps (a + i + 24), _mm256_loadu_ps (b + i + 24), s3);
+        }
+      return sum_avx2 (_mm256_add_ps (_mm256_add_ps (s0, s1), _mm256_add_ps (s2, s3)));
+    }
+
+    __attribute__((target("avx2,fma")))
+    float chi_square_avx2 (const float *q, const float *p, const float *inverse)
+    {
+      __m256 s0 = _mm256_setzero_ps (), s1 = _mm256_setzero_ps ();
+      for (size_t i = 0; i < WIDTH; i += 16)
+        {
+          __m256 d0 = _mm256_sub_ps (_mm256_loadu_ps (q + i), _mm256_loadu_ps (p + i));
+          __m256 d1 = _mm256_sub_ps (_mm256_loadu_ps (q + i + 8), _mm256_loadu_ps (p + i + 8));
+          s0 = _mm256_fmadd_ps (_mm256_mul_ps (d0, d0), _mm256_loadu_ps (inverse + i), s0);
+          s1 = _mm256_fmadd_ps (_mm256_mul_ps (d1, d1), _mm256_loadu_ps (inverse + i + 8), s1);
+        }
+      return sum_avx2 (_mm256_add_ps (s0, s1));
+    }
+
+    // _mm512_reduce_add_ps, spelled with the zero-masking forms: GCC 12
+    // expands the plain ones through _mm512_undefined_ps, which trips
+    // -Wuninitialized.
+    __attribute__((target("avx512f")))
+    inline float sum_avx512 (__m512 v)
+    {
+      v = _mm512_add_ps (v, _mm512_maskz_shuffle_f32x4 (0xFFFF, v, v, _MM_SHUFFLE (1, 0, 3, 2)));
+      v = _mm512_add_ps (v, _mm512_maskz_shuffle_f32x4 (0xFFFF, v, v, _MM_SHUFFLE (2, 3, 0, 1)));
+      __m128 x = _mm512_maskz_extractf32x4_ps (0xF, v, 0);
+      x = _mm_add_ps (x, _mm_movehl_ps (x, x));
+      x = _mm_add_ss (x, _mm_movehdup_ps (x));
+      return _mm_cvtss_f32 (x);
+    }
+
+    __attribute__((target("avx512f")))
+    float dot_avx512 (const float *a, const float *b)
+    {
+      __m512 s0 = _mm512_setzero_ps (), s1 = _mm512_setzero_ps ();
+      for (size_t i = 0; i < WIDTH; i += 32)
+        {
+          s0 = _mm512_fmadd_ps (_mm512_loadu_ps (a + i), _mm512_loadu_ps (b + i), s0);
+          s1 = _mm512_fmadd_ps (_mm512_loadu_ps (a + i + 16), _mm512_loadu_ps (b + i + 16), s1);
+        }
+      return sum_avx512 (_mm512_add_ps (s0, s1));
+    }
+
+    __attribute__((target("avx512f")))
+    float chi_square_avx512 (const float *q, const float *p, const float *inverse)
+    {
+      __m512 s0 = _mm512_setzero_ps (), s1 = _mm512_setzero_ps ();
+      for (size_t i = 0; i < WIDTH; i += 32)
+        {
+          __m512 d0 = _mm512_sub_ps (_mm512_loadu_ps (q + i), _mm512_loadu_ps (p + i));
+          __m512 d1 = _mm512_sub_ps (_mm512_loadu_ps (q + i + 16), _mm512_loadu_ps (p + i + 16));
+          s0 = _mm512_fmadd_ps (_mm512_mul_ps (d0, d0), _mm512_loadu_ps (inverse + i), s0);
+          s1 = _mm512_fmadd_ps (_mm512_mul_ps (d1, d1), _mm512_loadu_ps (inverse + i + 16), s1);
+        }
+      return sum_avx512 (_mm512_add_ps (s0, s1));
+    }
+#endif
+
+    using DotKernel = float (*) (const float *a, const float *b);
+    using ChiSquareKernel = float (*) (const float *q, const float *p, const float *inverse);
+
+    struct Kernels {
+        DotKernel dot = dot_scalar;
+        ChiSquareKernel chi_square = chi_square_scalar;
+    };
+
+    // Picked once per ProfileSet, for the ISA active at the time.
+    Kernels select_kernels ()
+    {
+      Kernels kernels;
+#ifdef UTILS_HAS_X86_SIMD
+      utils::simd::Isa isa = utils::simd::active_isa ();
+      if (isa >= utils::simd::Isa::AVX512)
+        {
+          kernels.dot = dot_avx512;
+          kernels.chi_square = chi_square_avx512;
+        }
+      else if (isa >= utils::simd::Isa::AVX2 && __builtin_cpu_supports ("fma"))
+        {
+          kernels.dot = dot_avx2;
+          kernels.chi_square = chi_square_avx2;
+        }
+#endif
+      return kernels;
+    }
+
+    //----------------------------------------------------
+    //  [ SECTION CLASSIFY ]   Profiles
+    //----------------------------------------------------
+
+    Query prepare (const CharMap<float> &ranks)
+    {
+      Query query;
+      double norm = 0, entropy = 0;
+      for (size_t i = 0; i < WIDTH; ++i)
+        {
+          float p = ranks.Data[i];
+          query.p[i] = p;
+          norm += (double) p * p;
+          entropy += p > 0 ? (double) p * std::log ((double) p) : 0.0;
+        }
+      query.norm = (float) std::sqrt (norm);
+      query.entropy = (float) entropy;
+      return query;
+    }
+
+    // Reference distributions held as N x WIDTH matrices, one row per
+    // profile, with what each metric needs precomputed per row: the smoothed
+    // probabilities, their logarithms and their reciprocals. Chi-square is
+    // then one pass over two rows, and KL and cosine reduce to dot products.
+    class ProfileSet {
+     public:
+        ProfileSet ()
+            : m_kernels (select_kernels ())
+        {
+        }
+
+        // Adds a profile from the ranks (a normalized distribution) of a
+        // reference text.
+        void add (std::string name, const CharMap<float> &ranks)
+        {
+          size_t row = m_names.size ();
+          m_names.push_back (std::move (name));
+          m_probabilities.resize ((row + 1) * WIDTH);
+          m_logs.resize ((row + 1) * WIDTH);
+          m_inverses.resize ((row + 1) * WIDTH);
+
+          double norm = 0;
+          for (size_t i = 0; i < WIDTH; ++i)
+            {
+              float p = std::max (ranks.Data[i], SMOOTHING);
+              m_probabilities[row * WIDTH + i] = p;
+              m_logs[row * WIDTH + i] = std::log (p);
+              m_inverses[row * WIDTH + i] = 1.0f / p;
+              norm += (double) p * p;
+            }
+          m_norms.push_back ((float) std::sqrt (norm));
+        }
+
+        // The distance of `query` to one profile.
+        [[nodiscard]] float score (const Query &query, size_t profile, Metric metric) const
+        {
+          size_t offset = profile * WIDTH;
+          switch (metric)
+            {
+              case Metric::ChiSquare:
+                return m_kernels.chi_square (query.p.data (), &m_probabilities[offset], &m_inverses[offset]);
+              case Metric::Cosine:
+                {
+                  float norms = query.norm * m_norms[profile];
+                  return norms > 0 ? 1.0f - m_kernels.dot (query.p.data (), &m_probabilities[offset]) / norms : 1.0f;
+                }
+              default:
+                // KL(query || profile) = sum q log q - sum q log p.
+                return query.entropy - m_kernels.dot (query.p.data (), &m_logs[offset]);
+            }
+        }
+
+        // The `top` closest profiles, closest first.
+        [[nodiscard]] std::vector<Match> best (const Query &query, Metric metric, size_t top) const
+        {
+          std::vector<Match> matches (size ());
+          for (size_t i = 0; i < matches.size (); ++i)
+            {
+              matches[i] = {i, score (query, i, metric)};
+            }
+          top = std::min (top, matches.size ());
+          std::partial_sort (matches.begin (), matches.begin () + (ptrdiff_t) top, matches.end (),
+                             [] (const Match &a, const Match &b)
+                             { return a.score < b.score || (a.score == b.score && a.profile < b.profile); });
+          matches.resize (top);
+          return matches;
+        }
+
+        // The best matches of many queries, spread over `threads` threads
+        // that take queries in turn.
+        [[nodiscard]] std::vector<std::vector<Match>> best (const std::vector<Query> &queries, Metric metric,
+                                                            size_t top, unsigned threads = 0) const
+        {
+          std::vector<std::vector<Match>> results (queries.size ());
+          std::atomic<size_t> next {0};
+          auto worker = [&]
+          {
+              for (size_t i = next++; i < queries.size (); i = next++)
+                {
+                  results[i] = best (queries[i], metric, top);
+                }
+          };
+
+          size_t count = std::min<size_t> (resolve_thread_count (threads), queries.size ());
+          std::vector<std::thread> workers;
+          for (size_t i = 1; i < count; ++i)
+            {
+              workers.emplace_back (worker);
+            }
+          worker ();
+          for (auto &thread: workers)
+            {
+              thread.join ();
+            }
+          return results;
+        }
+
+        [[nodiscard]] size_t size () const
+        {
+          return m_names.size ();
+        }
+
+        [[nodiscard]] const std::string &name (size_t profile) const
+        {
+          return m_names[profile];
+        }
+
+     private:
+        Kernels m_kernels;
+        std::vector<std::string> m_names;
+        std::vector<float> m_probabilities;
+        std::vector<float> m_logs;
+        std::vector<float> m_inverses;
+        std::vector<float> m_norms;
+    };
+
+    // The `type` ranks of a file: a histogram file written by `--save`, or
+    // any other file, counted (and decompressed) here.
+    bool read_ranks (const std::string &path, ParseType type, CharMap<float> &ranks, std::string &error)
+    {
+      shard::ShardFile shard_file;
+      shard::Error status = shard_file.open (path);
+      if (status == shard::Error::None)
+        {
+          CharMap<uint64_t> counts;
+          shard_file.add_to (counts);
+          if (shard_file.type () == shard::RAW_TYPE)
+            {
+              ranks = ByteHistogram (counts, shard_file.header ().bytes).rank_view (type);
+              return true;
+            }
+          if (shard_file.type () != (uint32_t) type)
+            {
+              error = std::string ("holds ") + shard::type_name (shard_file.type ()) + " counts, not "
+                      + parse_type_name (type);
+              return false;
+            }
+          ranks = counts.ranks ();
+          return true;
+        }
+      // Anything without the magic, or too short to hold a header, is text.
+      std::error_code size_error;
+      bool short_file = std::filesystem::file_size (path, size_error) < sizeof (shard::Header) || size_error;
+      if (status != shard::Error::Magic && !(status == shard::Error::Truncated && short_file))
+        {
+          error = shard::error_message (status);
+          return false;
+        }
+
+      utils::file::MappedFile file;
+      if (!file.open (path))
+        {
+          error = "could not open";
+          return false;
+        }
+      ByteHistogram histogram;
+      compress::Format format;
+      compress::Status decoded = compress::feed_file (file, [&histogram] (const char *data, size_t size)
+      { histogram.feed (data, size); }, &format);
+      if (decoded == compress::Status::Unsupported || decoded == compress::Status::Corrupt)
+        {
+          error = compress::status_message (decoded, format);
+          return false;
+        }
+      ranks = histogram.rank_view (type);
+      return true;
+    }
+
+    bool metric_from_name (const std::string &name, Metric &metric)
+    {
+      for (Metric candidate: {Metric::ChiSquare, Metric::Cosine, Metric::KullbackLeibler})
+        {
+          if (name == metric_name (candidate))
+            {
+              metric = candidate;
+              return true;
+            }
+        }
+      return false;
+    }
+
+    const char *metric_name (Metric metric)
+    {
+      switch (metric)
+        {
+          case Metric::ChiSquare:
+            return "chi2";
+          case Metric::Cosine:
+            return "cosine";
+          default:
+            return "kl";
+        }
+    }
+
+    //----------------------------------------------------
+    //  [ SECTION CLASSIFY ]   Program
+    //----------------------------------------------------
+
+    void print_usage ()
+    {
+      printf ("Usage: cfa -classify --profiles=<file|directory|glob> [options] <file|directory|glob>...\n"
+              "\t--profiles=...  reference texts or histogram files, one profile each, named\n"
+              "\t                after the file; may be given more than once\n"
+              "\t--type=alpha|digit|symbol|alnum|ascii   (default: alpha)\n"
+              "\t--metric=chi2|cosine|kl   distance to each profile (default: chi2)\n"
+              "\t--top=K         print the K closest profiles (default: 3)\n"
+              "\t--threads=N     worker threads (default: all cores)\n");
+    }
+
+    bool parse_options (int argc, char **argv, Options &options)
+    {
+      for (int i = 0; i < argc; ++i)
+        {
+          std::string arg (argv[i]), key, value;
+          if (!utils::parse_option (arg, key, value))
+            {
+              options.inputs.push_back (arg);
+              continue;
+            }
+
+          if (key == "type" && parse_type_from_name (value, options.type))
+            {
+              continue;
+            }
+          if (key == "metric" && metric_from_name (value, options.metric))
+            {
+              continue;
+            }
+          if (key == "profiles" && !value.empty ())
+            {
+              options.profiles.push_back (value);
+            }
+          else if (key == "top" && utils::parse_number (value, options.top))
+            {
+              options.top = std::max<size_t> (1, options.top);
+            }
+          else if (key == "threads" && utils::parse_number (value, options.threads))
+            {
+              continue;
+            }
+          else
+            {
+              fprintf (stderr, "cfa: invalid option '%s'\n", arg.c_str ());
+              return false;
+            }
+        }
+      return !options.profiles.empty () && !options.inputs.empty ();
+    }
+
+    int classify_program (int argc, char **argv)
+    {
+      Options options;
+      if (!parse_options (argc, argv, options))
+        {
+          print_usage ();
+          return 1;
+        }
+
+      std::vector<std::filesystem::path> profile_paths, paths;
+      for (auto &profile: options.profiles)
+        {
+          utils::file::collect_files (profile, profile_paths);
+        }
+      for (auto &input: options.inputs)
+        {
+          utils::file::collect_files (input, paths);
+        }
+
+      // Profiles and inputs are both read on the pool; a failed file leaves
+      // its slot empty.
+      std::vector<std::optional<CharMap<float>>> profiles (profile_paths.size ());
+      std::vector<std::optional<Query>> queries (paths.size ());
+      {
+        utils::WorkStealingPool pool (resolve_thread_count (options.threads));
+        auto submit = [&pool, &options] (const std::filesystem::path &path, auto store)
+        {
+            pool.submit ([&path, &options, store]
+                         {
+                             CharMap<float> ranks;
+                             std::string error;
+                             if (read_ranks (path.string (), options.type, ranks, error))
+                               {
+                                 store (ranks);
+                               }
+                             else
+                               {
+                                 fprintf (stderr, "cfa: '%s': %s\n", path.string ().c_str (), error.c_str ());
+                               }
+                         });
+        };
+        for (size_t i = 0; i < profile_paths.size (); ++i)
+          {
+            submit (profile_paths[i], [&profiles, i] (const CharMap<float> &ranks)
+            { profiles[i] = ranks; });
+          }
+        for (size_t i = 0; i < paths.size (); ++i)
+          {
+            submit (paths[i], [&queries, i] (const CharMap<float> &ranks)
+            { queries[i] = prepare (ranks); });
+          }
+        pool.wait ();
+      }
+
+      ProfileSet set;
+      for (size_t i = 0; i < profile_paths.size (); ++i)
+        {
+          if (profiles[i])
+            {
+              set.add (profile_paths[i].stem ().string (), *profiles[i]);
+            }
+        }
+      if (set.size () == 0)
+        {
+          fprintf (stderr, "cfa: no profiles could be read\n");
+          return 1;
+        }
+
+      std::vector<Query> ready;
+      for (auto &query: queries)
+        {
+          if (query)
+            {
+              ready.push_back (*query);
+            }
+        }
+      auto results = set.best (ready, options.metric, options.top, options.threads);
+
+      int status = ready.size () == paths.size () ? 0 : 1;
+      size_t next = 0;
+      for (size_t i = 0; i < paths.size (); ++i)
+        {
+          if (!queries[i])
+            {
+              continue;
+            }
+          printf ("==> %s <==\n", paths[i].string ().c_str ());
+          size_t rank = 1;
+          for (auto &match: results[next++])
+            {
+              printf ("   %2zu. %-24s %12.6g\n", rank++, set.name (match.profile).c_str (), (double) match.score);
+            }
+        }
+      return status;
+    }
+}
@@ -0,0 +1,392 @@
+// src/compress.h
+
+#pragma once
+
+#include <string_view>
+#include <thread>
+#include <utility>
+
+#include "aio.h"
+#include "utils.h"
+
+#ifdef CFA_HAS_ZLIB
+#include <zlib.h>
+#endif
+#ifdef CFA_HAS_ZSTD
+#include <zstd.h>
+#endif
+
+//----------------------------------------------------
+//  [ SECTION COMPRESS ]   Compressed input
+//----------------------------------------------------
+
+namespace cfa::compress
+{
+    // Decompressed data is handed over in RING_BUFFERS buffers of
+    // RING_BUFFER_SIZE bytes, so at most that much is held in memory however
+    // large the uncompressed input is.
+    const size_t RING_BUFFERS = 4;
+    const size_t RING_BUFFER_SIZE = 1024 * 1024;
+
+    // Bytes needed to recognize every supported format.
+    const size_t MAGIC_SIZE = 4;
+
+    enum class Format {
+        None,
+        Gzip,
+        Zstd,
+    };
+
+    enum class Status {
+        Plain,
+        Decompressed,
+        Unsupported,
+        Corrupt,
+    };
+
+    using utils::aio::Buffer;
+    using utils::aio::BufferRing;
+
+    class Input;
+
+    Format detect (std::string_view head);
+    const char *format_name (Format format);
+    bool is_supported (Format format);
+    bool is_plain (const utils::file::MappedFile &file);
+    Status decode (Format format, Input &input, BufferRing &ring);
+    template<typename Consumer>
+    Status feed_file (utils::file::MappedFile &file, Consumer &&consume, Format *detected = nullptr);
+    const char *status_message (Status status, Format format);
+}
+
+namespace cfa::compress
+{
+    // The bytes of a file in the order they are stored. A mapped file is one
+    // block; anything else is read in blocks, and the first block is kept so
+    // the format can be detected without losing what was read.
+    class Input {
+     public:
+        explicit Input (utils::file::MappedFile &file)
+            : m_file (file)
+        {
+        }
+
+        // The first bytes of the file, which are still returned by `next`.
+        std::string_view head ()
+        {
+          if (m_file.is_mapped ())
+            {
+              return {m_file.data (), std::min (m_file.size (), MAGIC_SIZE)};
+            }
+          if (!m_started)
+            {
+              m_started = true;
+              m_buffer.resize (utils::file::DEFAULT_BLOCK_SIZE);
+              // A pipe may return fewer bytes than asked for.
+              while (m_pending < MAGIC_SIZE)
+                {
+                  size_t size = m_file.read (m_buffer.data () + m_pending, m_buffer.size () - m_pending);
+                  if (size == 0)
+                    {
+                      break;
+                    }
+                  m_pending += size;
+                }
+            }
+          return {m_buffer.data (), std::min (m_pending, MAGIC_SIZE)};
+        }
+
+        // The next block, or an empty view at the end of the file.
+        std::string_view next ()
+        {
+          if (m_file.is_mapped ())
+            {
+              if (m_started)
+                {
+                  return {};
+                }
+              m_started = true;
+              return {m_file.data (), m_file.size ()};
+            }
+          if (!m_started)
+            {
+              head ();
+            }
+          if (m_pending > 0)
+            {
+              return {m_buffer.data (), std::exchange (m_pending, 0)};
+            }
+          return {m_buffer.data (), m_file.read (m_buffer.data (), m_buffer.size ())};
+        }
+
+     private:
+        utils::file::MappedFile &m_file;
+        std::vector<char> m_buffer;
+        size_t m_pending = 0;
+        bool m_started = false;
+    };
+
+    Format detect (std::string_view head)
+    {
+      auto *p = (const unsigned char *) head.data ();
+      if (head.size () >= 2 && p[0] == 0x1F && p[1] == 0x8B)
+        {
+          return Format::Gzip;
+        }
+      if (head.size () >= 4 && p[0] == 0x28 && p[1] == 0xB5 && p[2] == 0x2F && p[3] == 0xFD)
+        {
+          return Format::Zstd;
+        }
+      return Format::None;
+    }
+
+    const char *format_name (Format format)
+    {
+      switch (format)
+        {
+          case Format::Gzip:
+            return "gzip";
+          case Format::Zstd:
+            return "zstd";
+          default:
+            return "none";
+        }
+    }
+
+    bool is_supported (Format format)
+    {
+      switch (format)
+        {
+          case Format::None:
+            return true;
+#ifdef CFA_HAS_ZLIB
+          case Format::Gzip:
+            return true;
+#endif
+#ifdef CFA_HAS_ZSTD
+          case Format::Zstd:
+            return true;
+#endif
+          default:
+            return false;
+        }
+    }
+
+    // True for an uncompressed, mapped file, which callers can count in
+    // place (e.g. in parallel) instead of through `feed_file`.
+    bool is_plain (const utils::file::MappedFile &file)
+    {
+      return file.is_mapped () && detect ({file.data (), std::min (file.size (), MAGIC_SIZE)}) == Format::None;
+    }
+
+#ifdef CFA_HAS_ZLIB
+    // Inflates every gzip member in the input, as `gzip -d` does for files
+    // that were concatenated. Trailing bytes that do not start another
+    // member are ignored.
+    Status inflate_gzip (Input &input, BufferRing &ring)
+    {
+      z_stream stream {};
+      if (inflateInit2 (&stream, 16 + MAX_WBITS) != Z_OK)
+        {
+          return Status::Corrupt;
+        }
+
+      Buffer *out = &ring.acquire ();
+      stream.next_out = (Bytef *) out->data.data ();
+      stream.avail_out = (uInt) out->data.size ();
+
+      bool complete = false, ended = false, failed = false;
+      for (std::string_view in; !ended && !failed && !(in = input.next ()).empty ();)
+        {
+          while (!in.empty () && !ended && !failed)
+            {
+              // avail_in is 32 bits wide; feed a large mapping in slices.
+              size_t slice = std::min<size_t> (in.size (), (size_t) 1 << 30);
+              stream.next_in = (Bytef *) in.data ();
+              stream.avail_in = (uInt) slice;
+              while (stream.avail_in > 0)
+                {
+                  if (stream.avail_out == 0)
+                    {
+                      out->size = out->data.size ();
+                      ring.publish ();
+                      out = &ring.acquire ();
+                      stream.next_out = (Bytef *) out->data.data ();
+                      stream.avail_out = (uInt) out->data.size ();
+                    }
+
+                  int result = inflate (&stream, Z_NO_FLUSH);
+                  if (result == Z_STREAM_END)
+                    {
+                      complete = true;
+                      inflateReset (&stream);
+                    }
+                  else if (result != Z_OK)
+                    {
+                      // Garbage right after a member ends the input; within
+                      // one it is an error.
+                      ended = complete;
+                      failed = !complete;
+                      break;
+                    }
+                  else
+                    {
+                      complete = false;
+                    }
+                }
+              in.remove_prefix (slice - stream.avail_in);
+            }
+        }
+
+      out->size = out->data.size () - stream.avail_out;
+      ring.publish ();
+      inflateEnd (&stream);
+      return complete && !failed ? Status::Decompressed : Status::Corrupt;
+    }
+#endif
+
+#ifdef CFA_HAS_ZSTD
+    // Decompresses every zstd frame in the input.
+    Status decompress_zstd (Input &input, BufferRing &ring)
+    {
+      ZSTD_DStream *stream = ZSTD_createDStream ();
+      if (!stream)
+        {
+          return Status::Corrupt;
+        }
+      ZSTD_initDStream (stream);
+
+      Buffer *out = &ring.acquire ();
+      ZSTD_outBuffer output {out->data.data (), out->data.size (), 0};
+      size_t remaining = 1;
+      bool failed = false;
+      for (std::string_view in; !failed && !(in = input.next ()).empty ();)
+        {
+          ZSTD_inBuffer input_buffer {in.data (), in.size (), 0};
+          while (input_buffer.pos < input_buffer.size)
+            {
+              if (output.pos == output.size)
+                {
+                  out->size = output.pos;
+                  ring.publish ();
+                  out = &ring.acquire ();
+                  output = {out->data.data (), out->data.size (), 0};
+                }
+
+              // 0 once a frame is complete, else a hint of what it still needs.
+              remaining = ZSTD_decompressStream (stream, &output, &input_buffer);
+              if (ZSTD_isError (remaining))
+                {
+                  failed = true;
+                  break;
+                }
+            }
+        }
+
+      // Flush what the decoder still holds from the last frame.
+      while (!failed && remaining != 0)
+        {
+          if (output.pos == output.size)
+            {
+              out->size = output.pos;
+              ring.publish ();
+              out = &ring.acquire ();
+              output = {out->data.data (), out->data.size (), 0};
+            }
+          ZSTD_inBuffer empty {nullptr, 0, 0};
+          size_t before = output.pos;
+          remaining = ZSTD_decompressStream (stream, &output, &empty);
+          if (ZSTD_isError (remaining) || output.pos == before)
+            {
+              failed = true;
+            }
+        }
+
+      out->size = output.pos;
+      ring.publish ();
+      ZSTD_freeDStream (stream);
+      return failed ? Status::Corrupt : Status::Decompressed;
+    }
+#endif
+
+    // Decompresses `input` into `ring`. Runs on the producer thread.
+    Status decode (Format format, Input &input, BufferRing &ring)
+    {
+      switch (format)
+        {
+#ifdef CFA_HAS_ZLIB
+          case Format::Gzip:
+            return inflate_gzip (input, ring);
+#endif
+#ifdef CFA_HAS_ZSTD
+          case Format::Zstd:
+            return decompress_zstd (input, ring);
+#endif
+          default:
+            (void) input;
+            (void) ring;
+            return Status::Unsupported;
+        }
+    }
+
+    // Passes the contents of `file` to `consume (data, size)`, decompressing
+    // them first if the file is gzip or zstd compressed. Decompression runs
+    // on its own thread, one ring of buffers ahead of `consume`, so the two
+    // overlap and the uncompressed data is never held in full.
+    template<typename Consumer>
+    Status feed_file (utils::file::MappedFile &file, Consumer &&consume, Format *detected)
+    {
+      Input input (file);
+      Format format = detect (input.head ());
+      if (detected)
+        {
+          *detected = format;
+        }
+      if (format == Format::None)
+        {
+          for (std::string_view in; !(in = input.next ()).empty ();)
+            {
+              consume (in.data (), in.size ());
+            }
+          return Status::Plain;
+        }
+      if (!is_supported (format))
+        {
+          return Status::Unsupported;
+        }
+
+      BufferRing ring (RING_BUFFERS, RING_BUFFER_SIZE);
+      Status status = Status::Corrupt;
+      std::thread producer ([&]
+                            {
+                                utils::stats::Timer timer (utils::stats::Phase::Decompress);
+                                status = decode (format, input, ring);
+                                ring.finish ();
+                            });
+      while (const Buffer *buffer = ring.next ())
+        {
+          if (buffer->size > 0)
+            {
+              consume (buffer->data.data (), buffer->size);
+            }
+          ring.release ();
+        }
+      producer.join ();
+      return status;
+    }
+
+    // Why `feed_file` failed, for an error message.
+    const char *status_message (Status status, Format format)
+    {
+      switch (status)
+        {
+          case Status::Unsupported:
+            return format == Format::Zstd ? "zstd input, but cfa was built without zstd"
+                                          : "gzip input, but cfa was built without zlib";
+          case Status::Corrupt:
+            return format == Format::Zstd ? "corrupt or truncated zstd data" : "corrupt or truncated gzip data";
+          default:
+            return "ok";
+        }
+    }
+}
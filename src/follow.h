@@ -0,0 +1,377 @@
+// src/follow.h
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+
+#include "cfa.h"
+
+#ifdef UTILS_HAS_MMAP
+#include <poll.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#define CFA_HAS_INOTIFY 1
+#endif
+
+//----------------------------------------------------
+//  [ SECTION FOLLOW ]   Live counts of a growing file
+//----------------------------------------------------
+
+namespace cfa::follow
+{
+    // How often the file is checked when inotify is not available.
+    const int POLL_INTERVAL_MS = 200;
+    // Shortest time between two printed updates, in seconds.
+    const double MIN_INTERVAL = 0.01;
+
+    struct Options {
+        std::string path;
+        ParseType type = ParseType::Alpha;
+        SortMethod sort = SortMethod::Char_Ascending;
+        bool rank = false;
+        double interval = 1.0;
+        bool from_end = false;
+        bool poll = false;
+        uint64_t updates = 0;
+    };
+
+    class Follower;
+
+    void print_usage ();
+    bool parse_options (int argc, char **argv, Options &options);
+    void print_counts (const Options &options, const CharCounter &counter);
+    int follow_program (int argc, char **argv);
+}
+
+namespace cfa::follow
+{
+    // Set by SIGINT; the follow loop prints the final counts and returns.
+    std::atomic<bool> g_stop {false};
+
+#ifdef UTILS_HAS_MMAP
+    // Keeps a file open and counts the bytes appended to it. A file that is
+    // truncated is read again from its start; a file that is renamed away
+    // and replaced (log rotation) is drained, then the new file at the same
+    // path is followed. Counts keep accumulating across both.
+    class Follower {
+     public:
+        Follower (std::string path, ParseType type, bool use_inotify)
+            : m_path (std::move (path)), m_counter (type), m_buffer (utils::file::DEFAULT_BLOCK_SIZE)
+        {
+#ifdef CFA_HAS_INOTIFY
+          if (use_inotify)
+            {
+              m_inotify = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+            }
+#else
+          (void) use_inotify;
+#endif
+        }
+
+        Follower (const Follower &) = delete;
+        Follower &operator= (const Follower &) = delete;
+
+        ~Follower ()
+        {
+          close_file ();
+          if (m_inotify >= 0)
+            {
+              ::close (m_inotify);
+            }
+        }
+
+        // Opens the file. With `from_end`, what it holds now is skipped.
+        bool open (bool from_end)
+        {
+          if (!open_file ())
+            {
+              return false;
+            }
+          struct stat info {};
+          if (from_end && fstat (m_fd, &info) == 0)
+            {
+              m_offset = (uint64_t) info.st_size;
+            }
+          return true;
+        }
+
+        // Counts everything appended since the last call.
+        void update ()
+        {
+          struct stat info {};
+          if (fstat (m_fd, &info) == 0 && (uint64_t) info.st_size < m_offset)
+            {
+              fprintf (stderr, "cfa: '%s' was truncated\n", m_path.c_str ());
+              m_offset = 0;
+            }
+          read_available ();
+
+          // Anything left in the old file was just read; switch if the path
+          // now names a different file.
+          if (::stat (m_path.c_str (), &info) == 0 && ((uint64_t) info.st_dev != m_device
+                                                       || (uint64_t) info.st_ino != m_inode))
+            {
+              fprintf (stderr, "cfa: '%s' was replaced; following the new file\n", m_path.c_str ());
+              close_file ();
+              if (open_file ())
+                {
+                  read_available ();
+                }
+            }
+        }
+
+        // Sleeps until the file may have changed, `timeout_ms` passes or a
+        // signal arrives.
+        void wait (int timeout_ms)
+        {
+          timeout_ms = std::max (timeout_ms, 0);
+          if (m_inotify < 0)
+            {
+              ::poll (nullptr, 0, std::min (timeout_ms, POLL_INTERVAL_MS));
+              return;
+            }
+
+          pollfd fd {m_inotify, POLLIN, 0};
+          if (::poll (&fd, 1, timeout_ms) > 0)
+            {
+              // Only the wake-up matters; `update` works out what changed.
+              char events[4096];
+              while (::read (m_inotify, events, sizeof (events)) > 0)
+                {
+                }
+            }
+        }
+
+        [[nodiscard]] const CharCounter &counter () const
+        {
+          return m_counter;
+        }
+
+        [[nodiscard]] bool uses_inotify () const
+        {
+          return m_inotify >= 0;
+        }
+
+     private:
+        bool open_file ()
+        {
+          if ((m_fd = ::open (m_path.c_str (), O_RDONLY | O_CLOEXEC)) < 0)
+            {
+              return false;
+            }
+          struct stat info {};
+          fstat (m_fd, &info);
+          m_device = (uint64_t) info.st_dev;
+          m_inode = (uint64_t) info.st_ino;
+          m_offset = 0;
+          watch ();
+          return true;
+        }
+
+        void close_file ()
+        {
+          if (m_fd >= 0)
+            {
+              ::close (m_fd);
+              m_fd = -1;
+            }
+        }
+
+        void watch ()
+        {
+#ifdef CFA_HAS_INOTIFY
+          if (m_inotify < 0)
+            {
+              return;
+            }
+          if (m_file_watch >= 0)
+            {
+              inotify_rm_watch (m_inotify, m_file_watch);
+            }
+          m_file_watch = inotify_add_watch (m_inotify, m_path.c_str (),
+                                            IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+
+          // A rotated log reappears as a new entry in the same directory.
+          if (m_dir_watch < 0)
+            {
+              std::filesystem::path dir = std::filesystem::path (m_path).parent_path ();
+              m_dir_watch = inotify_add_watch (m_inotify, dir.empty () ? "." : dir.c_str (),
+                                               IN_CREATE | IN_MOVED_TO);
+            }
+#endif
+        }
+
+        void read_available ()
+        {
+          for (;;)
+            {
+              ssize_t size = ::pread (m_fd, m_buffer.data (), m_buffer.size (), (off_t) m_offset);
+              if (size < 0 && errno == EINTR)
+                {
+                  continue;
+                }
+              if (size <= 0)
+                {
+                  return;
+                }
+              m_counter.feed (m_buffer.data (), (size_t) size);
+              m_offset += (uint64_t) size;
+            }
+        }
+
+        std::string m_path;
+        CharCounter m_counter;
+        std::vector<char> m_buffer;
+        int m_fd = -1;
+        uint64_t m_offset = 0;
+        uint64_t m_device = 0;
+        uint64_t m_inode = 0;
+        int m_inotify = -1;
+        int m_file_watch = -1;
+        int m_dir_watch = -1;
+    };
+#endif
+
+    void print_usage ()
+    {
+      printf ("Usage: cfa -follow [options] <file>\n"
+              "\t--type=alpha|digit|symbol|alnum|ascii   (default: alpha)\n"
+              "\t--sort=char|char-desc|value|value-desc|none   (default: char)\n"
+              "\t--rank          print ranks instead of counts\n"
+              "\t--interval=SEC  seconds between updates, at least 0.01 (default: 1)\n"
+              "\t--from-end      count only bytes appended from now on\n"
+              "\t--poll          check the file periodically instead of using inotify\n"
+              "\t--updates=N     exit after N updates (default: run until interrupted)\n");
+    }
+
+    bool parse_options (int argc, char **argv, Options &options)
+    {
+      for (int i = 0; i < argc; ++i)
+        {
+          std::string arg (argv[i]), key, value;
+          if (!utils::parse_option (arg, key, value))
+            {
+              if (!options.path.empty ())
+                {
+                  return false;
+                }
+              options.path = arg;
+              continue;
+            }
+
+          if (key == "type" && parse_type_from_name (value, options.type))
+            {
+              continue;
+            }
+          if (key == "sort" && sort_method_from_name (value, options.sort))
+            {
+              continue;
+            }
+          if (key == "rank")
+            {
+              options.rank = true;
+            }
+          else if (key == "interval" && utils::parse_number (value, options.interval)
+                   && options.interval >= MIN_INTERVAL)
+            {
+              continue;
+            }
+          else if (key == "from-end")
+            {
+              options.from_end = true;
+            }
+          else if (key == "poll")
+            {
+              options.poll = true;
+            }
+          else if (key == "updates" && utils::parse_number (value, options.updates))
+            {
+              continue;
+            }
+          else
+            {
+              fprintf (stderr, "cfa: invalid option '%s'\n", arg.c_str ());
+              return false;
+            }
+        }
+      return !options.path.empty ();
+    }
+
+    void print_counts (const Options &options, const CharCounter &counter)
+    {
+      printf ("==> %s (%llu bytes) <==", options.path.c_str (), (unsigned long long) counter.bytes_fed ());
+      if (options.rank)
+        {
+          auto vec = counter.rank_vec ();
+          vec->sort (options.sort);
+          print_char_rank (vec);
+        }
+      else
+        {
+          auto vec = counter.count_vec<uint64_t> ();
+          vec->sort (options.sort);
+          print_char_count (vec);
+        }
+      fflush (stdout);
+    }
+
+    int follow_program (int argc, char **argv)
+    {
+      Options options;
+      if (!parse_options (argc, argv, options))
+        {
+          print_usage ();
+          return 1;
+        }
+
+#ifdef UTILS_HAS_MMAP
+      Follower follower (options.path, options.type, !options.poll);
+      if (!follower.open (options.from_end))
+        {
+          fprintf (stderr, "cfa: could not open '%s'\n", options.path.c_str ());
+          return 1;
+        }
+
+      g_stop = false;
+      std::signal (SIGINT, [] (int)
+      { g_stop = true; });
+
+      using clock = std::chrono::steady_clock;
+      auto interval = std::chrono::duration_cast<clock::duration> (std::chrono::duration<double> (options.interval));
+      auto next_update = clock::now () + interval;
+      uint64_t updates = 0;
+      bool printed = false;
+      while (!g_stop)
+        {
+          follower.update ();
+          printed = false;
+          if (clock::now () >= next_update)
+            {
+              print_counts (options, follower.counter ());
+              printed = true;
+              if (options.updates && ++updates >= options.updates)
+                {
+                  break;
+                }
+              next_update = std::max (next_update + interval, clock::now ());
+            }
+          auto remaining = std::chrono::duration_cast<std::chrono::milliseconds> (next_update - clock::now ());
+          follower.wait ((int) remaining.count () + 1);
+        }
+
+      std::signal (SIGINT, SIG_DFL);
+      if (!printed)
+        {
+          follower.update ();
+          print_counts (options, follower.counter ());
+        }
+      return 0;
+#else
+      fprintf (stderr, "cfa: follow mode is not supported on this platform\n");
+      return 1;
+#endif
+    }
+}
@@ -0,0 +1,359 @@
+// src/generate.h
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <thread>
+
+#include "utils.h"
+
+//----------------------------------------------------
+//  [ SECTION GENERATE ]   Synthetic corpus generator
+//----------------------------------------------------
+
+namespace cfa::generate
+{
+    // The corpus is produced in independent chunks, each with its own PRNG
+    // seeded from (seed, chunk index), so the output depends only on the seed
+    // and never on the number of threads.
+    const size_t CHUNK_SIZE = 1024 * 1024 * 4;
+
+    // Mixed corpora switch between text and binary at this granularity.
+    const size_t SEGMENT_SIZE = 1024 * 4;
+
+    enum class Distribution {
+        Uniform,
+        Zipf,
+        English,
+        Mixed,
+    };
+
+    struct Options {
+        std::string out = "corpus.cfa";
+        size_t size = 1000 * 1000;
+        Distribution distribution = Distribution::Uniform;
+        uint64_t seed = 0;
+        unsigned threads = 0;
+        double zipf_exponent = 1.0;
+        unsigned binary_percent = 25;
+    };
+
+    class Xoshiro256;
+
+    using Weights = std::array<double, 256>;
+    using SampleTable = std::array<unsigned char, 1 << 16>;
+
+    uint64_t splitmix64 (uint64_t &state);
+    bool distribution_from_name (const std::string &name, Distribution &distribution);
+    Weights distribution_weights (const Options &options);
+    SampleTable make_sample_table (const Weights &weights);
+    void fill_chunk (char *buffer, size_t size, uint64_t chunk, const Options &options, const SampleTable &table);
+    bool write_corpus (const Options &options);
+    int generate_program (int argc, char **argv);
+}
+
+namespace cfa::generate
+{
+    uint64_t splitmix64 (uint64_t &state)
+    {
+      uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+      return z ^ (z >> 31);
+    }
+
+    // xoshiro256**: small state, fast, and good enough for test data.
+    class Xoshiro256 {
+     public:
+        explicit Xoshiro256 (uint64_t seed)
+        {
+          for (uint64_t &word: m_state)
+            {
+              word = splitmix64 (seed);
+            }
+        }
+
+        uint64_t next ()
+        {
+          uint64_t result = rotl (m_state[1] * 5, 7) * 9;
+          uint64_t t = m_state[1] << 17;
+          m_state[2] ^= m_state[0];
+          m_state[3] ^= m_state[1];
+          m_state[1] ^= m_state[2];
+          m_state[0] ^= m_state[3];
+          m_state[2] ^= t;
+          m_state[3] = rotl (m_state[3], 45);
+          return result;
+        }
+
+     private:
+        static uint64_t rotl (uint64_t x, int k)
+        {
+          return (x << k) | (x >> (64 - k));
+        }
+
+        uint64_t m_state[4] {};
+    };
+
+    bool distribution_from_name (const std::string &name, Distribution &distribution)
+    {
+      if (name == "uniform")
+        {
+          distribution = Distribution::Uniform;
+        }
+      else if (name == "zipf")
+        {
+          distribution = Distribution::Zipf;
+        }
+      else if (name == "english")
+        {
+          distribution = Distribution::English;
+        }
+      else if (name == "mixed")
+        {
+          distribution = Distribution::Mixed;
+        }
+      else
+        {
+          return false;
+        }
+      return true;
+    }
+
+    // Relative weight of every byte value in the text parts of the corpus.
+    Weights distribution_weights (const Options &options)
+    {
+      Weights weights {};
+      switch (options.distribution)
+        {
+          case Distribution::Uniform:
+            {
+              // Printable ASCII, 32 - 126 ('SPACE' - '~').
+              for (int c = 32; c <= 126; ++c)
+                {
+                  weights[c] = 1;
+                }
+            }
+          break;
+          case Distribution::Zipf:
+            {
+              // Printable ASCII ranked roughly as in prose, weight 1 / rank^s.
+              std::string order = " etaoinshrdlcumwfgypbvkjxqz";
+              for (int c = 32; c <= 126; ++c)
+                {
+                  if (order.find ((char) c) == std::string::npos)
+                    {
+                      order.push_back ((char) c);
+                    }
+                }
+              for (size_t rank = 0; rank < order.size (); ++rank)
+                {
+                  weights[(unsigned char) order[rank]] = 1 / std::pow ((double) rank + 1, options.zipf_exponent);
+                }
+            }
+          break;
+          case Distribution::English:
+          case Distribution::Mixed:
+            {
+              // Letter frequencies of English text (percent), mostly lower case.
+              const double letters[26] = {8.167, 1.492, 2.782, 4.253, 12.702, 2.228, 2.015, 6.094, 6.966,
+                                          0.153, 0.772, 4.025, 2.406, 6.749, 7.507, 1.929, 0.095, 5.987,
+                                          6.327, 9.056, 2.758, 0.978, 2.360, 0.150, 1.974, 0.074};
+              for (int i = 0; i < 26; ++i)
+                {
+                  weights['a' + i] = letters[i] * 0.72;
+                  weights['A' + i] = letters[i] * 0.03;
+                }
+              weights[' '] = 18;
+              weights['\n'] = 1.5;
+              weights['.'] = 1;
+              weights[','] = 1;
+              weights['\''] = 0.3;
+              weights['"'] = 0.2;
+              weights['-'] = 0.2;
+              for (int c = '0'; c <= '9'; ++c)
+                {
+                  weights[c] = 0.05;
+                }
+            }
+          break;
+        }
+      return weights;
+    }
+
+    // Quantizes the weights into a table indexed by 16 random bits; every
+    // byte with a non-zero weight keeps at least one slot.
+    SampleTable make_sample_table (const Weights &weights)
+    {
+      SampleTable table {};
+      double total = 0;
+      int heaviest = 0;
+      for (int c = 0; c < 256; ++c)
+        {
+          total += weights[c];
+          heaviest = weights[c] > weights[heaviest] ? c : heaviest;
+        }
+
+      std::array<long, 256> slots {};
+      long used = 0;
+      for (int c = 0; c < 256; ++c)
+        {
+          if (weights[c] > 0)
+            {
+              slots[c] = std::max (1L, std::lround (weights[c] / total * (double) table.size ()));
+              used += slots[c];
+            }
+        }
+      // Rounding error is absorbed by the most frequent byte.
+      slots[heaviest] += (long) table.size () - used;
+
+      size_t slot = 0;
+      for (int c = 0; c < 256; ++c)
+        {
+          for (long i = 0; i < slots[c]; ++i)
+            {
+              table[slot++] = (unsigned char) c;
+            }
+        }
+      return table;
+    }
+
+    void fill_chunk (char *buffer, size_t size, uint64_t chunk, const Options &options, const SampleTable &table)
+    {
+      uint64_t state = options.seed ^ (chunk * 0xD1B54A32D192ED03ull);
+      Xoshiro256 random (splitmix64 (state));
+
+      for (size_t offset = 0; offset < size; offset += SEGMENT_SIZE)
+        {
+          size_t length = std::min (SEGMENT_SIZE, size - offset);
+          char *out = buffer + offset;
+
+          bool binary = options.distribution == Distribution::Mixed
+                        && random.next () % 100 < options.binary_percent;
+
+          for (size_t i = 0; i < length; i += 4)
+            {
+              uint64_t bits = random.next ();
+              size_t count = std::min<size_t> (4, length - i);
+              for (size_t j = 0; j < count; ++j, bits >>= 16)
+                {
+                  out[i + j] = binary ? (char) (bits & 0xFF) : (char) table[bits & 0xFFFF];
+                }
+            }
+        }
+    }
+
+    bool write_corpus (const Options &options)
+    {
+      // Size the file up front so every chunk can be written in place.
+      {
+        std::ofstream create (options.out, std::ios::binary | std::ios::trunc);
+        if (!create)
+          {
+            return false;
+          }
+      }
+      std::error_code error;
+      std::filesystem::resize_file (options.out, options.size, error);
+      if (error)
+        {
+          return false;
+        }
+
+      SampleTable table = make_sample_table (distribution_weights (options));
+      uint64_t chunks = (options.size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+      std::atomic<uint64_t> next_chunk {0};
+      std::atomic<bool> ok {true};
+
+      auto worker = [&]
+      {
+          std::vector<char> buffer (CHUNK_SIZE);
+          std::fstream file (options.out, std::ios::binary | std::ios::in | std::ios::out);
+          for (uint64_t chunk; (chunk = next_chunk++) < chunks && file;)
+            {
+              size_t offset = (size_t) chunk * CHUNK_SIZE;
+              size_t length = std::min (CHUNK_SIZE, options.size - offset);
+              fill_chunk (buffer.data (), length, chunk, options, table);
+              file.seekp ((std::streamoff) offset);
+              file.write (buffer.data (), (std::streamsize) length);
+            }
+          if (!file)
+            {
+              ok = false;
+            }
+      };
+
+      uint64_t threads = options.threads ? options.threads : std::max (1u, std::thread::hardware_concurrency ());
+      threads = std::min<uint64_t> (threads, std::max<uint64_t> (chunks, 1));
+      std::vector<std::thread> workers;
+      for (uint64_t i = 1; i < threads; ++i)
+        {
+          workers.emplace_back (worker);
+        }
+      worker ();
+      for (auto &thread: workers)
+        {
+          thread.join ();
+        }
+      return ok;
+    }
+
+    int generate_program (int argc, char **argv)
+    {
+      Options options;
+      for (int i = 0; i < argc; ++i)
+        {
+          std::string arg (argv[i]), key, value;
+          bool valid = utils::parse_option (arg, key, value);
+          if (valid && key == "out" && !value.empty ())
+            {
+              options.out = value;
+            }
+          else if (valid && key == "size")
+            {
+              valid = utils::parse_size (value, options.size);
+            }
+          else if (valid && key == "dist")
+            {
+              valid = distribution_from_name (value, options.distribution);
+            }
+          else if (valid && key == "seed")
+            {
+              valid = utils::parse_number (value, options.seed);
+            }
+          else if (valid && key == "threads")
+            {
+              valid = utils::parse_number (value, options.threads);
+            }
+          else if (valid && key == "zipf-s")
+            {
+              valid = utils::parse_number (value, options.zipf_exponent);
+            }
+          else if (valid && key == "binary")
+            {
+              valid = utils::parse_number (value, options.binary_percent) && options.binary_percent <= 100;
+            }
+          else
+            {
+              valid = false;
+            }
+
+          if (!valid)
+            {
+              printf ("Usage: cfa -generate [--out=FILE] [--size=1G] [--dist=uniform|zipf|english|mixed]\n"
+                      "                     [--seed=N] [--threads=N] [--zipf-s=1.0] [--binary=PERCENT]\n");
+              return 1;
+            }
+        }
+
+      if (!write_corpus (options))
+        {
+          fprintf (stderr, "cfa: could not write '%s'\n", options.out.c_str ());
+          return 1;
+        }
+      printf ("Created '%s'\n", options.out.c_str ());
+      return 0;
+    }
+}
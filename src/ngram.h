@@ -0,0 +1,340 @@
+// src/ngram.h
+
+#pragma once
+
+#include "cfa.h"
+
+//----------------------------------------------------
+//  [ SECTION N-GRAMS ]   Character n-gram frequencies
+//----------------------------------------------------
+
+namespace cfa::ngram
+{
+    const unsigned MIN_N = 2;
+    const unsigned MAX_N = 4;
+
+    // Tables with at most 2^MAX_DENSE_BITS slots are stored densely.
+    const unsigned MAX_DENSE_BITS = 15;
+
+    template<typename Num>
+    using NGramVec = CharVec<Num, std::string>;
+
+    class NGramCounter;
+
+    void print_ngram_count (std::unique_ptr <NGramVec<uint64_t>> &vec);
+    void print_ngram_rank (std::unique_ptr <NGramVec<float>> &vec);
+}
+
+namespace cfa::ngram
+{
+    // Counts runs of `n` consecutive bytes that are all accepted by a
+    // ParseType; a rejected byte breaks the run. Each gram is encoded as the
+    // alphabet positions of its characters packed into `n` fixed-width fields,
+    // so sliding the window is a shift and an or. Small alphabets (e.g. Alpha
+    // bigrams and trigrams, padded to 32 per axis) index a dense array
+    // directly; larger ones fall back to an open-addressing table.
+    class NGramCounter {
+     public:
+        NGramCounter (ParseType type, unsigned n)
+            : m_type (type), m_n (std::clamp (n, MIN_N, MAX_N))
+        {
+          // The alphabet is every key the fold table can produce for this
+          // ParseType, in key order.
+          const auto &table = utils::simd::FOLD_TABLES[parse_type_classes (type)];
+          std::array<bool, 256> present {};
+          for (unsigned c = 0; c < 256; ++c)
+            {
+              if (table[c] != utils::simd::REJECTED_KEY)
+                {
+                  present[table[c]] = true;
+                }
+            }
+
+          std::array<unsigned char, 256> index_of {};
+          for (unsigned key = 0; key < 256; ++key)
+            {
+              if (present[key])
+                {
+                  index_of[key] = (unsigned char) m_alphabet.size ();
+                  m_alphabet.push_back ((char) key);
+                }
+            }
+
+          // Map raw bytes straight to their alphabet position.
+          for (unsigned c = 0; c < 256; ++c)
+            {
+              m_position[c] = table[c] == utils::simd::REJECTED_KEY ? REJECTED : index_of[table[c]];
+            }
+
+          while ((1u << m_bits) < std::max<size_t> (m_alphabet.size (), 2))
+            {
+              ++m_bits;
+            }
+          m_mask = (1u << (m_bits * m_n)) - 1;
+
+          if (m_bits * m_n <= MAX_DENSE_BITS)
+            {
+              m_dense.assign ((size_t) m_mask + 1, 0);
+            }
+          else
+            {
+              grow ();
+            }
+        }
+
+        void feed (const char *data, size_t size)
+        {
+          uint32_t window = m_window;
+          unsigned run = m_run;
+
+          if (!m_dense.empty ())
+            {
+              uint64_t *dense = m_dense.data ();
+              for (size_t i = 0; i < size; ++i)
+                {
+                  unsigned char position = m_position[(unsigned char) data[i]];
+                  if (position == REJECTED)
+                    {
+                      run = 0;
+                      continue;
+                    }
+                  window = ((window << m_bits) | position) & m_mask;
+                  if (++run >= m_n)
+                    {
+                      ++dense[window];
+                    }
+                }
+            }
+          else
+            {
+              for (size_t i = 0; i < size; ++i)
+                {
+                  unsigned char position = m_position[(unsigned char) data[i]];
+                  if (position == REJECTED)
+                    {
+                      run = 0;
+                      continue;
+                    }
+                  window = ((window << m_bits) | position) & m_mask;
+                  if (++run >= m_n)
+                    {
+                      increment_sparse (window, 1);
+                    }
+                }
+            }
+
+          m_window = window;
+          m_run = std::min (run, m_n);
+        }
+
+        void feed (std::string_view str)
+        {
+          feed (str.data (), str.size ());
+        }
+
+        // Forgets the partial gram, e.g. between two unrelated documents.
+        void break_run ()
+        {
+          m_run = 0;
+        }
+
+        // Adds the counts of another counter with the same ParseType and n.
+        void merge (const NGramCounter &other)
+        {
+          assert (m_type == other.m_type && m_n == other.m_n);
+
+          if (!m_dense.empty ())
+            {
+              for (size_t i = 0; i < m_dense.size (); ++i)
+                {
+                  m_dense[i] += other.m_dense[i];
+                }
+              return;
+            }
+          for (size_t i = 0; i < other.m_keys.size (); ++i)
+            {
+              if (other.m_keys[i] != EMPTY)
+                {
+                  increment_sparse (other.m_keys[i] - 1, other.m_counts[i]);
+                }
+            }
+        }
+
+        [[nodiscard]] unsigned n () const
+        {
+          return m_n;
+        }
+
+        [[nodiscard]] ParseType type () const
+        {
+          return m_type;
+        }
+
+        [[nodiscard]] bool is_dense () const
+        {
+          return !m_dense.empty ();
+        }
+
+        template<typename Num>
+        std::unique_ptr <NGramVec<Num>> count_vec () const
+        {
+          auto vec = std::make_unique<NGramVec<Num>> ();
+          for_each ([&vec, this] (uint32_t gram, uint64_t n)
+                    {
+                        vec->emplace_back (decode (gram), (Num) n);
+                    });
+          return vec;
+        }
+
+        std::unique_ptr <NGramVec<float>> rank_vec () const
+        {
+          auto vec = count_vec<float> ();
+
+          // We use _sum_ to normalize the results.
+          double sum = 0;
+          for (auto &[gram, n]: vec->Data)
+            {
+              sum += n;
+            }
+          if (sum > 0)
+            {
+              for (auto &[gram, n]: vec->Data)
+                {
+                  n = (float) (n / sum);
+                }
+            }
+          return vec;
+        }
+
+     private:
+        static constexpr unsigned char REJECTED = 0xFF;
+        static constexpr uint32_t EMPTY = 0;
+
+        template<typename Func>
+        void for_each (Func &&func) const
+        {
+          for (size_t i = 0; i < m_dense.size (); ++i)
+            {
+              if (m_dense[i] != 0)
+                {
+                  func ((uint32_t) i, m_dense[i]);
+                }
+            }
+          for (size_t i = 0; i < m_keys.size (); ++i)
+            {
+              if (m_keys[i] != EMPTY)
+                {
+                  func (m_keys[i] - 1, m_counts[i]);
+                }
+            }
+        }
+
+        [[nodiscard]] std::string decode (uint32_t gram) const
+        {
+          std::string text (m_n, ' ');
+          for (unsigned i = m_n; i-- > 0;)
+            {
+              text[i] = m_alphabet[gram & ((1u << m_bits) - 1)];
+              gram >>= m_bits;
+            }
+          return text;
+        }
+
+        static size_t slot_of (uint32_t key, size_t capacity)
+        {
+          // Fibonacci hashing; the high half of the product mixes every key bit.
+          return (size_t) (((uint64_t) key * 0x9E3779B97F4A7C15ull) >> 32) & (capacity - 1);
+        }
+
+        void increment_sparse (uint32_t gram, uint64_t n)
+        {
+          // Keys are stored off by one so that 0 can mark an empty slot.
+          uint32_t key = gram + 1;
+          size_t slot = slot_of (key, m_keys.size ());
+          while (m_keys[slot] != key)
+            {
+              if (m_keys[slot] == EMPTY)
+                {
+                  m_keys[slot] = key;
+                  if (++m_used * 10 > m_keys.size () * 7)
+                    {
+                      m_counts[slot] = n;
+                      grow ();
+                      return;
+                    }
+                  break;
+                }
+              slot = (slot + 1) & (m_keys.size () - 1);
+            }
+          m_counts[slot] += n;
+        }
+
+        void grow ()
+        {
+          std::vector<uint32_t> keys (std::max<size_t> (m_keys.size () * 2, 1024), EMPTY);
+          std::vector<uint64_t> counts (keys.size (), 0);
+          for (size_t i = 0; i < m_keys.size (); ++i)
+            {
+              if (m_keys[i] == EMPTY)
+                {
+                  continue;
+                }
+              size_t slot = slot_of (m_keys[i], keys.size ());
+              while (keys[slot] != EMPTY)
+                {
+                  slot = (slot + 1) & (keys.size () - 1);
+                }
+              keys[slot] = m_keys[i];
+              counts[slot] = m_counts[i];
+            }
+          m_keys.swap (keys);
+          m_counts.swap (counts);
+        }
+
+        ParseType m_type;
+        unsigned m_n;
+        unsigned m_bits = 1;
+        uint32_t m_mask = 0;
+
+        std::string m_alphabet;
+        std::array<unsigned char, 256> m_position {};
+
+        std::vector<uint64_t> m_dense;
+        std::vector<uint32_t> m_keys;
+        std::vector<uint64_t> m_counts;
+        size_t m_used = 0;
+
+        uint32_t m_window = 0;
+        unsigned m_run = 0;
+    };
+
+    void print_ngram_count (std::unique_ptr <NGramVec<uint64_t>> &vec)
+    {
+      printf ("\n"
+              "------------------\n"
+              "   Gram   Count\n"
+              "------------------\n");
+
+      // Print the results
+      for (auto &[gram, n]: vec->Data)
+        {
+          printf ("    %-6s %llu\n", gram.c_str (), (unsigned long long) n);
+        }
+      printf ("\n");
+    }
+
+    void print_ngram_rank (std::unique_ptr <NGramVec<float>> &vec)
+    {
+      printf ("\n"
+              "---------------------\n"
+              "   Gram    Rank\n"
+              "---------------------\n");
+
+      // Print the results
+      for (auto &[gram, n]: vec->Data)
+        {
+          printf ("    %-6s %.4f\n", gram.c_str (), n);
+        }
+      printf ("\n");
+    }
+}
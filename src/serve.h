@@ -0,0 +1,1175 @@
+// src/serve.h
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include "cfa.h"
+#include "generate.h"
+#include "thread_pool.h"
+
+#ifdef UTILS_HAS_MMAP
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+//----------------------------------------------------
+//  [ SECTION SERVE ]   Analysis daemon on a Unix socket
+//----------------------------------------------------
+
+namespace cfa::serve
+{
+    // Histograms of this many recently requested files are kept.
+    const size_t DEFAULT_CACHE_ENTRIES = 1024;
+    // Largest buffer a client may send inline.
+    const size_t DEFAULT_MAX_INLINE = 64 * 1024 * 1024;
+    // Longest request line, path included.
+    const size_t MAX_REQUEST_LINE = 64 * 1024;
+    // A client that stops halfway through a request is dropped after this.
+    const int RECEIVE_TIMEOUT_S = 10;
+    // As is one that stops reading its replies, so it cannot hold a worker.
+    const int SEND_TIMEOUT_S = 10;
+    // How often the accept loop checks for a stop signal.
+    const int POLL_INTERVAL_MS = 200;
+
+    enum class Source {
+        File,
+        Inline,
+    };
+
+    // One question to the server: the counts or ranks of a file, or of
+    // bytes sent along with the request.
+    struct Request {
+        bool rank = false;
+        ParseType type = ParseType::Alpha;
+        std::string sort = "char";
+        Source source = Source::File;
+        std::string path;
+        std::string data;
+    };
+
+    struct Response {
+        bool ok = false;
+        std::string error;
+        uint64_t bytes = 0;
+        std::string origin;
+        CharVec<uint64_t> counts;
+        CharVec<float> ranks;
+    };
+
+    struct ServerOptions {
+        std::string socket_path;
+        unsigned threads = 0;
+        size_t cache_entries = DEFAULT_CACHE_ENTRIES;
+        size_t max_inline = DEFAULT_MAX_INLINE;
+    };
+
+    struct ClientOptions {
+        std::string socket_path;
+        Request request;
+        std::vector<std::string> inputs;
+    };
+
+    struct LoadOptions {
+        std::string socket_path;
+        Request request;
+        unsigned clients = 4;
+        uint64_t requests = 10000;
+        size_t inline_size = 0;
+        std::vector<std::string> files;
+    };
+
+    class Socket;
+    class HistogramLru;
+    class Server;
+    class Client;
+
+    std::string default_socket_path ();
+    std::string format_request (const Request &request);
+    bool parse_request (const std::string &line, Request &request, size_t &payload);
+    bool parse_common_option (const std::string &key, const std::string &value, std::string &socket_path,
+                              Request &request);
+    void print_serve_usage ();
+    void print_client_usage ();
+    void print_load_test_usage ();
+    int serve_program (int argc, char **argv);
+    int client_program (int argc, char **argv);
+    int load_test_program (int argc, char **argv);
+}
+
+namespace cfa::serve
+{
+    // Set by SIGINT or SIGTERM; the server stops accepting and drains.
+    std::atomic<bool> g_stop {false};
+
+    // $CFA_SOCKET, else the user's runtime directory, else /tmp.
+    std::string default_socket_path ()
+    {
+      if (const char *path = std::getenv ("CFA_SOCKET"); path && *path)
+        {
+          return path;
+        }
+      if (const char *dir = std::getenv ("XDG_RUNTIME_DIR"); dir && *dir)
+        {
+          return std::string (dir) + "/cfa.sock";
+        }
+#ifdef UTILS_HAS_MMAP
+      return "/tmp/cfa-" + std::to_string (getuid ()) + ".sock";
+#else
+      return "cfa.sock";
+#endif
+    }
+
+    // The request line, e.g. `count alpha value-desc file /var/log/syslog`
+    // or `rank ascii char data 1024` followed by 1024 bytes.
+    std::string format_request (const Request &request)
+    {
+      std::string line = request.rank ? "rank " : "count ";
+      line += parse_type_name (request.type);
+      line += ' ';
+      line += request.sort;
+      if (request.source == Source::File)
+        {
+          line += " file " + request.path;
+        }
+      else
+        {
+          line += " data " + std::to_string (request.data.size ());
+        }
+      return line + '\n';
+    }
+
+    // Parses a request line without its newline. For inline data `payload`
+    // is the number of bytes that follow.
+    bool parse_request (const std::string &line, Request &request, size_t &payload)
+    {
+      size_t fields[4];
+      size_t start = 0;
+      for (size_t &end: fields)
+        {
+          end = line.find (' ', start);
+          if (end == std::string::npos)
+            {
+              return false;
+            }
+          start = end + 1;
+        }
+      std::string mode = line.substr (0, fields[0]);
+      std::string type = line.substr (fields[0] + 1, fields[1] - fields[0] - 1);
+      request.sort = line.substr (fields[1] + 1, fields[2] - fields[1] - 1);
+      std::string source = line.substr (fields[2] + 1, fields[3] - fields[2] - 1);
+      std::string argument = line.substr (fields[3] + 1);
+
+      SortMethod sort;
+      if ((mode != "count" && mode != "rank") || !parse_type_from_name (type, request.type)
+          || !sort_method_from_name (request.sort, sort) || argument.empty ())
+        {
+          return false;
+        }
+      request.rank = mode == "rank";
+      payload = 0;
+      if (source == "file")
+        {
+          request.source = Source::File;
+          request.path = argument;
+          return true;
+        }
+      if (source == "data")
+        {
+          request.source = Source::Inline;
+          return utils::parse_number (argument, payload);
+        }
+      return false;
+    }
+
+#ifdef UTILS_HAS_MMAP
+    // A connected stream socket read in lines and counted runs of bytes.
+    // Bytes received past the current line stay buffered for the next call.
+    class Socket {
+     public:
+        explicit Socket (int fd = -1)
+            : m_fd (fd)
+        {
+        }
+
+        Socket (const Socket &) = delete;
+        Socket &operator= (const Socket &) = delete;
+
+        ~Socket ()
+        {
+          close ();
+        }
+
+        bool connect (const std::string &path)
+        {
+          close ();
+          sockaddr_un address {};
+          if (path.size () >= sizeof (address.sun_path))
+            {
+              return false;
+            }
+          address.sun_family = AF_UNIX;
+          std::memcpy (address.sun_path, path.c_str (), path.size () + 1);
+          m_fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+          if (m_fd < 0 || ::connect (m_fd, (const sockaddr *) &address, sizeof (address)) != 0)
+            {
+              close ();
+              return false;
+            }
+          return true;
+        }
+
+        void close ()
+        {
+          if (m_fd >= 0)
+            {
+              ::close (m_fd);
+              m_fd = -1;
+            }
+          m_buffer.clear ();
+        }
+
+        // False at the end of the stream, on an error or when no newline
+        // arrives within `max` bytes.
+        bool read_line (std::string &line, size_t max)
+        {
+          size_t scanned = 0;
+          for (;;)
+            {
+              size_t newline = m_buffer.find ('\n', scanned);
+              if (newline != std::string::npos)
+                {
+                  line.assign (m_buffer, 0, newline);
+                  m_buffer.erase (0, newline + 1);
+                  return true;
+                }
+              if (m_buffer.size () > max)
+                {
+                  return false;
+                }
+              scanned = m_buffer.size ();
+              if (!receive ())
+                {
+                  return false;
+                }
+            }
+        }
+
+        bool read_exact (std::string &data, size_t size)
+        {
+          size_t buffered = std::min (size, m_buffer.size ());
+          data.assign (m_buffer, 0, buffered);
+          m_buffer.erase (0, buffered);
+          data.resize (size);
+          for (size_t done = buffered; done < size;)
+            {
+              ssize_t result = recv (m_fd, &data[done], size - done, 0);
+              if (result < 0 && errno == EINTR)
+                {
+                  continue;
+                }
+              if (result <= 0)
+                {
+                  return false;
+                }
+              done += (size_t) result;
+            }
+          return true;
+        }
+
+        bool write_all (std::string_view data)
+        {
+          while (!data.empty ())
+            {
+              ssize_t result = send (m_fd, data.data (), data.size (), MSG_NOSIGNAL);
+              if (result < 0 && errno == EINTR)
+                {
+                  continue;
+                }
+              if (result <= 0)
+                {
+                  return false;
+                }
+              data.remove_prefix ((size_t) result);
+            }
+          return true;
+        }
+
+        // True when a whole request line is already buffered.
+        [[nodiscard]] bool has_line () const
+        {
+          return m_buffer.find ('\n') != std::string::npos;
+        }
+
+        [[nodiscard]] int fd () const
+        {
+          return m_fd;
+        }
+
+     private:
+        bool receive ()
+        {
+          char chunk[16 * 1024];
+          for (;;)
+            {
+              ssize_t result = recv (m_fd, chunk, sizeof (chunk), 0);
+              if (result < 0 && errno == EINTR)
+                {
+                  continue;
+                }
+              if (result <= 0)
+                {
+                  return false;
+                }
+              m_buffer.append (chunk, (size_t) result);
+              return true;
+            }
+        }
+
+        int m_fd;
+        std::string m_buffer;
+    };
+#endif
+
+    // Raw byte counts of the most recently requested files, keyed by what
+    // the filesystem says the file is (device, inode, size and modification
+    // time), so a file that changes is counted again and hard links share an
+    // entry. Raw counts answer every ParseType, count or rank.
+    class HistogramLru {
+     public:
+        explicit HistogramLru (size_t capacity)
+            : m_capacity (capacity)
+        {
+        }
+
+        bool find (const utils::file::FileIdentity &identity, ByteHistogram &histogram)
+        {
+          std::lock_guard<std::mutex> lock (m_mutex);
+          auto found = m_index.find (identity);
+          if (found == m_index.end ())
+            {
+              ++m_misses;
+              return false;
+            }
+          m_entries.splice (m_entries.begin (), m_entries, found->second);
+          histogram = found->second->histogram;
+          ++m_hits;
+          return true;
+        }
+
+        void insert (const utils::file::FileIdentity &identity, const ByteHistogram &histogram)
+        {
+          if (m_capacity == 0)
+            {
+              return;
+            }
+          std::lock_guard<std::mutex> lock (m_mutex);
+          if (auto found = m_index.find (identity); found != m_index.end ())
+            {
+              m_entries.splice (m_entries.begin (), m_entries, found->second);
+              return;
+            }
+          if (m_entries.size () >= m_capacity)
+            {
+              m_index.erase (m_entries.back ().identity);
+              m_entries.pop_back ();
+            }
+          m_entries.push_front ({identity, histogram});
+          m_index[identity] = m_entries.begin ();
+        }
+
+        [[nodiscard]] uint64_t hits () const
+        {
+          return m_hits;
+        }
+
+        [[nodiscard]] uint64_t misses () const
+        {
+          return m_misses;
+        }
+
+     private:
+        struct Entry {
+            utils::file::FileIdentity identity;
+            ByteHistogram histogram;
+        };
+
+        struct IdentityHash {
+            size_t operator() (const utils::file::FileIdentity &identity) const
+            {
+              uint64_t h = identity.inode * 0x9E3779B97F4A7C15ULL;
+              h ^= (identity.device + (h << 6) + (h >> 2)) * 0xBF58476D1CE4E5B9ULL;
+              h ^= identity.size + (uint64_t) identity.mtime_ns * 0x94D049BB133111EBULL;
+              return (size_t) (h ^ (h >> 31));
+            }
+        };
+
+        struct IdentityEqual {
+            bool operator() (const utils::file::FileIdentity &a, const utils::file::FileIdentity &b) const
+            {
+              return a.device == b.device && a.inode == b.inode && a.size == b.size && a.mtime_ns == b.mtime_ns;
+            }
+        };
+
+        size_t m_capacity;
+        std::mutex m_mutex;
+        // Most recently used first.
+        std::list<Entry> m_entries;
+        std::unordered_map<utils::file::FileIdentity, std::list<Entry>::iterator, IdentityHash, IdentityEqual> m_index;
+        std::atomic<uint64_t> m_hits {0};
+        std::atomic<uint64_t> m_misses {0};
+    };
+
+#ifdef UTILS_HAS_MMAP
+    // Listens on a Unix socket and answers requests with a fixed pool of
+    // workers. One thread polls the listening socket and every idle
+    // connection; a connection with a request waiting is handed to a worker,
+    // which answers everything the client has sent and then hands the
+    // connection back. Idle clients therefore hold no worker, and clients
+    // may keep their connection open between requests.
+    class Server {
+     public:
+        explicit Server (const ServerOptions &options)
+            : m_options (options), m_cache (options.cache_entries),
+              m_pool (resolve_thread_count (options.threads))
+        {
+        }
+
+        Server (const Server &) = delete;
+        Server &operator= (const Server &) = delete;
+
+        ~Server ()
+        {
+          m_pool.wait ();
+          if (m_listen >= 0)
+            {
+              ::close (m_listen);
+            }
+          if (m_bound)
+            {
+              unlink (m_options.socket_path.c_str ());
+            }
+          for (int fd: m_wake)
+            {
+              if (fd >= 0)
+                {
+                  ::close (fd);
+                }
+            }
+        }
+
+        // Binds the socket. A socket file left by a server that is gone is
+        // replaced; one that still answers is not, and neither is anything
+        // at the path that is not a socket.
+        bool listen ()
+        {
+          const std::string &path = m_options.socket_path;
+          sockaddr_un address {};
+          if (path.empty () || path.size () >= sizeof (address.sun_path))
+            {
+              fprintf (stderr, "cfa: socket path too long: '%s'\n", path.c_str ());
+              return false;
+            }
+          if (Socket probe; probe.connect (path))
+            {
+              fprintf (stderr, "cfa: a server is already listening on '%s'\n", path.c_str ());
+              return false;
+            }
+          if (struct stat status; lstat (path.c_str (), &status) == 0)
+            {
+              if (!S_ISSOCK (status.st_mode))
+                {
+                  fprintf (stderr, "cfa: '%s' exists and is not a socket\n", path.c_str ());
+                  return false;
+                }
+              unlink (path.c_str ());
+            }
+
+          address.sun_family = AF_UNIX;
+          std::memcpy (address.sun_path, path.c_str (), path.size () + 1);
+          m_listen = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+          m_bound = m_listen >= 0 && bind (m_listen, (const sockaddr *) &address, sizeof (address)) == 0;
+          if (!m_bound || ::listen (m_listen, SOMAXCONN) != 0 || pipe2 (m_wake, O_CLOEXEC | O_NONBLOCK) != 0)
+            {
+              fprintf (stderr, "cfa: could not listen on '%s': %s\n", path.c_str (), strerror (errno));
+              return false;
+            }
+          return true;
+        }
+
+        // Serves until `stop` is set, then waits until workers have answered
+        // the requests they hold.
+        void run (const std::atomic<bool> &stop)
+        {
+          std::vector<int> idle;
+          std::vector<pollfd> fds;
+          while (!stop)
+            {
+              fds.clear ();
+              fds.push_back ({m_listen, POLLIN, 0});
+              fds.push_back ({m_wake[0], POLLIN, 0});
+              for (int fd: idle)
+                {
+                  fds.push_back ({fd, POLLIN, 0});
+                }
+              if (poll (fds.data (), fds.size (), POLL_INTERVAL_MS) <= 0)
+                {
+                  continue;
+                }
+
+              std::vector<int> waiting;
+              for (size_t i = 2; i < fds.size (); ++i)
+                {
+                  if (fds[i].revents)
+                    {
+                      dispatch (fds[i].fd);
+                    }
+                  else
+                    {
+                      waiting.push_back (fds[i].fd);
+                    }
+                }
+              idle.swap (waiting);
+
+              if (fds[1].revents & POLLIN)
+                {
+                  char drain[256];
+                  while (read (m_wake[0], drain, sizeof (drain)) > 0)
+                    {
+                    }
+                  std::lock_guard<std::mutex> lock (m_mutex);
+                  idle.insert (idle.end (), m_returned.begin (), m_returned.end ());
+                  m_returned.clear ();
+                }
+              if (fds[0].revents & POLLIN)
+                {
+                  accept_all (idle);
+                }
+            }
+          m_pool.wait ();
+        }
+
+        [[nodiscard]] uint64_t requests () const
+        {
+          return m_requests;
+        }
+
+        [[nodiscard]] const HistogramLru &cache () const
+        {
+          return m_cache;
+        }
+
+     private:
+        void accept_all (std::vector<int> &idle)
+        {
+          for (;;)
+            {
+              int fd = accept4 (m_listen, nullptr, nullptr, SOCK_CLOEXEC);
+              if (fd < 0)
+                {
+                  return;
+                }
+              timeval receive_timeout {RECEIVE_TIMEOUT_S, 0};
+              timeval send_timeout {SEND_TIMEOUT_S, 0};
+              setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof (receive_timeout));
+              setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof (send_timeout));
+              std::lock_guard<std::mutex> lock (m_mutex);
+              m_connections[fd] = std::make_unique<Socket> (fd);
+              idle.push_back (fd);
+            }
+        }
+
+        void dispatch (int fd)
+        {
+          Socket *connection;
+          {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            connection = m_connections[fd].get ();
+          }
+          m_pool.submit ([this, connection]
+                         { serve (*connection); });
+        }
+
+        // Runs on a worker: answers every request the client has sent so
+        // far, then returns the connection to the poll loop.
+        void serve (Socket &connection)
+        {
+          do
+            {
+              if (!answer (connection))
+                {
+                  std::lock_guard<std::mutex> lock (m_mutex);
+                  m_connections.erase (connection.fd ());
+                  return;
+                }
+            }
+          while (connection.has_line ());
+
+          {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            m_returned.push_back (connection.fd ());
+          }
+          char wake = 0;
+          (void) !write (m_wake[1], &wake, 1);
+        }
+
+        // Reads and answers one request. False once the connection should be
+        // closed: the client hung up, or sent something that cannot be
+        // followed by another request.
+        bool answer (Socket &connection)
+        {
+          std::string line;
+          if (!connection.read_line (line, MAX_REQUEST_LINE))
+            {
+              return false;
+            }
+
+          Request request;
+          size_t payload = 0;
+          if (!parse_request (line, request, payload))
+            {
+              connection.write_all ("error malformed request\n");
+              return false;
+            }
+          if (request.source == Source::Inline)
+            {
+              if (payload > m_options.max_inline)
+                {
+                  connection.write_all ("error inline data too large\n");
+                  return false;
+                }
+              if (!connection.read_exact (request.data, payload))
+                {
+                  return false;
+                }
+            }
+          ++m_requests;
+
+          ByteHistogram histogram;
+          std::string origin = "inline", error;
+          if (request.source == Source::Inline)
+            {
+              histogram.feed (request.data);
+            }
+          else if (!file_histogram (request.path, histogram, origin, error))
+            {
+              return connection.write_all ("error " + error + "\n");
+            }
+          return connection.write_all (format_response (request, histogram, origin));
+        }
+
+        bool file_histogram (const std::string &path, ByteHistogram &histogram, std::string &origin,
+                             std::string &error)
+        {
+          utils::file::FileIdentity identity;
+          if (!utils::file::identify (path, identity))
+            {
+              error = "cannot open '" + path + "'";
+              return false;
+            }
+          if (m_cache.find (identity, histogram))
+            {
+              origin = "hit";
+              return true;
+            }
+
+          utils::file::MappedFile file;
+          if (!file.open (path))
+            {
+              error = "cannot open '" + path + "'";
+              return false;
+            }
+          compress::Format format;
+          compress::Status status = compress::feed_file (file, [&histogram] (const char *data, size_t size)
+          { histogram.feed (data, size); }, &format);
+          if (status == compress::Status::Unsupported || status == compress::Status::Corrupt)
+            {
+              error = "'" + path + "': " + compress::status_message (status, format);
+              return false;
+            }
+
+          // Only cache what was counted if the file did not change meanwhile.
+          utils::file::FileIdentity after;
+          if (utils::file::identify (path, after) && after.device == identity.device && after.inode == identity.inode
+              && after.size == identity.size && after.mtime_ns == identity.mtime_ns)
+            {
+              m_cache.insert (identity, histogram);
+            }
+          origin = "miss";
+          return true;
+        }
+
+        // `ok <bytes> <entries> <hit|miss|inline>`, then one `<byte> <value>`
+        // line per character.
+        static std::string format_response (const Request &request, const ByteHistogram &histogram,
+                                            const std::string &origin)
+        {
+          SortMethod sort = SortMethod::Char_Ascending;
+          sort_method_from_name (request.sort, sort);
+
+          std::string out;
+          char line[64];
+          auto append = [&out, &line] (int length)
+          { out.append (line, (size_t) length); };
+          if (request.rank)
+            {
+              auto vec = histogram.rank_vec (request.type);
+              vec->sort (sort);
+              append (snprintf (line, sizeof (line), "ok %llu %zu %s\n", (unsigned long long) histogram.bytes_fed (),
+                                vec->Data.size (), origin.c_str ()));
+              for (auto &[c, rank]: vec->Data)
+                {
+                  append (snprintf (line, sizeof (line), "%u %.9g\n", (unsigned) (unsigned char) c, rank));
+                }
+            }
+          else
+            {
+              auto vec = histogram.count_vec<uint64_t> (request.type);
+              vec->sort (sort);
+              append (snprintf (line, sizeof (line), "ok %llu %zu %s\n", (unsigned long long) histogram.bytes_fed (),
+                                vec->Data.size (), origin.c_str ()));
+              for (auto &[c, count]: vec->Data)
+                {
+                  append (snprintf (line, sizeof (line), "%u %llu\n", (unsigned) (unsigned char) c,
+                                    (unsigned long long) count));
+                }
+            }
+          return out;
+        }
+
+        ServerOptions m_options;
+        HistogramLru m_cache;
+        int m_listen = -1;
+        // Only a socket file this server created is removed on exit.
+        bool m_bound = false;
+        int m_wake[2] = {-1, -1};
+        std::mutex m_mutex;
+        std::unordered_map<int, std::unique_ptr<Socket>> m_connections;
+        std::vector<int> m_returned;
+        std::atomic<uint64_t> m_requests {0};
+        // Last, so its workers are joined before anything they use goes away.
+        utils::WorkStealingPool m_pool;
+    };
+
+    // One connection to a server, reused for any number of requests.
+    class Client {
+     public:
+        bool connect (const std::string &socket_path)
+        {
+          return m_socket.connect (socket_path);
+        }
+
+        // False when the server could not be reached or broke the protocol;
+        // an error the server reports comes back in `response.error`.
+        bool request (const Request &request, Response &response)
+        {
+          response = Response ();
+          std::string header = format_request (request);
+          if (!m_socket.write_all (header) || (request.source == Source::Inline && !m_socket.write_all (request.data)))
+            {
+              return false;
+            }
+
+          std::string line;
+          if (!m_socket.read_line (line, MAX_REQUEST_LINE))
+            {
+              return false;
+            }
+          if (line.compare (0, 6, "error ") == 0)
+            {
+              response.error = line.substr (6);
+              return true;
+            }
+
+          unsigned long long bytes;
+          size_t entries;
+          char origin[16];
+          if (sscanf (line.c_str (), "ok %llu %zu %15s", &bytes, &entries, origin) != 3 || entries > 256)
+            {
+              return false;
+            }
+          response.bytes = bytes;
+          response.origin = origin;
+          for (size_t i = 0; i < entries; ++i)
+            {
+              unsigned c;
+              char *end = nullptr;
+              if (!m_socket.read_line (line, MAX_REQUEST_LINE) || sscanf (line.c_str (), "%u", &c) != 1)
+                {
+                  return false;
+                }
+              const char *value = line.c_str () + line.find (' ') + 1;
+              if (request.rank)
+                {
+                  response.ranks.emplace_back ((char) c, std::strtof (value, &end));
+                }
+              else
+                {
+                  response.counts.emplace_back ((char) c, (uint64_t) std::strtoull (value, &end, 10));
+                }
+            }
+          response.ok = true;
+          return true;
+        }
+
+     private:
+        Socket m_socket;
+    };
+#endif
+
+    // Options shared by all three programs; false for anything else.
+    bool parse_common_option (const std::string &key, const std::string &value, std::string &socket_path,
+                              Request &request)
+    {
+      if (key == "socket" && !value.empty ())
+        {
+          socket_path = value;
+          return true;
+        }
+      if (key == "type")
+        {
+          return parse_type_from_name (value, request.type);
+        }
+      if (key == "sort")
+        {
+          SortMethod sort;
+          request.sort = value;
+          return sort_method_from_name (value, sort);
+        }
+      if (key == "rank")
+        {
+          request.rank = true;
+          return true;
+        }
+      return false;
+    }
+
+    void print_serve_usage ()
+    {
+      printf ("Usage: cfa -serve [options]\n"
+              "\t--socket=PATH   Unix socket to listen on (default: $CFA_SOCKET,\n"
+              "\t                $XDG_RUNTIME_DIR/cfa.sock or /tmp/cfa-UID.sock)\n"
+              "\t--threads=N     worker threads (default: all cores)\n"
+              "\t--cache=N       histograms of recent files kept in memory (default: 1024)\n"
+              "\t--max-inline=SIZE   largest buffer a client may send, e.g. 16M (default: 64M)\n");
+    }
+
+    int serve_program (int argc, char **argv)
+    {
+      ServerOptions options;
+      options.socket_path = default_socket_path ();
+      for (int i = 0; i < argc; ++i)
+        {
+          std::string arg (argv[i]), key, value;
+          Request unused;
+          if (!utils::parse_option (arg, key, value))
+            {
+              print_serve_usage ();
+              return 1;
+            }
+          if (key == "socket" && parse_common_option (key, value, options.socket_path, unused))
+            {
+              continue;
+            }
+          if (key == "threads" && utils::parse_number (value, options.threads))
+            {
+              continue;
+            }
+          else if (key == "cache" && utils::parse_number (value, options.cache_entries))
+            {
+              continue;
+            }
+          else if (key == "max-inline" && utils::parse_size (value, options.max_inline))
+            {
+              continue;
+            }
+          else
+            {
+              fprintf (stderr, "cfa: invalid option '%s'\n", arg.c_str ());
+              print_serve_usage ();
+              return 1;
+            }
+        }
+
+#ifdef UTILS_HAS_MMAP
+      Server server (options);
+      if (!server.listen ())
+        {
+          return 1;
+        }
+
+      g_stop = false;
+      std::signal (SIGINT, [] (int)
+      { g_stop = true; });
+      std::signal (SIGTERM, [] (int)
+      { g_stop = true; });
+      fprintf (stderr, "cfa: serving on %s\n", options.socket_path.c_str ());
+
+      server.run (g_stop);
+
+      std::signal (SIGINT, SIG_DFL);
+      std::signal (SIGTERM, SIG_DFL);
+      fprintf (stderr, "cfa: %llu requests, %llu cache hits, %llu misses\n", (unsigned long long) server.requests (),
+               (unsigned long long) server.cache ().hits (), (unsigned long long) server.cache ().misses ());
+      return 0;
+#else
+      fprintf (stderr, "cfa: serve mode is not supported on this platform\n");
+      return 1;
+#endif
+    }
+
+    void print_client_usage ()
+    {
+      printf ("Usage: cfa -client [options] <file|->...\n"
+              "\t--socket=PATH   server socket (default: as for -serve)\n"
+              "\t--type=alpha|digit|symbol|alnum|ascii   (default: alpha)\n"
+              "\t--sort=char|char-desc|value|value-desc|none   (default: char)\n"
+              "\t--rank          print ranks instead of counts\n"
+              "Files are read by the server; `-` sends standard input along with the request.\n");
+    }
+
+    int client_program (int argc, char **argv)
+    {
+      ClientOptions options;
+      options.socket_path = default_socket_path ();
+      for (int i = 0; i < argc; ++i)
+        {
+          std::string arg (argv[i]), key, value;
+          if (!utils::parse_option (arg, key, value))
+            {
+              options.inputs.push_back (arg);
+            }
+          else if (!parse_common_option (key, value, options.socket_path, options.request))
+            {
+              fprintf (stderr, "cfa: invalid option '%s'\n", arg.c_str ());
+              print_client_usage ();
+              return 1;
+            }
+        }
+      if (options.inputs.empty ())
+        {
+          print_client_usage ();
+          return 1;
+        }
+
+#ifdef UTILS_HAS_MMAP
+      Client client;
+      if (!client.connect (options.socket_path))
+        {
+          fprintf (stderr, "cfa: could not connect to '%s'\n", options.socket_path.c_str ());
+          return 1;
+        }
+
+      int status = 0;
+      for (auto &input: options.inputs)
+        {
+          Request request = options.request;
+          if (input == "-")
+            {
+              request.source = Source::Inline;
+              request.data.assign (std::istreambuf_iterator<char> (std::cin), std::istreambuf_iterator<char> ());
+            }
+          else
+            {
+              // The server resolves paths from its own working directory.
+              std::error_code error;
+              request.path = std::filesystem::absolute (input, error).string ();
+            }
+
+          Response response;
+          if (!client.request (request, response))
+            {
+              fprintf (stderr, "cfa: lost connection to '%s'\n", options.socket_path.c_str ());
+              return 1;
+            }
+          if (!response.error.empty ())
+            {
+              fprintf (stderr, "cfa: %s\n", response.error.c_str ());
+              status = 1;
+              continue;
+            }
+
+          printf ("==> %s (%llu bytes, %s) <==", input.c_str (), (unsigned long long) response.bytes,
+                  response.origin.c_str ());
+          if (request.rank)
+            {
+              auto vec = std::make_unique<CharVec<float>> (std::move (response.ranks));
+              print_char_rank (vec);
+            }
+          else
+            {
+              auto vec = std::make_unique<CharVec<uint64_t>> (std::move (response.counts));
+              print_char_count (vec);
+            }
+        }
+      return status;
+#else
+      fprintf (stderr, "cfa: client mode is not supported on this platform\n");
+      return 1;
+#endif
+    }
+
+    void print_load_test_usage ()
+    {
+      printf ("Usage: cfa -loadtest [options] [file]...\n"
+              "\t--socket=PATH   server socket (default: as for -serve)\n"
+              "\t--clients=N     concurrent connections (default: 4)\n"
+              "\t--requests=N    requests in total (default: 10000)\n"
+              "\t--inline=SIZE   send SIZE bytes of text with each request instead of\n"
+              "\t                naming the files\n"
+              "\t--type, --sort, --rank   as for -client\n"
+              "Each client keeps one connection and cycles through the files.\n");
+    }
+
+    int load_test_program (int argc, char **argv)
+    {
+      LoadOptions options;
+      options.socket_path = default_socket_path ();
+      for (int i = 0; i < argc; ++i)
+        {
+          std::string arg (argv[i]), key, value;
+          if (!utils::parse_option (arg, key, value))
+            {
+              std::error_code error;
+              options.files.push_back (std::filesystem::absolute (arg, error).string ());
+              continue;
+            }
+          if (parse_common_option (key, value, options.socket_path, options.request))
+            {
+              continue;
+            }
+          if (key == "clients" && utils::parse_number (value, options.clients))
+            {
+              options.clients = std::max (1u, options.clients);
+            }
+          else if (key == "requests" && utils::parse_number (value, options.requests))
+            {
+              continue;
+            }
+          else if (key == "inline" && utils::parse_size (value, options.inline_size) && options.inline_size > 0)
+            {
+              continue;
+            }
+          else
+            {
+              fprintf (stderr, "cfa: invalid option '%s'\n", arg.c_str ());
+              print_load_test_usage ();
+              return 1;
+            }
+        }
+      if (options.files.empty () == (options.inline_size == 0))
+        {
+          print_load_test_usage ();
+          return 1;
+        }
+
+#ifdef UTILS_HAS_MMAP
+      // English-like text from the corpus generator, so every type has work.
+      std::string text (options.inline_size, ' ');
+      if (!text.empty ())
+        {
+          generate::Options corpus;
+          corpus.distribution = generate::Distribution::English;
+          auto table = generate::make_sample_table (generate::distribution_weights (corpus));
+          for (size_t offset = 0; offset < text.size (); offset += generate::CHUNK_SIZE)
+            {
+              generate::fill_chunk (&text[offset], std::min (generate::CHUNK_SIZE, text.size () - offset),
+                                    offset / generate::CHUNK_SIZE, corpus, table);
+            }
+        }
+
+      using clock = std::chrono::steady_clock;
+      std::vector<std::vector<uint64_t>> latencies (options.clients);
+      std::atomic<uint64_t> next {0}, errors {0};
+      std::atomic<bool> failed {false};
+      auto start = clock::now ();
+      {
+        std::vector<std::thread> clients;
+        for (unsigned i = 0; i < options.clients; ++i)
+          {
+            clients.emplace_back ([&, i]
+                                  {
+                                      Client client;
+                                      if (!client.connect (options.socket_path))
+                                        {
+                                          failed = true;
+                                          return;
+                                        }
+                                      Request request = options.request;
+                                      if (!text.empty ())
+                                        {
+                                          request.source = Source::Inline;
+                                          request.data = text;
+                                        }
+                                      Response response;
+                                      for (uint64_t n = next++; n < options.requests && !failed; n = next++)
+                                        {
+                                          if (text.empty ())
+                                            {
+                                              request.path = options.files[n % options.files.size ()];
+                                            }
+                                          auto sent = clock::now ();
+                                          if (!client.request (request, response))
+                                            {
+                                              failed = true;
+                                              return;
+                                            }
+                                          latencies[i].push_back ((uint64_t) std::chrono::duration_cast<
+                                              std::chrono::nanoseconds> (clock::now () - sent).count ());
+                                          errors += !response.ok;
+                                        }
+                                  });
+          }
+        for (auto &client: clients)
+          {
+            client.join ();
+          }
+      }
+      double seconds = std::chrono::duration<double> (clock::now () - start).count ();
+      if (failed)
+        {
+          fprintf (stderr, "cfa: lost connection to '%s'\n", options.socket_path.c_str ());
+          return 1;
+        }
+
+      std::vector<uint64_t> all;
+      for (auto &client: latencies)
+        {
+          all.insert (all.end (), client.begin (), client.end ());
+        }
+      std::sort (all.begin (), all.end ());
+      auto percentile = [&all] (double p)
+      {
+          return all.empty () ? 0.0 : (double) all[std::min (all.size () - 1, (size_t) (p * (double) all.size ()))] / 1e6;
+      };
+
+      printf ("\n"
+              "-----------------------------------\n"
+              "   Load test\n"
+              "-----------------------------------\n"
+              "   clients          %u\n"
+              "   requests         %zu\n"
+              "   errors           %llu\n"
+              "   seconds          %.3f\n"
+              "   requests/s       %.0f\n"
+              "   latency p50      %.3f ms\n"
+              "   latency p90      %.3f ms\n"
+              "   latency p99      %.3f ms\n"
+              "   latency max      %.3f ms\n"
+              "\n",
+              options.clients, all.size (), (unsigned long long) errors.load (), seconds,
+              seconds > 0 ? (double) all.size () / seconds : 0.0, percentile (0.50), percentile (0.90),
+              percentile (0.99), all.empty () ? 0.0 : (double) all.back () / 1e6);
+      return errors > 0;
+#else
+      fprintf (stderr, "cfa: load tests are not supported on this platform\n");
+      return 1;
+#endif
+    }
+}
@@ -0,0 +1,513 @@
+// src/shard.h
+
+#pragma once
+
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <string_view>
+#include <thread>
+
+#include "cfa.h"
+
+//----------------------------------------------------
+//  [ SECTION SHARD ]   Portable histogram files
+//----------------------------------------------------
+
+namespace cfa::shard
+{
+    const char MAGIC[8] = {'C', 'F', 'A', 'H', 'I', 'S', 'T', '\0'};
+    const uint16_t VERSION = 1;
+
+    // The `type` of a shard holding raw byte counts, from which every
+    // ParseType view can still be derived. Other shards hold the counts of
+    // one ParseType, stored as its enum value.
+    const uint32_t RAW_TYPE = 0;
+
+    // Longer source text is cut when written and taken as corruption when read.
+    const uint32_t MAX_SOURCE_LENGTH = 1 << 20;
+
+    // File layout, every field little-endian:
+    //
+    //   Header        64 bytes
+    //   counts        256 x uint64, one per byte value
+    //   source        `source_length` bytes of free text, not terminated
+    //
+    // Counts start 8-byte aligned, so a mapped shard is read in place.
+    struct Header {
+        char magic[8];
+        uint16_t version;
+        uint16_t header_size;
+        uint32_t flags;
+        uint32_t type;
+        uint32_t source_length;
+        uint64_t bytes;         // Bytes counted, accepted or not.
+        uint64_t sources;       // Inputs merged into the shard.
+        int64_t created;        // Unix time it was written.
+        uint32_t counts_crc;    // CRC-32 of the counts and the source text.
+        uint32_t header_crc;    // CRC-32 of the header with this field zeroed.
+        uint64_t reserved;
+    };
+
+    static_assert (sizeof (Header) == 64, "shard header layout changed");
+
+    const size_t COUNTS_SIZE = CharMap<uint64_t>::SIZE * sizeof (uint64_t);
+
+    enum class Error {
+        None,
+        Open,
+        Truncated,
+        Magic,
+        Version,
+        HeaderChecksum,
+        CountsChecksum,
+    };
+
+    // A histogram in memory, ready to be written.
+    struct Shard {
+        uint32_t type = RAW_TYPE;
+        CharMap<uint64_t> counts;
+        uint64_t bytes = 0;
+        uint64_t sources = 1;
+        std::string source;
+    };
+
+    class ShardFile;
+
+    struct Options {
+        std::string out;
+        bool type_set = false;
+        ParseType type = ParseType::Alpha;
+        SortMethod sort = SortMethod::Char_Ascending;
+        bool rank = false;
+        unsigned threads = 0;
+    };
+
+    const char *error_message (Error error);
+    const char *type_name (uint32_t type);
+    bool write (const std::filesystem::path &path, const Shard &shard);
+    void print_usage ();
+    bool parse_options (int argc, char **argv, Options &options, std::vector<std::string> &inputs);
+    int merge_program (int argc, char **argv);
+}
+
+namespace cfa::shard
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    const bool HOST_LITTLE_ENDIAN = false;
+#else
+    const bool HOST_LITTLE_ENDIAN = true;
+#endif
+
+    // Converts between host order and the little-endian order on disk.
+    template<typename T>
+    T little_endian (T value)
+    {
+      if (HOST_LITTLE_ENDIAN)
+        {
+          return value;
+        }
+      T swapped;
+      auto *from = (const unsigned char *) &value;
+      auto *to = (unsigned char *) &swapped;
+      for (size_t i = 0; i < sizeof (T); ++i)
+        {
+          to[i] = from[sizeof (T) - 1 - i];
+        }
+      return swapped;
+    }
+
+    Header swap_header (Header header)
+    {
+      header.version = little_endian (header.version);
+      header.header_size = little_endian (header.header_size);
+      header.flags = little_endian (header.flags);
+      header.type = little_endian (header.type);
+      header.source_length = little_endian (header.source_length);
+      header.bytes = little_endian (header.bytes);
+      header.sources = little_endian (header.sources);
+      header.created = little_endian (header.created);
+      header.counts_crc = little_endian (header.counts_crc);
+      header.header_crc = little_endian (header.header_crc);
+      return header;
+    }
+
+    // A validated shard. Regular files are mapped and their counts used in
+    // place; anything else is read into memory first. Every shard is checked
+    // against both checksums before it is accepted.
+    class ShardFile {
+     public:
+        Error open (const std::string &path)
+        {
+          m_copy.clear ();
+          if (!m_file.open (path))
+            {
+              return Error::Open;
+            }
+
+          const char *data = m_file.data ();
+          size_t size = m_file.size ();
+          if (!m_file.is_mapped () || !HOST_LITTLE_ENDIAN)
+            {
+              // Shards are small, so copying one costs little.
+              if (m_file.is_mapped ())
+                {
+                  m_copy.assign (data, data + size);
+                }
+              else
+                {
+                  utils::file::BlockReader reader;
+                  while (size_t length = reader.read (m_file))
+                    {
+                      m_copy.insert (m_copy.end (), reader.data (), reader.data () + length);
+                    }
+                }
+              data = m_copy.data ();
+              size = m_copy.size ();
+            }
+
+          if (size < sizeof (Header))
+            {
+              return Error::Truncated;
+            }
+          Header stored;
+          std::memcpy (&stored, data, sizeof (Header));
+          m_header = swap_header (stored);
+          if (std::memcmp (m_header.magic, MAGIC, sizeof (MAGIC)) != 0)
+            {
+              return Error::Magic;
+            }
+          if (m_header.version != VERSION || m_header.header_size < sizeof (Header) || m_header.header_size % 8 != 0)
+            {
+              return Error::Version;
+            }
+
+          stored.header_crc = 0;
+          if (utils::crc32 (&stored, sizeof (stored)) != m_header.header_crc)
+            {
+              return Error::HeaderChecksum;
+            }
+          if (m_header.source_length > MAX_SOURCE_LENGTH
+              || size < (size_t) m_header.header_size + COUNTS_SIZE + m_header.source_length)
+            {
+              return Error::Truncated;
+            }
+
+          const char *body = data + m_header.header_size;
+          if (utils::crc32 (body, COUNTS_SIZE + m_header.source_length) != m_header.counts_crc)
+            {
+              return Error::CountsChecksum;
+            }
+
+          if (!HOST_LITTLE_ENDIAN)
+            {
+              auto *counts = (uint64_t *) (m_copy.data () + m_header.header_size);
+              for (size_t c = 0; c < CharMap<uint64_t>::SIZE; ++c)
+                {
+                  counts[c] = little_endian (counts[c]);
+                }
+            }
+          m_counts = (const uint64_t *) body;
+          m_source = std::string_view (body + COUNTS_SIZE, m_header.source_length);
+          return Error::None;
+        }
+
+        [[nodiscard]] const Header &header () const
+        {
+          return m_header;
+        }
+
+        [[nodiscard]] uint32_t type () const
+        {
+          return m_header.type;
+        }
+
+        [[nodiscard]] uint64_t count (unsigned char c) const
+        {
+          return m_counts[c];
+        }
+
+        [[nodiscard]] std::string_view source () const
+        {
+          return m_source;
+        }
+
+        // Adds the counts to `map` without copying them first.
+        void add_to (CharMap<uint64_t> &map) const
+        {
+          for (size_t c = 0; c < CharMap<uint64_t>::SIZE; ++c)
+            {
+              map.Data[c] += m_counts[c];
+            }
+        }
+
+     private:
+        utils::file::MappedFile m_file;
+        std::vector<char> m_copy;
+        Header m_header {};
+        const uint64_t *m_counts = nullptr;
+        std::string_view m_source;
+    };
+
+    const char *error_message (Error error)
+    {
+      switch (error)
+        {
+          case Error::None:
+            return "ok";
+          case Error::Open:
+            return "could not open";
+          case Error::Truncated:
+            return "truncated";
+          case Error::Magic:
+            return "not a histogram file";
+          case Error::Version:
+            return "unsupported version";
+          case Error::HeaderChecksum:
+            return "header checksum mismatch";
+          case Error::CountsChecksum:
+            return "counts checksum mismatch";
+        }
+      return "unknown error";
+    }
+
+    const char *type_name (uint32_t type)
+    {
+      return type == RAW_TYPE ? "raw" : parse_type_name ((ParseType) type);
+    }
+
+    // Writes through a temporary file, so readers never see a partial shard.
+    bool write (const std::filesystem::path &path, const Shard &shard)
+    {
+      std::vector<char> body (COUNTS_SIZE + shard.source.size ());
+      for (size_t c = 0; c < CharMap<uint64_t>::SIZE; ++c)
+        {
+          uint64_t count = little_endian (shard.counts.Data[c]);
+          std::memcpy (body.data () + c * sizeof (uint64_t), &count, sizeof (count));
+        }
+      std::memcpy (body.data () + COUNTS_SIZE, shard.source.data (), shard.source.size ());
+
+      Header header {};
+      std::memcpy (header.magic, MAGIC, sizeof (MAGIC));
+      header.version = VERSION;
+      header.header_size = sizeof (Header);
+      header.type = shard.type;
+      header.source_length = (uint32_t) std::min<size_t> (shard.source.size (), MAX_SOURCE_LENGTH);
+      header.bytes = shard.bytes;
+      header.sources = shard.sources;
+      header.created = (int64_t) std::time (nullptr);
+      header.counts_crc = utils::crc32 (body.data (), COUNTS_SIZE + header.source_length);
+      Header stored = swap_header (header);
+      stored.header_crc = little_endian (utils::crc32 (&stored, sizeof (stored)));
+
+      std::filesystem::path temp = path;
+      temp += ".tmp";
+      {
+        std::ofstream out (temp, std::ios::binary | std::ios::trunc);
+        out.write ((const char *) &stored, sizeof (stored));
+        out.write (body.data (), (std::streamsize) (COUNTS_SIZE + header.source_length));
+        if (!out)
+          {
+            return false;
+          }
+      }
+      std::error_code error;
+      std::filesystem::rename (temp, path, error);
+      return !error;
+    }
+
+    void print_usage ()
+    {
+      printf ("Usage: cfa -merge [options] <file|directory|glob>...\n"
+              "\t--out=FILE      write the merged histogram to FILE instead of printing it\n"
+              "\t--type=alpha|digit|symbol|alnum|ascii   view of raw shards to print\n"
+              "\t                (default: alpha; typed shards print as stored)\n"
+              "\t--sort=char|char-desc|value|value-desc|none   (default: char)\n"
+              "\t--rank          print ranks instead of counts\n"
+              "\t--threads=N     worker threads (default: all cores)\n");
+    }
+
+    bool parse_options (int argc, char **argv, Options &options, std::vector<std::string> &inputs)
+    {
+      for (int i = 0; i < argc; ++i)
+        {
+          std::string arg (argv[i]), key, value;
+          if (!utils::parse_option (arg, key, value))
+            {
+              inputs.push_back (arg);
+              continue;
+            }
+
+          if (key == "type" && parse_type_from_name (value, options.type))
+            {
+              options.type_set = true;
+              continue;
+            }
+          if (key == "sort" && sort_method_from_name (value, options.sort))
+            {
+              continue;
+            }
+          if (key == "rank")
+            {
+              options.rank = true;
+            }
+          else if (key == "out" && !value.empty ())
+            {
+              options.out = value;
+            }
+          else if (key == "threads" && utils::parse_number (value, options.threads))
+            {
+              continue;
+            }
+          else
+            {
+              fprintf (stderr, "cfa: invalid option '%s'\n", arg.c_str ());
+              return false;
+            }
+        }
+      return !inputs.empty ();
+    }
+
+    // Sums any number of shards. Each worker keeps one running total and
+    // opens one shard at a time, so memory stays the same for ten files or
+    // ten thousand.
+    int merge_program (int argc, char **argv)
+    {
+      Options options;
+      std::vector<std::string> inputs;
+      if (!parse_options (argc, argv, options, inputs))
+        {
+          print_usage ();
+          return 1;
+        }
+
+      std::vector<std::filesystem::path> paths;
+      for (auto &input: inputs)
+        {
+          utils::file::collect_files (input, paths);
+        }
+      if (paths.empty ())
+        {
+          fprintf (stderr, "cfa: no input files\n");
+          return 1;
+        }
+
+      struct Partial {
+          CharMap<uint64_t> counts;
+          uint64_t bytes = 0;
+          uint64_t sources = 0;
+          uint32_t type = RAW_TYPE;
+          size_t merged = 0;
+          size_t failed = 0;
+      };
+
+      std::atomic<size_t> next {0};
+      std::atomic<uint32_t> type {UINT32_MAX};
+      std::atomic<bool> mixed {false};
+      auto worker = [&] (Partial &partial)
+      {
+          ShardFile shard;
+          for (size_t i; (i = next++) < paths.size ();)
+            {
+              std::string path = paths[i].string ();
+              Error error = shard.open (path);
+              if (error != Error::None)
+                {
+                  fprintf (stderr, "cfa: '%s': %s\n", path.c_str (), error_message (error));
+                  ++partial.failed;
+                  continue;
+                }
+
+              // The first shard opened decides the type every other must have.
+              uint32_t expected = UINT32_MAX;
+              if (!type.compare_exchange_strong (expected, shard.type ()) && expected != shard.type ())
+                {
+                  fprintf (stderr, "cfa: '%s' holds %s counts, not %s\n", path.c_str (), type_name (shard.type ()),
+                           type_name (expected));
+                  mixed = true;
+                  ++partial.failed;
+                  continue;
+                }
+
+              shard.add_to (partial.counts);
+              partial.bytes += shard.header ().bytes;
+              partial.sources += shard.header ().sources;
+              partial.type = shard.type ();
+              ++partial.merged;
+            }
+      };
+
+      size_t threads = std::min<size_t> (resolve_thread_count (options.threads), paths.size ());
+      std::vector<Partial> partials (threads);
+      std::vector<std::thread> workers;
+      for (size_t i = 1; i < threads; ++i)
+        {
+          workers.emplace_back (worker, std::ref (partials[i]));
+        }
+      worker (partials[0]);
+      for (auto &thread: workers)
+        {
+          thread.join ();
+        }
+
+      Shard merged;
+      merged.sources = 0;
+      size_t count = 0, failed = 0;
+      for (auto &partial: partials)
+        {
+          merged.counts.merge (partial.counts);
+          merged.bytes += partial.bytes;
+          merged.sources += partial.sources;
+          count += partial.merged;
+          failed += partial.failed;
+        }
+      merged.type = type == UINT32_MAX ? RAW_TYPE : type.load ();
+      merged.source = "cfa -merge of " + std::to_string (count) + " files";
+      if (mixed || count == 0)
+        {
+          return 1;
+        }
+
+      if (!options.out.empty ())
+        {
+          if (!write (options.out, merged))
+            {
+              fprintf (stderr, "cfa: could not write '%s'\n", options.out.c_str ());
+              return 1;
+            }
+          fprintf (stderr, "cfa: merged %zu files (%llu sources, %llu bytes) into '%s'\n", count,
+                   (unsigned long long) merged.sources, (unsigned long long) merged.bytes, options.out.c_str ());
+          return failed ? 1 : 0;
+        }
+
+      // Raw shards can be printed as any view; typed ones only as stored.
+      CharMap<uint64_t> view = merged.counts;
+      if (merged.type == RAW_TYPE)
+        {
+          view = ByteHistogram (merged.counts, merged.bytes).view<uint64_t> (options.type);
+        }
+      else if (options.type_set && (uint32_t) options.type != merged.type)
+        {
+          fprintf (stderr, "cfa: the inputs hold %s counts; --type is ignored\n", type_name (merged.type));
+        }
+
+      printf ("==> total: %zu files, %llu sources (%llu bytes, %s) <==", count,
+              (unsigned long long) merged.sources, (unsigned long long) merged.bytes,
+              merged.type == RAW_TYPE ? parse_type_name (options.type) : type_name (merged.type));
+      if (options.rank)
+        {
+          auto vec = std::make_unique<CharVec<float>> ();
+          view.ranks ().copy_to (*vec);
+          vec->sort (options.sort);
+          print_char_rank (vec);
+        }
+      else
+        {
+          auto vec = std::make_unique<CharVec<uint64_t>> ();
+          view.copy_to (*vec);
+          vec->sort (options.sort);
+          print_char_count (vec);
+        }
+      return failed ? 1 : 0;
+    }
+}
@@ -0,0 +1,479 @@
+// src/simd.h
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define UTILS_HAS_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+//----------------------------------------------------
+//  [ SECTION SIMD ]   Byte classification kernels
+//----------------------------------------------------
+
+namespace utils::simd
+{
+    // Classes of bytes a kernel can accept. They mirror `utils::valid_utf8`
+    // plus the C-locale `isalpha`/`isdigit`: a byte is a symbol when it passes
+    // `valid_utf8` but is neither a letter nor a digit.
+    enum ByteClass : unsigned {
+        CLASS_NONE = 0,
+        CLASS_ALPHA = 1 << 0,
+        CLASS_DIGIT = 1 << 1,
+        CLASS_SYMBOL = 1 << 2,
+    };
+
+    enum class Isa {
+        Scalar = 0,
+        SSE2,
+        AVX2,
+        AVX512,
+    };
+
+    // Rejected bytes are written as this key. No byte ever folds to it, so the
+    // counters can discard it after counting a block.
+    const unsigned char REJECTED_KEY = 0;
+
+    // Size of the scratch block the counters fold into before counting.
+    const size_t FOLD_BLOCK_SIZE = 1024 * 4;
+
+    // Interleaved sub-histograms the counters spread consecutive keys over,
+    // so a run of one byte does not make every increment wait on the one
+    // before it.
+    const size_t COUNT_BANKS = 4;
+
+    // Most keys counted into the 16-bit banks before they are added to the
+    // totals; each bank sees at most a quarter of them, so none can wrap.
+    const size_t COUNT_FLUSH_KEYS = COUNT_BANKS * UINT16_MAX;
+
+    // Inputs shorter than this are counted straight into the totals; for
+    // them, clearing and flushing the banks would cost more than it saves.
+    const size_t COUNT_BANKED_MIN = 1024 * 16;
+
+    using FoldKernel = void (*) (const unsigned char *src, unsigned char *dst, size_t size, unsigned classes);
+    using FoldTable = std::array<unsigned char, 256>;
+
+    class KeyCounter;
+
+    constexpr FoldTable make_fold_table (unsigned classes);
+    constexpr std::array<FoldTable, 8> make_fold_tables ();
+
+    Isa detect_isa ();
+    Isa active_isa ();
+    Isa set_isa (Isa isa);
+    const char *isa_name (Isa isa);
+
+    // Writes the counting key of every byte in `src` to `dst`: letters are
+    // upper-cased, other accepted bytes are copied, rejected bytes become
+    // `REJECTED_KEY`.
+    void fold (const char *src, unsigned char *dst, size_t size, unsigned classes);
+
+    void fold_scalar (const unsigned char *src, unsigned char *dst, size_t size, unsigned classes);
+
+    // Length of the leading run of bytes below 0x80.
+    size_t ascii_prefix (const char *data, size_t size);
+#ifdef UTILS_HAS_X86_SIMD
+    void fold_sse2 (const unsigned char *src, unsigned char *dst, size_t size, unsigned classes);
+    void fold_avx2 (const unsigned char *src, unsigned char *dst, size_t size, unsigned classes);
+    void fold_avx512 (const unsigned char *src, unsigned char *dst, size_t size, unsigned classes);
+#endif
+}
+
+namespace utils::simd
+{
+    // The counting key of every byte for one combination of classes. This is
+    // the reference definition the vector kernels have to agree with.
+    constexpr FoldTable make_fold_table (unsigned classes)
+    {
+      FoldTable table {};
+      for (unsigned c = 0; c < table.size (); ++c)
+        {
+          bool valid = (unsigned char) (c - '0') < 127;
+          bool alpha = (unsigned char) ((c | 0x20) - 'a') < 26;
+          bool digit = (unsigned char) (c - '0') < 10;
+          bool symbol = valid && !alpha && !digit;
+
+          bool accept = (alpha && (classes & CLASS_ALPHA))
+                        || (digit && (classes & CLASS_DIGIT))
+                        || (symbol && (classes & CLASS_SYMBOL));
+
+          table[c] = accept ? (unsigned char) (alpha ? c & ~0x20 : c) : REJECTED_KEY;
+        }
+      return table;
+    }
+
+    constexpr std::array<FoldTable, 8> make_fold_tables ()
+    {
+      std::array<FoldTable, 8> tables {};
+      for (unsigned classes = 0; classes < tables.size (); ++classes)
+        {
+          tables[classes] = make_fold_table (classes);
+        }
+      return tables;
+    }
+
+    // One table per class combination, built at compile time.
+    inline constexpr std::array<FoldTable, 8> FOLD_TABLES = make_fold_tables ();
+
+    // Counts keys into COUNT_BANKS interleaved tables of 16-bit counters and
+    // adds them to caller-owned totals every COUNT_FLUSH_KEYS keys and at
+    // `flush`. The banks keep the hot counters in 2 KiB of cache and break
+    // the store-to-load chain of repeated keys; the totals only have to be
+    // wide enough for the whole input.
+    class KeyCounter {
+     public:
+        KeyCounter ()
+        {
+          std::memset (m_banks, 0, sizeof (m_banks));
+        }
+
+        template<typename Num>
+        void add (const unsigned char *keys, size_t size, Num *totals)
+        {
+          while (size > 0)
+            {
+              size_t length = std::min (size, COUNT_FLUSH_KEYS - m_load * COUNT_BANKS);
+              count (keys, length, [] (unsigned char key)
+              { return key; });
+              keys += length;
+              size -= length;
+              reserve (length, totals);
+            }
+        }
+
+        // Folds and counts raw bytes through `table` in one pass.
+        template<typename Num>
+        void add (const char *data, size_t size, const FoldTable &table, Num *totals)
+        {
+          while (size > 0)
+            {
+              size_t length = std::min (size, COUNT_FLUSH_KEYS - m_load * COUNT_BANKS);
+              count ((const unsigned char *) data, length, [&table] (unsigned char c)
+              { return table[c]; });
+              data += length;
+              size -= length;
+              reserve (length, totals);
+            }
+        }
+
+        // Adds the banks to `totals` and clears them.
+        template<typename Num>
+        void flush (Num *totals)
+        {
+          for (size_t c = 0; c < 256; ++c)
+            {
+              uint32_t sum = 0;
+              for (auto &bank: m_banks)
+                {
+                  sum += bank[c];
+                }
+              totals[c] += (Num) sum;
+            }
+          std::memset (m_banks, 0, sizeof (m_banks));
+          m_load = 0;
+        }
+
+     private:
+        template<typename Key>
+        void count (const unsigned char *src, size_t size, Key key)
+        {
+          size_t i = 0;
+          for (; i + COUNT_BANKS <= size; i += COUNT_BANKS)
+            {
+              ++m_banks[0][key (src[i])];
+              ++m_banks[1][key (src[i + 1])];
+              ++m_banks[2][key (src[i + 2])];
+              ++m_banks[3][key (src[i + 3])];
+            }
+          for (size_t bank = 0; i < size; ++i, ++bank)
+            {
+              ++m_banks[bank][key (src[i])];
+            }
+        }
+
+        template<typename Num>
+        void reserve (size_t length, Num *totals)
+        {
+          // No bank got more than its rounded-up share of `length`.
+          m_load += (length + COUNT_BANKS - 1) / COUNT_BANKS;
+          if (m_load == UINT16_MAX)
+            {
+              flush (totals);
+            }
+        }
+
+        alignas (64) uint16_t m_banks[COUNT_BANKS][256];
+
+        // The most any one bank may have counted since the last flush.
+        size_t m_load = 0;
+    };
+
+    // Selected once on first use; `set_isa` may swap it later.
+    std::atomic<FoldKernel> g_fold_kernel {nullptr};
+    std::atomic<Isa> g_active_isa {Isa::Scalar};
+
+    Isa detect_isa ()
+    {
+#ifdef UTILS_HAS_X86_SIMD
+      __builtin_cpu_init ();
+      if (__builtin_cpu_supports ("avx512bw"))
+        {
+          return Isa::AVX512;
+        }
+      if (__builtin_cpu_supports ("avx2"))
+        {
+          return Isa::AVX2;
+        }
+      if (__builtin_cpu_supports ("sse2"))
+        {
+          return Isa::SSE2;
+        }
+#endif
+      return Isa::Scalar;
+    }
+
+    Isa set_isa (Isa isa)
+    {
+      // Never select more than the CPU can run.
+      Isa best = detect_isa ();
+      if (isa > best)
+        {
+          isa = best;
+        }
+
+      FoldKernel kernel;
+      switch (isa)
+        {
+#ifdef UTILS_HAS_X86_SIMD
+          case Isa::AVX512:
+            kernel = fold_avx512;
+          break;
+          case Isa::AVX2:
+            kernel = fold_avx2;
+          break;
+          case Isa::SSE2:
+            kernel = fold_sse2;
+          break;
+#endif
+          default:
+            isa = Isa::Scalar;
+          kernel = fold_scalar;
+          break;
+        }
+
+      g_active_isa.store (isa);
+      g_fold_kernel.store (kernel);
+      return isa;
+    }
+
+    Isa active_isa ()
+    {
+      if (!g_fold_kernel.load (std::memory_order_acquire))
+        {
+          // `CFA_SIMD` caps the dispatch, e.g. to compare against the scalar path.
+          Isa isa = Isa::AVX512;
+          if (const char *env = std::getenv ("CFA_SIMD"); env)
+            {
+              std::string name (env);
+              if (name == "scalar")
+                {
+                  isa = Isa::Scalar;
+                }
+              else if (name == "sse2")
+                {
+                  isa = Isa::SSE2;
+                }
+              else if (name == "avx2")
+                {
+                  isa = Isa::AVX2;
+                }
+            }
+          set_isa (isa);
+        }
+      return g_active_isa.load ();
+    }
+
+    const char *isa_name (Isa isa)
+    {
+      switch (isa)
+        {
+          case Isa::SSE2:
+            return "sse2";
+          case Isa::AVX2:
+            return "avx2";
+          case Isa::AVX512:
+            return "avx512";
+          default:
+            return "scalar";
+        }
+    }
+
+    void fold (const char *src, unsigned char *dst, size_t size, unsigned classes)
+    {
+      FoldKernel kernel = g_fold_kernel.load (std::memory_order_acquire);
+      if (!kernel)
+        {
+          active_isa ();
+          kernel = g_fold_kernel.load (std::memory_order_acquire);
+        }
+      kernel ((const unsigned char *) src, dst, size, classes);
+    }
+
+    void fold_scalar (const unsigned char *src, unsigned char *dst, size_t size, unsigned classes)
+    {
+      const FoldTable &table = FOLD_TABLES[classes & 7];
+      for (size_t i = 0; i < size; ++i)
+        {
+          dst[i] = table[src[i]];
+        }
+    }
+
+    size_t ascii_prefix (const char *data, size_t size)
+    {
+      size_t i = 0;
+#if defined(UTILS_HAS_X86_SIMD) && defined(__SSE2__)
+      // SSE2 is part of the x86-64 baseline, so no dispatch is needed here.
+      for (; i + 16 <= size; i += 16)
+        {
+          __m128i chunk = _mm_loadu_si128 ((const __m128i *) (data + i));
+          if (int high = _mm_movemask_epi8 (chunk); high != 0)
+            {
+              return i + (size_t) __builtin_ctz ((unsigned) high);
+            }
+        }
+#else
+      for (; i + 8 <= size; i += 8)
+        {
+          uint64_t word;
+          std::memcpy (&word, data + i, sizeof (word));
+          if (word & 0x8080808080808080ull)
+            {
+              break;
+            }
+        }
+#endif
+      while (i < size && (unsigned char) data[i] < 0x80)
+        {
+          ++i;
+        }
+      return i;
+    }
+
+#ifdef UTILS_HAS_X86_SIMD
+    // Each vector kernel computes the same predicates as `make_fold_table`, using
+    // `min_epu8` for the unsigned range checks, then finishes the tail scalar.
+
+    __attribute__((target("sse2")))
+    void fold_sse2 (const unsigned char *src, unsigned char *dst, size_t size, unsigned classes)
+    {
+      const __m128i want_alpha = _mm_set1_epi8 ((classes & CLASS_ALPHA) ? -1 : 0);
+      const __m128i want_digit = _mm_set1_epi8 ((classes & CLASS_DIGIT) ? -1 : 0);
+      const __m128i want_symbol = _mm_set1_epi8 ((classes & CLASS_SYMBOL) ? -1 : 0);
+      const __m128i zero = _mm_set1_epi8 ('0');
+      const __m128i lower_a = _mm_set1_epi8 ('a');
+      const __m128i case_bit = _mm_set1_epi8 (0x20);
+      const __m128i valid_span = _mm_set1_epi8 (126);
+      const __m128i alpha_span = _mm_set1_epi8 (25);
+      const __m128i digit_span = _mm_set1_epi8 (9);
+
+      size_t i = 0;
+      for (; i + 16 <= size; i += 16)
+        {
+          __m128i c = _mm_loadu_si128 ((const __m128i *) (src + i));
+          __m128i from_zero = _mm_sub_epi8 (c, zero);
+          __m128i from_a = _mm_sub_epi8 (_mm_or_si128 (c, case_bit), lower_a);
+
+          __m128i valid = _mm_cmpeq_epi8 (_mm_min_epu8 (from_zero, valid_span), from_zero);
+          __m128i alpha = _mm_cmpeq_epi8 (_mm_min_epu8 (from_a, alpha_span), from_a);
+          __m128i digit = _mm_cmpeq_epi8 (_mm_min_epu8 (from_zero, digit_span), from_zero);
+          __m128i symbol = _mm_andnot_si128 (_mm_or_si128 (alpha, digit), valid);
+
+          __m128i accept = _mm_or_si128 (_mm_and_si128 (alpha, want_alpha),
+                                         _mm_or_si128 (_mm_and_si128 (digit, want_digit),
+                                                       _mm_and_si128 (symbol, want_symbol)));
+          __m128i key = _mm_andnot_si128 (_mm_and_si128 (alpha, case_bit), c);
+
+          _mm_storeu_si128 ((__m128i *) (dst + i), _mm_and_si128 (key, accept));
+        }
+      fold_scalar (src + i, dst + i, size - i, classes);
+    }
+
+    __attribute__((target("avx2")))
+    void fold_avx2 (const unsigned char *src, unsigned char *dst, size_t size, unsigned classes)
+    {
+      const __m256i want_alpha = _mm256_set1_epi8 ((classes & CLASS_ALPHA) ? -1 : 0);
+      const __m256i want_digit = _mm256_set1_epi8 ((classes & CLASS_DIGIT) ? -1 : 0);
+      const __m256i want_symbol = _mm256_set1_epi8 ((classes & CLASS_SYMBOL) ? -1 : 0);
+      const __m256i zero = _mm256_set1_epi8 ('0');
+      const __m256i lower_a = _mm256_set1_epi8 ('a');
+      const __m256i case_bit = _mm256_set1_epi8 (0x20);
+      const __m256i valid_span = _mm256_set1_epi8 (126);
+      const __m256i alpha_span = _mm256_set1_epi8 (25);
+      const __m256i digit_span = _mm256_set1_epi8 (9);
+
+      size_t i = 0;
+      for (; i + 32 <= size; i += 32)
+        {
+          __m256i c = _mm256_loadu_si256 ((const __m256i *) (src + i));
+          __m256i from_zero = _mm256_sub_epi8 (c, zero);
+          __m256i from_a = _mm256_sub_epi8 (_mm256_or_si256 (c, case_bit), lower_a);
+
+          __m256i valid = _mm256_cmpeq_epi8 (_mm256_min_epu8 (from_zero, valid_span), from_zero);
+          __m256i alpha = _mm256_cmpeq_epi8 (_mm256_min_epu8 (from_a, alpha_span), from_a);
+          __m256i digit = _mm256_cmpeq_epi8 (_mm256_min_epu8 (from_zero, digit_span), from_zero);
+          __m256i symbol = _mm256_andnot_si256 (_mm256_or_si256 (alpha, digit), valid);
+
+          __m256i accept = _mm256_or_si256 (_mm256_and_si256 (alpha, want_alpha),
+                                            _mm256_or_si256 (_mm256_and_si256 (digit, want_digit),
+                                                             _mm256_and_si256 (symbol, want_symbol)));
+          __m256i key = _mm256_andnot_si256 (_mm256_and_si256 (alpha, case_bit), c);
+
+          _mm256_storeu_si256 ((__m256i *) (dst + i), _mm256_and_si256 (key, accept));
+        }
+      fold_scalar (src + i, dst + i, size - i, classes);
+    }
+
+    __attribute__((target("avx512f,avx512bw")))
+    void fold_avx512 (const unsigned char *src, unsigned char *dst, size_t size, unsigned classes)
+    {
+      const __mmask64 want_alpha = (classes & CLASS_ALPHA) ? ~(__mmask64) 0 : 0;
+      const __mmask64 want_digit = (classes & CLASS_DIGIT) ? ~(__mmask64) 0 : 0;
+      const __mmask64 want_symbol = (classes & CLASS_SYMBOL) ? ~(__mmask64) 0 : 0;
+      const __m512i zero = _mm512_set1_epi8 ('0');
+      const __m512i lower_a = _mm512_set1_epi8 ('a');
+      const __m512i case_bit = _mm512_set1_epi8 (0x20);
+      const __m512i upper_mask = _mm512_set1_epi8 ((char) ~0x20);
+      const __m512i valid_span = _mm512_set1_epi8 (126);
+      const __m512i alpha_span = _mm512_set1_epi8 (25);
+      const __m512i digit_span = _mm512_set1_epi8 (9);
+
+      size_t i = 0;
+      for (; i + 64 <= size; i += 64)
+        {
+          __m512i c = _mm512_loadu_si512 ((const void *) (src + i));
+          __m512i from_zero = _mm512_sub_epi8 (c, zero);
+          __m512i from_a = _mm512_sub_epi8 (_mm512_or_si512 (c, case_bit), lower_a);
+
+          __mmask64 valid = _mm512_cmple_epu8_mask (from_zero, valid_span);
+          __mmask64 alpha = _mm512_cmple_epu8_mask (from_a, alpha_span);
+          __mmask64 digit = _mm512_cmple_epu8_mask (from_zero, digit_span);
+          __mmask64 symbol = valid & ~(alpha | digit);
+
+          __mmask64 accept = (alpha & want_alpha) | (digit & want_digit) | (symbol & want_symbol);
+          __m512i key = _mm512_mask_blend_epi8 (alpha, c, _mm512_and_si512 (c, upper_mask));
+
+          _mm512_storeu_si512 ((void *) (dst + i), _mm512_maskz_mov_epi8 (accept, key));
+        }
+      fold_scalar (src + i, dst + i, size - i, classes);
+    }
+#endif
+}
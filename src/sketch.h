@@ -0,0 +1,431 @@
+// src/sketch.h
+
+#pragma once
+
+#include <cmath>
+#include <string_view>
+#include <unordered_map>
+
+#include "cfa.h"
+
+//----------------------------------------------------
+//  [ SECTION SKETCH ]   Approximate heavy hitters
+//----------------------------------------------------
+
+namespace cfa::sketch
+{
+    // Approximate mode has no per-gram table, so n is only bounded by how
+    // long a key is worth printing.
+    const unsigned MAX_N = 32;
+
+    // Words longer than this are split.
+    const size_t MAX_WORD_LENGTH = 64;
+
+    // Largest sketch approximate mode will build. One is kept per file being
+    // analyzed plus one for the total, so this bounds memory per worker.
+    const size_t MAX_SKETCH_BYTES = 256 * 1024 * 1024;
+
+    enum class Item {
+        NGram,
+        Word,
+    };
+
+    template<typename Num>
+    using ItemVec = CharVec<Num, std::string>;
+
+    class CountMinSketch;
+    class SpaceSaving;
+    class HeavyHitters;
+
+    void print_heavy_hitters (const HeavyHitters &hitters, std::unique_ptr <ItemVec<uint64_t>> &vec);
+}
+
+namespace cfa::sketch
+{
+    // Count-Min sketch with conservative update. Every estimate is an upper
+    // bound of the true count, and exceeds it by more than `epsilon * N`
+    // with probability at most `delta`, where N is the number of items added.
+    class CountMinSketch {
+     public:
+        CountMinSketch (double epsilon, double delta)
+            : m_width (width_for (epsilon)), m_depth (depth_for (delta))
+        {
+          m_counters.assign (m_width * m_depth, 0);
+        }
+
+        // Counters per row: e / epsilon, rounded up to a power of two so a
+        // row index is a mask.
+        static size_t width_for (double epsilon)
+        {
+          size_t width = (size_t) std::ceil (std::exp (1.0) / std::max (epsilon, 1e-9));
+          size_t rounded = 1;
+          while (rounded < width)
+            {
+              rounded <<= 1;
+            }
+          return rounded;
+        }
+
+        static size_t depth_for (double delta)
+        {
+          return (size_t) std::max (1.0, std::ceil (std::log (1 / std::clamp (delta, 1e-12, 0.5))));
+        }
+
+        // What a sketch for (epsilon, delta) allocates, to check against
+        // MAX_SKETCH_BYTES before building one.
+        static size_t bytes_for (double epsilon, double delta)
+        {
+          return width_for (epsilon) * depth_for (delta) * sizeof (uint64_t);
+        }
+
+        // Adds `n` occurrences of the key with hash `hash` and returns its
+        // new estimate.
+        uint64_t add (uint64_t hash, uint64_t n = 1)
+        {
+          size_t slots[64];
+          size_t depth = std::min<size_t> (m_depth, 64);
+          uint64_t estimate = UINT64_MAX;
+          for (size_t row = 0; row < depth; ++row)
+            {
+              slots[row] = row * m_width + slot_of (hash, row);
+              estimate = std::min (estimate, m_counters[slots[row]]);
+            }
+
+          // Conservative update: only raise the counters that are below the
+          // new estimate.
+          estimate += n;
+          for (size_t row = 0; row < depth; ++row)
+            {
+              m_counters[slots[row]] = std::max (m_counters[slots[row]], estimate);
+            }
+          m_total += n;
+          return estimate;
+        }
+
+        [[nodiscard]] uint64_t estimate (uint64_t hash) const
+        {
+          uint64_t estimate = UINT64_MAX;
+          for (size_t row = 0; row < m_depth; ++row)
+            {
+              estimate = std::min (estimate, m_counters[row * m_width + slot_of (hash, row)]);
+            }
+          return estimate;
+        }
+
+        // Adds a sketch with the same dimensions.
+        void merge (const CountMinSketch &other)
+        {
+          assert (m_width == other.m_width && m_depth == other.m_depth);
+          for (size_t i = 0; i < m_counters.size (); ++i)
+            {
+              m_counters[i] += other.m_counters[i];
+            }
+          m_total += other.m_total;
+        }
+
+        // Largest overestimate expected with probability `1 - delta`.
+        [[nodiscard]] uint64_t error_bound () const
+        {
+          return (uint64_t) std::ceil (std::exp (1.0) / (double) m_width * (double) m_total);
+        }
+
+        [[nodiscard]] uint64_t total () const
+        {
+          return m_total;
+        }
+
+        [[nodiscard]] size_t width () const
+        {
+          return m_width;
+        }
+
+        [[nodiscard]] size_t depth () const
+        {
+          return m_depth;
+        }
+
+        [[nodiscard]] size_t memory () const
+        {
+          return m_counters.size () * sizeof (uint64_t);
+        }
+
+     private:
+        [[nodiscard]] size_t slot_of (uint64_t hash, size_t row) const
+        {
+          // Rows use g_i(x) = h1(x) + i * h2(x) (Kirsch-Mitzenmacher).
+          uint64_t h1 = hash;
+          uint64_t h2 = (hash * 0x9E3779B97F4A7C15ull) | 1;
+          return (size_t) ((h1 + row * h2) >> 17) & (m_width - 1);
+        }
+
+        size_t m_width = 1;
+        size_t m_depth = 1;
+        std::vector<uint64_t> m_counters;
+        uint64_t m_total = 0;
+    };
+
+    // Space-Saving top-K summary kept as a min-heap of at most `k` keys, so
+    // the smallest monitored count is always at the root.
+    class SpaceSaving {
+     public:
+        struct Entry {
+            std::string key;
+            uint64_t count = 0;
+        };
+
+        explicit SpaceSaving (size_t k)
+            : m_k (std::max<size_t> (k, 1))
+        {
+          m_heap.reserve (m_k);
+          m_index.reserve (m_k * 2);
+        }
+
+        // Offers a key whose count is now `count`. Counts of a key only grow,
+        // so a key below the current minimum cannot be monitored and the
+        // lookup is skipped.
+        void offer (std::string_view key, uint64_t count)
+        {
+          if (m_heap.size () == m_k && count <= m_heap.front ().count)
+            {
+              return;
+            }
+
+          m_key.assign (key.data (), key.size ());
+          if (auto it = m_index.find (m_key); it != m_index.end ())
+            {
+              m_heap[it->second].count = std::max (m_heap[it->second].count, count);
+              sift_down (it->second);
+              return;
+            }
+
+          if (m_heap.size () < m_k)
+            {
+              m_heap.push_back ({m_key, count});
+              m_index[m_key] = m_heap.size () - 1;
+              sift_up (m_heap.size () - 1);
+              return;
+            }
+
+          // Replace the minimum.
+          m_index.erase (m_heap.front ().key);
+          m_heap.front () = {m_key, count};
+          m_index[m_key] = 0;
+          sift_down (0);
+        }
+
+        [[nodiscard]] const std::vector<Entry> &entries () const
+        {
+          return m_heap;
+        }
+
+        [[nodiscard]] size_t k () const
+        {
+          return m_k;
+        }
+
+     private:
+        void swap_entries (size_t a, size_t b)
+        {
+          std::swap (m_heap[a], m_heap[b]);
+          m_index[m_heap[a].key] = a;
+          m_index[m_heap[b].key] = b;
+        }
+
+        void sift_up (size_t i)
+        {
+          while (i > 0 && m_heap[i].count < m_heap[(i - 1) / 2].count)
+            {
+              swap_entries (i, (i - 1) / 2);
+              i = (i - 1) / 2;
+            }
+        }
+
+        void sift_down (size_t i)
+        {
+          for (;;)
+            {
+              size_t smallest = i;
+              for (size_t child = 2 * i + 1; child <= 2 * i + 2 && child < m_heap.size (); ++child)
+                {
+                  if (m_heap[child].count < m_heap[smallest].count)
+                    {
+                      smallest = child;
+                    }
+                }
+              if (smallest == i)
+                {
+                  return;
+                }
+              swap_entries (i, smallest);
+              i = smallest;
+            }
+        }
+
+        size_t m_k;
+        std::vector<Entry> m_heap;
+        std::unordered_map<std::string, size_t> m_index;
+        std::string m_key;
+    };
+
+    // Streams n-grams or words of accepted characters through a Count-Min
+    // sketch and keeps the `k` keys with the largest estimates. Memory is
+    // fixed by (epsilon, delta, k) however many distinct keys the input has.
+    class HeavyHitters {
+     public:
+        HeavyHitters (ParseType type, Item item, unsigned n, size_t k, double epsilon, double delta)
+            : m_type (type), m_item (item), m_n (std::clamp (n, 1u, MAX_N)), m_sketch (epsilon, delta), m_top (k)
+        {
+        }
+
+        void feed (const char *data, size_t size)
+        {
+          const auto &table = utils::simd::FOLD_TABLES[parse_type_classes (m_type)];
+          for (size_t i = 0; i < size; ++i)
+            {
+              unsigned char key = table[(unsigned char) data[i]];
+              if (key == utils::simd::REJECTED_KEY)
+                {
+                  break_run ();
+                  continue;
+                }
+
+              if (m_item == Item::Word)
+                {
+                  if (m_token.size () == MAX_WORD_LENGTH)
+                    {
+                      break_run ();
+                    }
+                  m_token.push_back ((char) key);
+                  continue;
+                }
+
+              // Slide the n-gram window.
+              if (m_token.size () == m_n)
+                {
+                  m_token.erase (0, 1);
+                }
+              m_token.push_back ((char) key);
+              if (m_token.size () == m_n)
+                {
+                  add (m_token);
+                }
+            }
+        }
+
+        void feed (std::string_view str)
+        {
+          feed (str.data (), str.size ());
+        }
+
+        // Ends the current word or n-gram, e.g. at the end of a document.
+        void break_run ()
+        {
+          if (m_item == Item::Word && !m_token.empty ())
+            {
+              add (m_token);
+            }
+          m_token.clear ();
+        }
+
+        // Adds another summary built with the same parameters. Keys monitored
+        // by either side are re-estimated against the merged sketch.
+        void merge (const HeavyHitters &other)
+        {
+          assert (m_type == other.m_type && m_item == other.m_item && m_n == other.m_n);
+          m_sketch.merge (other.m_sketch);
+
+          SpaceSaving top (m_top.k ());
+          for (const auto *entries: {&m_top.entries (), &other.m_top.entries ()})
+            {
+              for (auto &entry: *entries)
+                {
+                  top.offer (entry.key, m_sketch.estimate (hash (entry.key)));
+                }
+            }
+          m_top = std::move (top);
+        }
+
+        [[nodiscard]] const CountMinSketch &sketch () const
+        {
+          return m_sketch;
+        }
+
+        [[nodiscard]] Item item () const
+        {
+          return m_item;
+        }
+
+        [[nodiscard]] unsigned n () const
+        {
+          return m_n;
+        }
+
+        // The monitored keys with their estimated counts.
+        template<typename Num>
+        std::unique_ptr <ItemVec<Num>> count_vec () const
+        {
+          auto vec = std::make_unique<ItemVec<Num>> ();
+          for (auto &entry: m_top.entries ())
+            {
+              vec->emplace_back (entry.key, (Num) entry.count);
+            }
+          return vec;
+        }
+
+        std::unique_ptr <ItemVec<float>> rank_vec () const
+        {
+          auto vec = count_vec<float> ();
+
+          // Ranks are relative to every item seen, not just the top K.
+          double sum = (double) m_sketch.total ();
+          if (sum > 0)
+            {
+              for (auto &[key, n]: vec->Data)
+                {
+                  n = (float) (n / sum);
+                }
+            }
+          return vec;
+        }
+
+     private:
+        static uint64_t hash (std::string_view key)
+        {
+          // std::hash may be the identity on some platforms; mix it.
+          uint64_t z = std::hash<std::string_view> {} (key);
+          z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+          z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+          return z ^ (z >> 31);
+        }
+
+        void add (std::string_view key)
+        {
+          m_top.offer (key, m_sketch.add (hash (key)));
+        }
+
+        ParseType m_type;
+        Item m_item;
+        unsigned m_n;
+        CountMinSketch m_sketch;
+        SpaceSaving m_top;
+        std::string m_token;
+    };
+
+    void print_heavy_hitters (const HeavyHitters &hitters, std::unique_ptr <ItemVec<uint64_t>> &vec)
+    {
+      printf ("\n"
+              "  %llu items, counts overestimated by at most %llu (%zux%zu sketch)\n"
+              "--------------------------------\n"
+              "   %-20s Count\n"
+              "--------------------------------\n",
+              (unsigned long long) hitters.sketch ().total (), (unsigned long long) hitters.sketch ().error_bound (),
+              hitters.sketch ().depth (), hitters.sketch ().width (), hitters.item () == Item::Word ? "Word" : "Gram");
+
+      // Print the results
+      for (auto &[key, n]: vec->Data)
+        {
+          printf ("    %-20s %llu\n", key.c_str (), (unsigned long long) n);
+        }
+      printf ("\n");
+    }
+}
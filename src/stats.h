@@ -0,0 +1,373 @@
+// src/stats.h
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define UTILS_HAS_PERF_EVENTS 1
+#endif
+
+//----------------------------------------------------
+//  [ SECTION STATS ]   Run-time instrumentation
+//----------------------------------------------------
+
+namespace utils::stats
+{
+    enum class Phase {
+        Open,
+        Read,
+        Decompress,
+        Count,
+        Copy,
+        Sort,
+        Print,
+    };
+
+    enum class Counter {
+        BytesRead,
+        BytesCounted,
+        BytesAccepted,
+        ReadCalls,
+        Allocations,
+    };
+
+    enum class Hardware {
+        Cycles,
+        Instructions,
+        CacheMisses,
+        BranchMisses,
+    };
+
+    const size_t PHASE_COUNT = 7;
+    const size_t COUNTER_COUNT = 5;
+    const size_t HARDWARE_COUNT = 4;
+
+    class Timer;
+    class HardwareScope;
+
+    void enable (bool hardware);
+    bool enabled ();
+    void add (Counter counter, uint64_t n = 1);
+    void record (Phase phase, uint64_t nanoseconds);
+    void reset ();
+    void print_report (FILE *out, bool json);
+}
+
+namespace utils::stats
+{
+    // Everything is recorded with relaxed atomics, so any thread may report.
+    struct Registry {
+        std::atomic<uint64_t> phase_ns[PHASE_COUNT] {};
+        std::atomic<uint64_t> phase_calls[PHASE_COUNT] {};
+        std::atomic<uint64_t> counters[COUNTER_COUNT] {};
+        std::atomic<uint64_t> hardware[HARDWARE_COUNT] {};
+        std::atomic<bool> hardware_seen[HARDWARE_COUNT] {};
+    };
+
+    Registry g_registry;
+    std::atomic<bool> g_enabled {false};
+    std::atomic<bool> g_hardware {false};
+
+    const char *const PHASE_NAMES[PHASE_COUNT] = {"open", "read", "decompress", "count", "copy", "sort", "print"};
+    const char *const COUNTER_NAMES[COUNTER_COUNT] = {"bytes_read", "bytes_counted", "bytes_accepted", "read_calls", "allocations"};
+    const char *const HARDWARE_NAMES[HARDWARE_COUNT] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+
+    // Instrumentation is off unless a program turns it on; every hook then
+    // costs one relaxed load and a branch that is never taken. Building with
+    // UTILS_NO_STATS removes the hooks entirely.
+    inline bool enabled ()
+    {
+#ifdef UTILS_NO_STATS
+      return false;
+#else
+      return g_enabled.load (std::memory_order_relaxed);
+#endif
+    }
+
+    void enable (bool hardware)
+    {
+      g_hardware = hardware;
+      g_enabled = true;
+    }
+
+    inline void add (Counter counter, uint64_t n)
+    {
+      if (enabled ())
+        {
+          g_registry.counters[(size_t) counter].fetch_add (n, std::memory_order_relaxed);
+        }
+    }
+
+    void record (Phase phase, uint64_t nanoseconds)
+    {
+      g_registry.phase_ns[(size_t) phase].fetch_add (nanoseconds, std::memory_order_relaxed);
+      g_registry.phase_calls[(size_t) phase].fetch_add (1, std::memory_order_relaxed);
+    }
+
+    void reset ()
+    {
+      for (size_t i = 0; i < PHASE_COUNT; ++i)
+        {
+          g_registry.phase_ns[i] = 0;
+          g_registry.phase_calls[i] = 0;
+        }
+      for (auto &counter: g_registry.counters)
+        {
+          counter = 0;
+        }
+      for (size_t i = 0; i < HARDWARE_COUNT; ++i)
+        {
+          g_registry.hardware[i] = 0;
+          g_registry.hardware_seen[i] = false;
+        }
+    }
+
+    // Adds the time until the end of the scope to a phase.
+    class Timer {
+     public:
+        explicit Timer (Phase phase)
+            : m_phase (phase)
+        {
+          if (enabled ())
+            {
+              m_running = true;
+              m_start = std::chrono::steady_clock::now ();
+            }
+        }
+
+        Timer (const Timer &) = delete;
+        Timer &operator= (const Timer &) = delete;
+
+        ~Timer ()
+        {
+          if (m_running)
+            {
+              auto elapsed = std::chrono::steady_clock::now () - m_start;
+              record (m_phase, (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds> (elapsed).count ());
+            }
+        }
+
+     private:
+        Phase m_phase;
+        bool m_running = false;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+#ifdef UTILS_HAS_PERF_EVENTS
+    // One group of hardware counters per thread, opened on first use and
+    // kept for the life of the thread. Counters the CPU or the kernel's
+    // perf_event_paranoid setting refuse are left out.
+    class HardwareGroup {
+     public:
+        HardwareGroup ()
+        {
+          const uint64_t configs[HARDWARE_COUNT] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                                    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+          for (size_t i = 0; i < HARDWARE_COUNT; ++i)
+            {
+              perf_event_attr attr {};
+              attr.size = sizeof (attr);
+              attr.type = PERF_TYPE_HARDWARE;
+              attr.config = configs[i];
+              attr.disabled = m_leader < 0;
+              attr.exclude_kernel = 1;
+              attr.exclude_hv = 1;
+              attr.read_format = PERF_FORMAT_GROUP;
+              int fd = (int) syscall (SYS_perf_event_open, &attr, 0, -1, m_leader, 0);
+              if (fd < 0)
+                {
+                  continue;
+                }
+              if (m_leader < 0)
+                {
+                  m_leader = fd;
+                }
+              m_fds[m_members] = fd;
+              m_events[m_members++] = (Hardware) i;
+            }
+        }
+
+        HardwareGroup (const HardwareGroup &) = delete;
+        HardwareGroup &operator= (const HardwareGroup &) = delete;
+
+        ~HardwareGroup ()
+        {
+          for (size_t i = 0; i < m_members; ++i)
+            {
+              ::close (m_fds[i]);
+            }
+        }
+
+        void start ()
+        {
+          if (m_leader >= 0)
+            {
+              ioctl (m_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+              ioctl (m_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+            }
+        }
+
+        // Stops counting and adds the counts to the registry.
+        void stop ()
+        {
+          if (m_leader < 0)
+            {
+              return;
+            }
+          ioctl (m_leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+          // PERF_FORMAT_GROUP: the number of counters, then their values.
+          uint64_t values[1 + HARDWARE_COUNT] {};
+          if (::read (m_leader, values, sizeof (values)) <= 0)
+            {
+              return;
+            }
+          for (size_t i = 0; i < std::min<uint64_t> (values[0], m_members); ++i)
+            {
+              auto event = (size_t) m_events[i];
+              g_registry.hardware[event].fetch_add (values[1 + i], std::memory_order_relaxed);
+              g_registry.hardware_seen[event] = true;
+            }
+        }
+
+     private:
+        int m_leader = -1;
+        int m_fds[HARDWARE_COUNT] {};
+        Hardware m_events[HARDWARE_COUNT] {};
+        size_t m_members = 0;
+    };
+#endif
+
+    // Counts cycles, instructions, cache and branch misses of the calling
+    // thread until the end of the scope, when hardware counters were asked
+    // for and the system allows them.
+    class HardwareScope {
+     public:
+        HardwareScope ()
+        {
+#ifdef UTILS_HAS_PERF_EVENTS
+          if (enabled () && g_hardware.load (std::memory_order_relaxed))
+            {
+              thread_local HardwareGroup group;
+              m_group = &group;
+              m_group->start ();
+            }
+#endif
+        }
+
+        HardwareScope (const HardwareScope &) = delete;
+        HardwareScope &operator= (const HardwareScope &) = delete;
+
+        ~HardwareScope ()
+        {
+#ifdef UTILS_HAS_PERF_EVENTS
+          if (m_group)
+            {
+              m_group->stop ();
+            }
+#endif
+        }
+
+     private:
+#ifdef UTILS_HAS_PERF_EVENTS
+        HardwareGroup *m_group = nullptr;
+#endif
+    };
+
+    void print_report (FILE *out, bool json)
+    {
+      auto &r = g_registry;
+      uint64_t counted = r.counters[(size_t) Counter::BytesCounted];
+      uint64_t accepted = r.counters[(size_t) Counter::BytesAccepted];
+      bool hardware = false;
+      for (auto &seen: r.hardware_seen)
+        {
+          hardware = hardware || seen;
+        }
+
+      if (json)
+        {
+          fprintf (out, "{\"phases\": {");
+          for (size_t i = 0; i < PHASE_COUNT; ++i)
+            {
+              fprintf (out, "%s\"%s\": {\"calls\": %llu, \"ns\": %llu}", i ? ", " : "", PHASE_NAMES[i],
+                       (unsigned long long) r.phase_calls[i], (unsigned long long) r.phase_ns[i]);
+            }
+          fprintf (out, "}, \"counters\": {");
+          for (size_t i = 0; i < COUNTER_COUNT; ++i)
+            {
+              fprintf (out, "%s\"%s\": %llu", i ? ", " : "", COUNTER_NAMES[i], (unsigned long long) r.counters[i]);
+            }
+          fprintf (out, "}, \"hardware\": ");
+          if (!hardware)
+            {
+              fprintf (out, "null}\n");
+              return;
+            }
+          fprintf (out, "{");
+          bool first = true;
+          for (size_t i = 0; i < HARDWARE_COUNT; ++i)
+            {
+              if (r.hardware_seen[i])
+                {
+                  fprintf (out, "%s\"%s\": %llu", first ? "" : ", ", HARDWARE_NAMES[i],
+                           (unsigned long long) r.hardware[i]);
+                  first = false;
+                }
+            }
+          fprintf (out, "}}\n");
+          return;
+        }
+
+      fprintf (out, "\n"
+                    "-----------------------------------\n"
+                    "   Phase          Calls   Time (ms)\n"
+                    "-----------------------------------\n");
+      for (size_t i = 0; i < PHASE_COUNT; ++i)
+        {
+          fprintf (out, "   %-12s %7llu %11.3f\n", PHASE_NAMES[i], (unsigned long long) r.phase_calls[i],
+                   (double) r.phase_ns[i] / 1e6);
+        }
+      fprintf (out, "-----------------------------------\n");
+      for (size_t i = 0; i < COUNTER_COUNT; ++i)
+        {
+          fprintf (out, "   %-16s %llu", COUNTER_NAMES[i], (unsigned long long) r.counters[i]);
+          if ((Counter) i == Counter::BytesAccepted && counted > 0)
+            {
+              fprintf (out, " (%.1f%%)", 100.0 * (double) accepted / (double) counted);
+            }
+          fprintf (out, "\n");
+        }
+      if (!hardware)
+        {
+          fprintf (out, "   hardware counters unavailable\n\n");
+          return;
+        }
+      for (size_t i = 0; i < HARDWARE_COUNT; ++i)
+        {
+          if (r.hardware_seen[i])
+            {
+              fprintf (out, "   %-16s %llu\n", HARDWARE_NAMES[i], (unsigned long long) r.hardware[i]);
+            }
+        }
+      uint64_t cycles = r.hardware[(size_t) Hardware::Cycles];
+      if (cycles > 0 && r.hardware_seen[(size_t) Hardware::Instructions])
+        {
+          fprintf (out, "   %-16s %.2f\n", "ipc", (double) r.hardware[(size_t) Hardware::Instructions] / (double) cycles);
+        }
+      if (cycles > 0 && counted > 0)
+        {
+          fprintf (out, "   %-16s %.3f\n", "cycles_per_byte", (double) cycles / (double) counted);
+        }
+      fprintf (out, "\n");
+    }
+}
@@ -0,0 +1,159 @@
+// src/thread_pool.h
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace utils
+{
+    class WorkStealingPool;
+}
+
+namespace utils
+{
+    // A fixed set of workers, each with its own job queue. Jobs are dealt to
+    // the queues round-robin in the order they are submitted; a worker runs
+    // its own jobs front to back and, once its queue is empty, steals from
+    // the front of the others. Submitting the biggest jobs first therefore
+    // keeps every worker busy on the largest remaining work and the tail short.
+    class WorkStealingPool {
+     public:
+        using Job = std::function<void ()>;
+
+        explicit WorkStealingPool (unsigned threads)
+        {
+          threads = threads > 0 ? threads : 1;
+          for (unsigned i = 0; i < threads; ++i)
+            {
+              m_queues.emplace_back (new Queue);
+            }
+          for (unsigned i = 0; i < threads; ++i)
+            {
+              m_threads.emplace_back ([this, i]
+                                      { worker_loop (i); });
+            }
+        }
+
+        WorkStealingPool (const WorkStealingPool &) = delete;
+        WorkStealingPool &operator= (const WorkStealingPool &) = delete;
+
+        ~WorkStealingPool ()
+        {
+          wait ();
+          {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            m_stop = true;
+          }
+          m_work_cv.notify_all ();
+          for (auto &thread: m_threads)
+            {
+              thread.join ();
+            }
+        }
+
+        void submit (Job job)
+        {
+          Queue &queue = *m_queues[m_next++ % m_queues.size ()];
+          {
+            std::lock_guard<std::mutex> lock (queue.mutex);
+            queue.jobs.push_back (std::move (job));
+          }
+          {
+            std::lock_guard<std::mutex> lock (m_mutex);
+            ++m_queued;
+            ++m_pending;
+          }
+          m_work_cv.notify_one ();
+        }
+
+        // Blocks until every submitted job has finished.
+        void wait ()
+        {
+          std::unique_lock<std::mutex> lock (m_mutex);
+          m_done_cv.wait (lock, [this]
+          { return m_pending == 0; });
+        }
+
+        [[nodiscard]] unsigned size () const
+        {
+          return (unsigned) m_threads.size ();
+        }
+
+     private:
+        struct Queue {
+            std::mutex mutex;
+            std::deque<Job> jobs;
+        };
+
+        bool try_pop (unsigned index, Job &job)
+        {
+          // Own queue first, then every other queue starting with the neighbour.
+          for (size_t offset = 0; offset < m_queues.size (); ++offset)
+            {
+              Queue &queue = *m_queues[(index + offset) % m_queues.size ()];
+              std::lock_guard<std::mutex> lock (queue.mutex);
+              if (!queue.jobs.empty ())
+                {
+                  job = std::move (queue.jobs.front ());
+                  queue.jobs.pop_front ();
+                  return true;
+                }
+            }
+          return false;
+        }
+
+        void worker_loop (unsigned index)
+        {
+          for (;;)
+            {
+              {
+                std::unique_lock<std::mutex> lock (m_mutex);
+                m_work_cv.wait (lock, [this]
+                { return m_stop || m_queued > 0; });
+                if (m_queued == 0)
+                  {
+                    return;
+                  }
+                // Claim a job; it is already sitting in one of the queues.
+                --m_queued;
+              }
+
+              Job job;
+              while (!try_pop (index, job))
+                {
+                  std::this_thread::yield ();
+                }
+
+              job ();
+
+              bool done;
+              {
+                std::lock_guard<std::mutex> lock (m_mutex);
+                done = --m_pending == 0;
+              }
+              if (done)
+                {
+                  m_done_cv.notify_all ();
+                }
+            }
+        }
+
+        std::vector<std::unique_ptr<Queue>> m_queues;
+        std::vector<std::thread> m_threads;
+        std::atomic<size_t> m_next {0};
+
+        std::mutex m_mutex;
+        std::condition_variable m_work_cv;
+        std::condition_variable m_done_cv;
+        size_t m_queued = 0;
+        size_t m_pending = 0;
+        bool m_stop = false;
+    };
+}
@@ -0,0 +1,423 @@
+// src/utf8.h
+
+#pragma once
+
+#include <cstring>
+#include <unordered_map>
+
+#include "cfa.h"
+
+//----------------------------------------------------
+//  [ SECTION UTF-8 ]   Code point frequencies
+//----------------------------------------------------
+
+namespace cfa::utf8
+{
+    const uint32_t MAX_CODE_POINT = 0x10FFFF;
+    const uint32_t BMP_END = 0x10000;
+    const uint32_t PAGE_SIZE = 256;
+
+    enum class DecodeStatus {
+        Valid,
+        Invalid,
+        Incomplete,
+    };
+
+    template<typename Num>
+    using CodePointVec = CharVec<Num, uint32_t>;
+
+    class CodePointMap;
+    class CodePointCounter;
+
+    DecodeStatus decode (const unsigned char *data, size_t size, uint32_t &code_point, size_t &length);
+    size_t encode (uint32_t code_point, char *out);
+
+    void print_code_point_count (std::unique_ptr <CodePointVec<uint64_t>> &vec);
+    void print_code_point_rank (std::unique_ptr <CodePointVec<float>> &vec);
+}
+
+namespace cfa::utf8
+{
+    // Decodes the sequence at the start of `data`. Rejects overlong forms,
+    // surrogates and values above U+10FFFF. On `Invalid`, `length` is 1 so the
+    // caller can resynchronize on the next byte.
+    DecodeStatus decode (const unsigned char *data, size_t size, uint32_t &code_point, size_t &length)
+    {
+      unsigned char lead = data[0];
+      length = 1;
+      if (lead < 0x80)
+        {
+          code_point = lead;
+          return DecodeStatus::Valid;
+        }
+      if (lead < 0xC2 || lead > 0xF4)
+        {
+          return DecodeStatus::Invalid;
+        }
+
+      size_t expected = lead < 0xE0 ? 2 : lead < 0xF0 ? 3 : 4;
+      uint32_t value = lead & (0x7F >> expected);
+      for (size_t i = 1; i < expected; ++i)
+        {
+          if (i >= size)
+            {
+              return DecodeStatus::Incomplete;
+            }
+
+          // The second byte carries the overlong/surrogate/range limits.
+          unsigned char low = 0x80, high = 0xBF;
+          if (i == 1)
+            {
+              low = lead == 0xE0 ? 0xA0 : lead == 0xF0 ? 0x90 : 0x80;
+              high = lead == 0xED ? 0x9F : lead == 0xF4 ? 0x8F : 0xBF;
+            }
+          if (data[i] < low || data[i] > high)
+            {
+              return DecodeStatus::Invalid;
+            }
+          value = (value << 6) | (data[i] & 0x3F);
+        }
+
+      code_point = value;
+      length = expected;
+      return DecodeStatus::Valid;
+    }
+
+    size_t encode (uint32_t code_point, char *out)
+    {
+      if (code_point < 0x80)
+        {
+          out[0] = (char) code_point;
+          return 1;
+        }
+      if (code_point < 0x800)
+        {
+          out[0] = (char) (0xC0 | (code_point >> 6));
+          out[1] = (char) (0x80 | (code_point & 0x3F));
+          return 2;
+        }
+      if (code_point < 0x10000)
+        {
+          out[0] = (char) (0xE0 | (code_point >> 12));
+          out[1] = (char) (0x80 | ((code_point >> 6) & 0x3F));
+          out[2] = (char) (0x80 | (code_point & 0x3F));
+          return 3;
+        }
+      out[0] = (char) (0xF0 | (code_point >> 18));
+      out[1] = (char) (0x80 | ((code_point >> 12) & 0x3F));
+      out[2] = (char) (0x80 | ((code_point >> 6) & 0x3F));
+      out[3] = (char) (0x80 | (code_point & 0x3F));
+      return 4;
+    }
+
+    // Two-level code point histogram. The BMP is split into 256-entry pages
+    // that are allocated the first time a code point in them is seen (the
+    // ASCII/Latin-1 page always exists); everything above the BMP is rare
+    // enough to live in a sparse map.
+    class CodePointMap {
+     public:
+        CodePointMap ()
+        {
+          m_pages[0].reset (new Page {});
+        }
+
+        CodePointMap (const CodePointMap &other)
+        {
+          *this = other;
+        }
+
+        CodePointMap &operator= (const CodePointMap &other)
+        {
+          if (this != &other)
+            {
+              for (size_t i = 0; i < m_pages.size (); ++i)
+                {
+                  m_pages[i].reset (other.m_pages[i] ? new Page (*other.m_pages[i]) : nullptr);
+                }
+              m_supplementary = other.m_supplementary;
+            }
+          return *this;
+        }
+
+        CodePointMap (CodePointMap &&) noexcept = default;
+        CodePointMap &operator= (CodePointMap &&) noexcept = default;
+
+        void increment (uint32_t code_point, uint64_t n = 1)
+        {
+          if (code_point < BMP_END)
+            {
+              auto &page = m_pages[code_point / PAGE_SIZE];
+              if (!page)
+                {
+                  page.reset (new Page {});
+                }
+              (*page)[code_point % PAGE_SIZE] += n;
+            }
+          else
+            {
+              m_supplementary[code_point] += n;
+            }
+        }
+
+        // Direct access to U+0000-U+00FF for the ASCII fast path.
+        uint64_t *first_page ()
+        {
+          return m_pages[0]->data ();
+        }
+
+        [[nodiscard]] uint64_t get (uint32_t code_point) const
+        {
+          if (code_point < BMP_END)
+            {
+              auto &page = m_pages[code_point / PAGE_SIZE];
+              return page ? (*page)[code_point % PAGE_SIZE] : 0;
+            }
+          auto it = m_supplementary.find (code_point);
+          return it != m_supplementary.end () ? it->second : 0;
+        }
+
+        void merge (const CodePointMap &other)
+        {
+          for (size_t i = 0; i < m_pages.size (); ++i)
+            {
+              if (!other.m_pages[i])
+                {
+                  continue;
+                }
+              for (uint32_t j = 0; j < PAGE_SIZE; ++j)
+                {
+                  if (uint64_t n = (*other.m_pages[i])[j]; n != 0)
+                    {
+                      increment ((uint32_t) (i * PAGE_SIZE + j), n);
+                    }
+                }
+            }
+          for (auto &[code_point, n]: other.m_supplementary)
+            {
+              m_supplementary[code_point] += n;
+            }
+        }
+
+        template<typename Num>
+        std::unique_ptr <CodePointVec<Num>> copy_to_vec () const
+        {
+          auto vec = std::make_unique<CodePointVec<Num>> ();
+          for (size_t i = 0; i < m_pages.size (); ++i)
+            {
+              if (!m_pages[i])
+                {
+                  continue;
+                }
+              for (uint32_t j = 0; j < PAGE_SIZE; ++j)
+                {
+                  if (uint64_t n = (*m_pages[i])[j]; n != 0)
+                    {
+                      vec->emplace_back ((uint32_t) (i * PAGE_SIZE + j), (Num) n);
+                    }
+                }
+            }
+          for (auto &[code_point, n]: m_supplementary)
+            {
+              vec->emplace_back (code_point, (Num) n);
+            }
+          return vec;
+        }
+
+        std::unique_ptr <CodePointVec<float>> ranks_to_vec () const
+        {
+          // Normalized from the 64-bit counts, so ranks stay exact past 2^24
+          // code points. We use _sum_ to normalize the results.
+          auto counts = copy_to_vec<uint64_t> ();
+          uint64_t sum = 0;
+          for (auto &[code_point, n]: counts->Data)
+            {
+              sum += n;
+            }
+
+          auto vec = std::make_unique<CodePointVec<float>> ();
+          for (auto &[code_point, n]: counts->Data)
+            {
+              vec->emplace_back (code_point, (float) ((double) n / (double) sum));
+            }
+          return vec;
+        }
+
+     private:
+        using Page = std::array<uint64_t, PAGE_SIZE>;
+
+        std::array<std::unique_ptr<Page>, BMP_END / PAGE_SIZE> m_pages;
+        std::unordered_map<uint32_t, uint64_t> m_supplementary;
+    };
+
+    // Streaming code point counter. Sequences split across `feed` calls are
+    // carried over; malformed bytes are counted separately and skipped.
+    class CodePointCounter {
+     public:
+        void feed (const char *data, size_t size)
+        {
+          auto *p = (const unsigned char *) data;
+          auto *end = p + size;
+          m_bytes += size;
+
+          // Finish a sequence left over from the previous buffer first.
+          while (m_pending_size > 0)
+            {
+              uint32_t code_point;
+              size_t length;
+              DecodeStatus status = decode (m_pending, m_pending_size, code_point, length);
+              if (status == DecodeStatus::Incomplete)
+                {
+                  if (p == end)
+                    {
+                      return;
+                    }
+                  m_pending[m_pending_size++] = *p++;
+                  continue;
+                }
+
+              if (status == DecodeStatus::Valid)
+                {
+                  m_map.increment (code_point);
+                }
+              else
+                {
+                  ++m_invalid;
+                }
+              m_pending_size -= length;
+              std::memmove (m_pending, m_pending + length, m_pending_size);
+            }
+
+          uint64_t *ascii = m_map.first_page ();
+          while (p < end)
+            {
+              // Runs of plain ASCII are counted without decoding.
+              size_t run = utils::simd::ascii_prefix ((const char *) p, (size_t) (end - p));
+              for (size_t i = 0; i < run; ++i)
+                {
+                  ++ascii[p[i]];
+                }
+              p += run;
+              if (p == end)
+                {
+                  break;
+                }
+
+              uint32_t code_point;
+              size_t length;
+              DecodeStatus status = decode (p, (size_t) (end - p), code_point, length);
+              if (status == DecodeStatus::Incomplete)
+                {
+                  m_pending_size = (size_t) (end - p);
+                  std::memcpy (m_pending, p, m_pending_size);
+                  break;
+                }
+
+              if (status == DecodeStatus::Valid)
+                {
+                  m_map.increment (code_point);
+                }
+              else
+                {
+                  ++m_invalid;
+                }
+              p += length;
+            }
+        }
+
+        void feed (std::string_view str)
+        {
+          feed (str.data (), str.size ());
+        }
+
+        // Counts a sequence still cut off at the end of input as malformed.
+        void finish ()
+        {
+          if (m_pending_size > 0)
+            {
+              ++m_invalid;
+              m_pending_size = 0;
+            }
+        }
+
+        void merge (const CodePointCounter &other)
+        {
+          m_map.merge (other.m_map);
+          m_invalid += other.m_invalid;
+          m_bytes += other.m_bytes;
+        }
+
+        [[nodiscard]] const CodePointMap &map () const
+        {
+          return m_map;
+        }
+
+        // Number of malformed sequences skipped so far.
+        [[nodiscard]] uint64_t invalid () const
+        {
+          return m_invalid;
+        }
+
+        [[nodiscard]] uint64_t bytes_fed () const
+        {
+          return m_bytes;
+        }
+
+        template<typename Num>
+        std::unique_ptr <CodePointVec<Num>> count_vec () const
+        {
+          return m_map.copy_to_vec<Num> ();
+        }
+
+        std::unique_ptr <CodePointVec<float>> rank_vec () const
+        {
+          return m_map.ranks_to_vec ();
+        }
+
+     private:
+        CodePointMap m_map;
+        unsigned char m_pending[4] {};
+        size_t m_pending_size = 0;
+        uint64_t m_invalid = 0;
+        uint64_t m_bytes = 0;
+    };
+
+    void print_code_point_count (std::unique_ptr <CodePointVec<uint64_t>> &vec)
+    {
+      printf ("\n"
+              "---------------------------\n"
+              "   Code point  Char  Count\n"
+              "---------------------------\n");
+
+      // Print the results
+      for (auto &[code_point, n]: vec->Data)
+        {
+          char glyph[5] = " ";
+          if (code_point >= 0x20 && code_point != 0x7F && (code_point < 0x80 || code_point >= 0xA0))
+            {
+              glyph[encode (code_point, glyph)] = '\0';
+            }
+          printf ("    U+%04X     %s     %llu\n", code_point, glyph, (unsigned long long) n);
+        }
+      printf ("\n");
+    }
+
+    void print_code_point_rank (std::unique_ptr <CodePointVec<float>> &vec)
+    {
+      printf ("\n"
+              "---------------------------\n"
+              "   Code point  Char  Rank\n"
+              "---------------------------\n");
+
+      // Print the results
+      for (auto &[code_point, n]: vec->Data)
+        {
+          char glyph[5] = " ";
+          if (code_point >= 0x20 && code_point != 0x7F && (code_point < 0x80 || code_point >= 0xA0))
+            {
+              glyph[encode (code_point, glyph)] = '\0';
+            }
+          printf ("    U+%04X     %s     %.4f\n", code_point, glyph, n);
+        }
+      printf ("\n");
+    }
+}
@@ -1,11 +1,39 @@
 // src/utils.h
 
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
 #include <fstream>
+#include <limits>
 #include <string>
+#include <type_traits>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define UTILS_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "stats.h"
 
 namespace utils
 {
     bool valid_utf8 (unsigned char c);
+    bool parse_option (const std::string &arg, std::string &key, std::string &value);
+    template<typename Num>
+    bool parse_number (const std::string &text, Num &number);
+    bool parse_size (const std::string &text, size_t &size);
+    uint32_t crc32 (const void *data, size_t size, uint32_t crc = 0);
 }
 
 namespace utils
@@ -16,17 +44,381 @@ namespace utils
 
       return (digit >= 0 && digit < 127);
     }
+
+    // Splits a `--key=value` or `--key` argument. Returns false for anything
+    // that is not an option.
+    bool parse_option (const std::string &arg, std::string &key, std::string &value)
+    {
+      if (arg.size () < 3 || arg.compare (0, 2, "--") != 0)
+        {
+          return false;
+        }
+
+      if (auto equals = arg.find ('='); equals != std::string::npos)
+        {
+          key = arg.substr (2, equals - 2);
+          value = arg.substr (equals + 1);
+        }
+      else
+        {
+          key = arg.substr (2);
+          value.clear ();
+        }
+      return true;
+    }
+
+    // Parses an option value that must be a whole number of type `Num`.
+    // Leaves `number` untouched and returns false on trailing text, on a
+    // sign for an unsigned type and on values `Num` cannot hold.
+    template<typename Num>
+    bool parse_number (const std::string &text, Num &number)
+    {
+      if (text.empty () || std::isspace ((unsigned char) text[0]))
+        {
+          return false;
+        }
+
+      char *end = nullptr;
+      errno = 0;
+      if constexpr (std::is_floating_point_v<Num>)
+        {
+          double value = std::strtod (text.c_str (), &end);
+          if (*end != '\0' || errno == ERANGE || !std::isfinite (value)
+              || std::fabs (value) > (double) std::numeric_limits<Num>::max ())
+            {
+              return false;
+            }
+          number = (Num) value;
+        }
+      else if constexpr (std::is_signed_v<Num>)
+        {
+          long long value = std::strtoll (text.c_str (), &end, 10);
+          if (*end != '\0' || errno == ERANGE || value < std::numeric_limits<Num>::min ()
+              || value > std::numeric_limits<Num>::max ())
+            {
+              return false;
+            }
+          number = (Num) value;
+        }
+      else
+        {
+          // strtoull accepts a minus sign and wraps the value around.
+          if (text[0] == '-')
+            {
+              return false;
+            }
+          unsigned long long value = std::strtoull (text.c_str (), &end, 10);
+          if (*end != '\0' || errno == ERANGE || value > std::numeric_limits<Num>::max ())
+            {
+              return false;
+            }
+          number = (Num) value;
+        }
+      return true;
+    }
+
+    // Parses a byte count with an optional K/M/G (binary) suffix, e.g. `64K`.
+    bool parse_size (const std::string &text, size_t &size)
+    {
+      char *end = nullptr;
+      double value = std::strtod (text.c_str (), &end);
+      if (end == text.c_str ())
+        {
+          return false;
+        }
+      switch (std::toupper (*end))
+        {
+          case 'G':
+            value *= 1024;
+            [[fallthrough]];
+          case 'M':
+            value *= 1024;
+            [[fallthrough]];
+          case 'K':
+            value *= 1024;
+            ++end;
+          break;
+          default:
+            break;
+        }
+      // Checked before the conversion: a negative, NaN or too large value
+      // has no size_t representation.
+      if (*end != '\0' || !(value >= 0) || value >= std::ldexp (1.0, std::numeric_limits<size_t>::digits))
+        {
+          return false;
+        }
+      size = (size_t) value;
+      return true;
+    }
+
+    // CRC-32 (IEEE 802.3, as in zlib and gzip). Pass the previous result as
+    // `crc` to continue a checksum over several buffers.
+    uint32_t crc32 (const void *data, size_t size, uint32_t crc)
+    {
+      static const auto table = []
+      {
+          std::array<uint32_t, 256> entries {};
+          for (uint32_t i = 0; i < 256; ++i)
+            {
+              uint32_t c = i;
+              for (int bit = 0; bit < 8; ++bit)
+                {
+                  c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+              entries[i] = c;
+            }
+          return entries;
+      } ();
+
+      auto *p = (const unsigned char *) data;
+      crc = ~crc;
+      for (size_t i = 0; i < size; ++i)
+        {
+          crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+        }
+      return ~crc;
+    }
 }
 
 namespace utils::file
 {
+    const size_t DEFAULT_BLOCK_SIZE = 1024 * 256;
+
+    class MappedFile;
+    class BlockReader;
+
+    // What a file is and when it last changed, as far as the filesystem knows.
+    struct FileIdentity {
+        uint64_t device = 0;
+        uint64_t inode = 0;
+        uint64_t size = 0;
+        int64_t mtime_ns = 0;
+    };
+
     std::ifstream get_file (std::string &filename);
+    MappedFile map_file (std::string &filename);
     void trim_filename (std::string &filename);
+    bool has_wildcard (const std::string &pattern);
+    bool wildcard_match (const char *pattern, const char *text);
+    void collect_files (const std::string &arg, std::vector<std::filesystem::path> &files);
+    bool identify (const std::string &filename, FileIdentity &identity);
 }
 
 
 namespace utils::file
 {
+    // Read-only view of a whole file. Regular files are memory-mapped so they
+    // can be counted in place; pipes, character devices and anything else that
+    // cannot be mapped are read sequentially through `read` instead.
+    class MappedFile {
+     public:
+        MappedFile () = default;
+
+        explicit MappedFile (const std::string &filename)
+        {
+          open (filename);
+        }
+
+        MappedFile (const MappedFile &) = delete;
+        MappedFile &operator= (const MappedFile &) = delete;
+
+        MappedFile (MappedFile &&other) noexcept
+        {
+          *this = std::move (other);
+        }
+
+        MappedFile &operator= (MappedFile &&other) noexcept
+        {
+          if (this != &other)
+            {
+              close ();
+#ifdef UTILS_HAS_MMAP
+              std::swap (m_fd, other.m_fd);
+#else
+              m_stream = std::move (other.m_stream);
+#endif
+              std::swap (m_data, other.m_data);
+              std::swap (m_size, other.m_size);
+              std::swap (m_mapped, other.m_mapped);
+            }
+          return *this;
+        }
+
+        ~MappedFile ()
+        {
+          close ();
+        }
+
+        bool open (const std::string &filename)
+        {
+          stats::Timer timer (stats::Phase::Open);
+          close ();
+#ifdef UTILS_HAS_MMAP
+          if ((m_fd = ::open (filename.c_str (), O_RDONLY)) < 0)
+            {
+              return false;
+            }
+
+          struct stat info {};
+          if (fstat (m_fd, &info) != 0 || !S_ISREG (info.st_mode) || info.st_size == 0)
+            {
+              // Not a regular file, so stream it. Files such as those in
+              // /proc report a size of 0 yet have content, and a file that
+              // really is empty streams just as well.
+              return true;
+            }
+
+          m_size = (size_t) info.st_size;
+          m_mapped = true;
+
+          void *addr = mmap (nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+          if (addr == MAP_FAILED)
+            {
+              m_size = 0;
+              m_mapped = false;
+              return true;
+            }
+
+          m_data = (const char *) addr;
+          stats::add (stats::Counter::BytesRead, m_size);
+          madvise (addr, m_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+          // Only a hint; most filesystems ignore it for file-backed pages.
+          madvise (addr, m_size, MADV_HUGEPAGE);
+#endif
+          return true;
+#else
+          m_stream.open (filename, std::ios::binary);
+          return m_stream.is_open ();
+#endif
+        }
+
+        void close ()
+        {
+#ifdef UTILS_HAS_MMAP
+          if (m_data)
+            {
+              munmap ((void *) m_data, m_size);
+            }
+          if (m_fd >= 0)
+            {
+              ::close (m_fd);
+            }
+          m_fd = -1;
+#else
+          m_stream.close ();
+#endif
+          m_data = nullptr;
+          m_size = 0;
+          m_mapped = false;
+        }
+
+        [[nodiscard]] bool is_open () const
+        {
+#ifdef UTILS_HAS_MMAP
+          return m_fd >= 0;
+#else
+          return m_stream.is_open ();
+#endif
+        }
+
+        // True when the whole file is available through `data`/`size`.
+        [[nodiscard]] bool is_mapped () const
+        {
+          return m_mapped;
+        }
+
+        [[nodiscard]] const char *data () const
+        {
+          return m_data;
+        }
+
+        [[nodiscard]] size_t size () const
+        {
+          return m_size;
+        }
+
+        // Streaming fallback for unmapped files. Returns 0 at end of input.
+        size_t read (char *buffer, size_t size)
+        {
+          stats::Timer timer (stats::Phase::Read);
+          stats::add (stats::Counter::ReadCalls);
+#ifdef UTILS_HAS_MMAP
+          for (;;)
+            {
+              ssize_t result = ::read (m_fd, buffer, size);
+              if (result < 0 && errno == EINTR)
+                {
+                  continue;
+                }
+              stats::add (stats::Counter::BytesRead, result > 0 ? (uint64_t) result : 0);
+              return result > 0 ? (size_t) result : 0;
+            }
+#else
+          m_stream.read (buffer, (std::streamsize) size);
+          stats::add (stats::Counter::BytesRead, (uint64_t) m_stream.gcount ());
+          return (size_t) m_stream.gcount ();
+#endif
+        }
+
+        explicit operator bool () const
+        {
+          return is_open ();
+        }
+
+     private:
+#ifdef UTILS_HAS_MMAP
+        int m_fd = -1;
+#else
+        std::ifstream m_stream;
+#endif
+        const char *m_data = nullptr;
+        size_t m_size = 0;
+        bool m_mapped = false;
+    };
+
+    // Reads a stream in fixed-size blocks into a buffer that is allocated once
+    // and reused for every block.
+    class BlockReader {
+     public:
+        explicit BlockReader (size_t block_size = DEFAULT_BLOCK_SIZE)
+            : m_buffer (block_size > 0 ? block_size : DEFAULT_BLOCK_SIZE)
+        {
+        }
+
+        // Returns the number of bytes read, or 0 once the stream is exhausted.
+        size_t read (std::istream &stream)
+        {
+          if (!stream)
+            {
+              return 0;
+            }
+          stats::Timer timer (stats::Phase::Read);
+          stream.read (m_buffer.data (), (std::streamsize) m_buffer.size ());
+          stats::add (stats::Counter::ReadCalls);
+          stats::add (stats::Counter::BytesRead, (uint64_t) stream.gcount ());
+          return (size_t) stream.gcount ();
+        }
+
+        size_t read (MappedFile &file)
+        {
+          return file.read (m_buffer.data (), m_buffer.size ());
+        }
+
+        [[nodiscard]] const char *data () const
+        {
+          return m_buffer.data ();
+        }
+
+        [[nodiscard]] size_t block_size () const
+        {
+          return m_buffer.size ();
+        }
+
+     private:
+        std::vector<char> m_buffer;
+    };
+
     void trim_filename (std::string &filename)
     {
       if (auto slash = filename.find_first_of ("/\\"); slash != std::string::npos)
@@ -54,4 +446,232 @@ namespace utils::file
 
       return file;
     }
+
+    MappedFile map_file (std::string &filename)
+    {
+      MappedFile file;
+      if (file.open (filename); !file)
+        {
+          // Check the previous directory (CMake works from `cmake-build-debug`)
+          filename = "../" + filename;
+
+          // Try again
+          if (file.open (filename); !file)
+            {
+              printf ("File does not exist!\n");
+            }
+        }
+
+      return file;
+    }
+
+    bool has_wildcard (const std::string &pattern)
+    {
+      return pattern.find_first_of ("*?[") != std::string::npos;
+    }
+
+    // Shell-style matching on '/'-separated paths: `?` and `*` stay within one
+    // path component, `**` also crosses separators, `[a-z]`/`[!a-z]` match a set.
+    bool wildcard_match (const char *pattern, const char *text)
+    {
+      for (; *pattern; ++pattern)
+        {
+          switch (*pattern)
+            {
+              case '*':
+                {
+                  bool any_depth = pattern[1] == '*';
+                  while (*pattern == '*')
+                    {
+                      ++pattern;
+                    }
+                  for (const char *rest = text;; ++rest)
+                    {
+                      if (wildcard_match (pattern, rest))
+                        {
+                          return true;
+                        }
+                      if (!*rest || (*rest == '/' && !any_depth))
+                        {
+                          return false;
+                        }
+                    }
+                }
+              case '?':
+                if (!*text || *text == '/')
+                  {
+                    return false;
+                  }
+              ++text;
+              break;
+              case '[':
+                {
+                  const char *end = pattern + 1;
+                  bool negate = *end == '!' || *end == '^';
+                  if (negate)
+                    {
+                      ++end;
+                    }
+                  bool matched = false;
+                  for (bool first = true; *end && (first || *end != ']'); first = false, ++end)
+                    {
+                      if (end[1] == '-' && end[2] && end[2] != ']')
+                        {
+                          matched |= *text >= end[0] && *text <= end[2];
+                          end += 2;
+                        }
+                      else
+                        {
+                          matched |= *text == *end;
+                        }
+                    }
+                  if (!*end)
+                    {
+                      // No closing bracket, so treat '[' literally.
+                      if (*text != '[')
+                        {
+                          return false;
+                        }
+                      ++text;
+                      break;
+                    }
+                  if (!*text || *text == '/' || matched == negate)
+                    {
+                      return false;
+                    }
+                  pattern = end;
+                  ++text;
+                }
+              break;
+              default:
+                if (*pattern != *text)
+                  {
+                    return false;
+                  }
+              ++text;
+              break;
+            }
+        }
+      return !*text;
+    }
+
+    // Expands one command-line argument into the files it names. Directories
+    // are walked recursively; arguments with wildcards are matched against the
+    // paths below the directory that precedes the first wildcard.
+    void collect_files (const std::string &arg, std::vector<std::filesystem::path> &files)
+    {
+      namespace fs = std::filesystem;
+      std::error_code error;
+
+      auto add_tree = [&files] (const fs::path &root)
+      {
+          std::error_code walk_error;
+          if (!fs::is_directory (root, walk_error))
+            {
+              files.push_back (root);
+              return;
+            }
+          for (fs::recursive_directory_iterator it (root, fs::directory_options::skip_permission_denied, walk_error), end;
+               !walk_error && it != end; it.increment (walk_error))
+            {
+              if (it->is_regular_file (walk_error))
+                {
+                  files.push_back (it->path ());
+                }
+            }
+      };
+
+      if (!has_wildcard (arg))
+        {
+          if (fs::exists (arg, error))
+            {
+              add_tree (arg);
+            }
+          else
+            {
+              fprintf (stderr, "cfa: '%s' does not exist\n", arg.c_str ());
+            }
+          return;
+        }
+
+      std::string pattern = fs::path (arg).generic_string ();
+      size_t wildcard = pattern.find_first_of ("*?[");
+      size_t slash = pattern.rfind ('/', wildcard);
+      fs::path base = slash == std::string::npos ? fs::path (".") : fs::path (pattern.substr (0, slash + 1));
+      std::string relative = slash == std::string::npos ? pattern : pattern.substr (slash + 1);
+      bool recursive = relative.find ('/') != std::string::npos || relative.find ("**") != std::string::npos;
+
+      std::vector<fs::path> matches;
+      auto consider = [&] (const fs::directory_entry &entry)
+      {
+          std::error_code type_error;
+          if (recursive && entry.is_directory (type_error))
+            {
+              // The walk reaches the files below it anyway.
+              return;
+            }
+          std::string name = entry.path ().lexically_relative (base).generic_string ();
+          if (wildcard_match (relative.c_str (), name.c_str ()))
+            {
+              matches.push_back (entry.path ());
+            }
+      };
+
+      if (recursive)
+        {
+          for (fs::recursive_directory_iterator it (base, fs::directory_options::skip_permission_denied, error), end;
+               !error && it != end; it.increment (error))
+            {
+              consider (*it);
+            }
+        }
+      else
+        {
+          for (fs::directory_iterator it (base, error), end; !error && it != end; it.increment (error))
+            {
+              consider (*it);
+            }
+        }
+
+      if (matches.empty ())
+        {
+          fprintf (stderr, "cfa: no match for '%s'\n", arg.c_str ());
+        }
+      std::sort (matches.begin (), matches.end ());
+      for (auto &match: matches)
+        {
+          add_tree (match);
+        }
+    }
+
+    bool identify (const std::string &filename, FileIdentity &identity)
+    {
+#ifdef UTILS_HAS_MMAP
+      struct stat info {};
+      if (::stat (filename.c_str (), &info) != 0 || !S_ISREG (info.st_mode))
+        {
+          return false;
+        }
+      identity.device = (uint64_t) info.st_dev;
+      identity.inode = (uint64_t) info.st_ino;
+      identity.size = (uint64_t) info.st_size;
+#ifdef __APPLE__
+      identity.mtime_ns = (int64_t) info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+      identity.mtime_ns = (int64_t) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+      return true;
+#else
+      // No inode here; the size and time still catch most rewrites.
+      std::error_code error;
+      if (!std::filesystem::is_regular_file (filename, error))
+        {
+          return false;
+        }
+      identity.size = std::filesystem::file_size (filename, error);
+      identity.mtime_ns = std::chrono::duration_cast<std::chrono::nanoseconds> (
+          std::filesystem::last_write_time (filename, error).time_since_epoch ()).count ();
+      return !error;
+#endif
+    }
 }
\ No newline at end of file
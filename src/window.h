@@ -0,0 +1,462 @@
+// src/window.h
+
+#pragma once
+
+#include <chrono>
+#include <cmath>
+
+#include "cfa.h"
+
+//----------------------------------------------------
+//  [ SECTION WINDOW ]   Sliding windows and drift
+//----------------------------------------------------
+
+namespace cfa::window
+{
+    const size_t DEFAULT_BLOCK_SIZE = 1024 * 64;
+    const unsigned DEFAULT_TIME_SLOTS = 64;
+
+    // Probability given to keys a distribution never saw, so neither metric
+    // divides by zero or takes the log of zero.
+    const double SMOOTHING = 1e-6;
+
+    enum class Metric {
+        ChiSquare,
+        KullbackLeibler,
+    };
+
+    struct Options {
+        std::string input;
+        std::string baseline;
+        ParseType type = ParseType::Alpha;
+        size_t window_bytes = 1024 * 1024;
+        double window_seconds = 0;
+        size_t block_size = DEFAULT_BLOCK_SIZE;
+        Metric metric = Metric::ChiSquare;
+        double threshold = 0;
+    };
+
+    class SlidingWindow;
+    class DriftDetector;
+
+    double divergence (Metric metric, const CharMap<uint64_t> &observed, const CharMap<float> &expected);
+    void print_usage ();
+    bool parse_options (int argc, char **argv, Options &options);
+    int window_program (int argc, char **argv);
+}
+
+namespace cfa::window
+{
+    // Counts over the most recent input only. Input is counted into a block
+    // histogram; a full block joins a ring of the last few blocks and the
+    // running total, and the oldest block leaves both. Sliding therefore
+    // costs 2 x 256 additions per block, whatever the window size.
+    //
+    // Byte windows close a block every `block_size` bytes and cover the last
+    // `window_bytes` to within one block. Time windows close a block every
+    // `window / slots` and drop blocks older than the window.
+    class SlidingWindow {
+     public:
+        using Clock = std::chrono::steady_clock;
+
+        SlidingWindow (ParseType type, size_t window_bytes, size_t block_size = DEFAULT_BLOCK_SIZE)
+            : m_type (type), m_block_size (std::max<size_t> (block_size, 1)),
+              m_slots (std::max<size_t> (window_bytes / std::max<size_t> (block_size, 1), 1))
+        {
+          m_ring.resize (m_slots);
+        }
+
+        SlidingWindow (ParseType type, Clock::duration window, unsigned slots = DEFAULT_TIME_SLOTS)
+            : m_type (type), m_block_size (SIZE_MAX), m_slots (std::max (slots, 1u)),
+              m_slice (std::max<Clock::duration> (window / std::max (slots, 1u), Clock::duration (1))),
+              m_window (window), m_by_time (true)
+        {
+          m_ring.resize (m_slots);
+          m_current.start = Clock::now ();
+        }
+
+        void feed (const char *data, size_t size, Clock::time_point now = Clock::now ())
+        {
+          if (m_by_time)
+            {
+              advance (now);
+              count (data, size);
+              return;
+            }
+
+          while (size > 0)
+            {
+              size_t length = std::min (size, m_block_size - m_current.bytes);
+              count (data, length);
+              data += length;
+              size -= length;
+              if (m_current.bytes == m_block_size)
+                {
+                  close_block (now);
+                }
+            }
+        }
+
+        // Closes and expires time slices up to `now`; a no-op for byte windows.
+        void advance (Clock::time_point now = Clock::now ())
+        {
+          if (!m_by_time)
+            {
+              return;
+            }
+          while (now - m_current.start >= m_slice)
+            {
+              Clock::time_point next = m_current.start + m_slice;
+              close_block (next);
+              m_current.start = next;
+
+              // Skip over a long idle gap in one step.
+              if (now - next >= m_window)
+                {
+                  m_current.start = now - (now - next) % m_slice;
+                }
+            }
+          while (m_used > 0 && now - oldest ().start >= m_window + m_slice)
+            {
+              expire_oldest ();
+            }
+        }
+
+        // Counts in the window, including the block still being filled.
+        [[nodiscard]] CharMap<uint64_t> counts () const
+        {
+          CharMap<uint64_t> map = m_total;
+          map.merge (m_current.counts);
+          return map;
+        }
+
+        [[nodiscard]] uint64_t bytes () const
+        {
+          return m_total_bytes + m_current.bytes;
+        }
+
+        // True once the window has been filled for the first time.
+        [[nodiscard]] bool full () const
+        {
+          return m_used == m_slots;
+        }
+
+        [[nodiscard]] ParseType type () const
+        {
+          return m_type;
+        }
+
+     private:
+        struct Block {
+            CharMap<uint64_t> counts;
+            uint64_t bytes = 0;
+            Clock::time_point start;
+        };
+
+        void count (const char *data, size_t size)
+        {
+          m_current.counts.increment_if (data, size, m_type);
+          m_current.bytes += size;
+        }
+
+        Block &oldest ()
+        {
+          return m_ring[(m_head + m_slots - m_used) % m_slots];
+        }
+
+        void expire_oldest ()
+        {
+          Block &block = oldest ();
+          for (size_t i = 0; i < CharMap<uint64_t>::SIZE; ++i)
+            {
+              m_total.Data[i] -= block.counts.Data[i];
+            }
+          m_total_bytes -= block.bytes;
+          --m_used;
+        }
+
+        void close_block (Clock::time_point now)
+        {
+          if (m_used == m_slots)
+            {
+              expire_oldest ();
+            }
+          m_total.merge (m_current.counts);
+          m_total_bytes += m_current.bytes;
+
+          m_ring[m_head] = m_current;
+          m_head = (m_head + 1) % m_slots;
+          ++m_used;
+
+          m_current.counts = CharMap<uint64_t> ();
+          m_current.bytes = 0;
+          m_current.start = now;
+        }
+
+        ParseType m_type;
+        size_t m_block_size;
+        size_t m_slots;
+        Clock::duration m_slice {};
+        Clock::duration m_window {};
+        bool m_by_time = false;
+
+        std::vector<Block> m_ring;
+        size_t m_head = 0;
+        size_t m_used = 0;
+        Block m_current;
+        CharMap<uint64_t> m_total;
+        uint64_t m_total_bytes = 0;
+    };
+
+    // Compares windows against a baseline distribution and reports when the
+    // score crosses the threshold, in either direction.
+    class DriftDetector {
+     public:
+        DriftDetector (Metric metric, double threshold)
+            : m_metric (metric), m_threshold (threshold)
+        {
+        }
+
+        void set_baseline (const CharMap<float> &ranks)
+        {
+          m_baseline = ranks;
+          m_has_baseline = true;
+        }
+
+        [[nodiscard]] bool has_baseline () const
+        {
+          return m_has_baseline;
+        }
+
+        // Scores `counts`; returns true when it has just crossed the threshold.
+        bool check (const CharMap<uint64_t> &counts)
+        {
+          m_score = divergence (m_metric, counts, m_baseline);
+          bool drifting = m_score > m_threshold;
+          bool crossed = drifting != m_drifting;
+          m_drifting = drifting;
+          return crossed;
+        }
+
+        [[nodiscard]] double score () const
+        {
+          return m_score;
+        }
+
+        [[nodiscard]] bool drifting () const
+        {
+          return m_drifting;
+        }
+
+     private:
+        Metric m_metric;
+        double m_threshold;
+        CharMap<float> m_baseline;
+        bool m_has_baseline = false;
+        double m_score = 0;
+        bool m_drifting = false;
+    };
+
+    // Pearson's chi-square statistic of the observed counts against the
+    // expected distribution, or the KL divergence D(observed || expected) in
+    // nats. Both are 0 for identical distributions.
+    double divergence (Metric metric, const CharMap<uint64_t> &observed, const CharMap<float> &expected)
+    {
+      double total = 0;
+      for (uint64_t n: observed.Data)
+        {
+          total += (double) n;
+        }
+      if (total == 0)
+        {
+          return 0;
+        }
+
+      double score = 0;
+      for (size_t i = 0; i < CharMap<uint64_t>::SIZE; ++i)
+        {
+          double p = (double) observed.Data[i] / total;
+          double q = std::max ((double) expected.Data[i], SMOOTHING);
+          if (p == 0 && expected.Data[i] == 0)
+            {
+              continue;
+            }
+          if (metric == Metric::ChiSquare)
+            {
+              double e = q * total;
+              score += ((double) observed.Data[i] - e) * ((double) observed.Data[i] - e) / e;
+            }
+          else if (p > 0)
+            {
+              score += p * std::log (p / q);
+            }
+        }
+      return score;
+    }
+
+    void print_usage ()
+    {
+      printf ("Usage: cfa -window [options] <file|->\n"
+              "\t--type=alpha|digit|symbol|alnum|ascii   (default: alpha)\n"
+              "\t--bytes=SIZE       window over the last SIZE bytes (default: 1M)\n"
+              "\t--seconds=T        window over the last T seconds instead\n"
+              "\t--block=SIZE       bytes per block of a byte window (default: 64K)\n"
+              "\t--baseline=FILE    distribution to compare with (default: the first full window)\n"
+              "\t--metric=chi2|kl   divergence score (default: chi2)\n"
+              "\t--threshold=X      report when the score crosses X (default: print every block)\n");
+    }
+
+    bool parse_options (int argc, char **argv, Options &options)
+    {
+      for (int i = 0; i < argc; ++i)
+        {
+          std::string arg (argv[i]), key, value;
+          bool valid = utils::parse_option (arg, key, value);
+          if (!valid && options.input.empty ())
+            {
+              options.input = arg;
+              continue;
+            }
+
+          if (valid && key == "type")
+            {
+              valid = parse_type_from_name (value, options.type);
+            }
+          else if (valid && key == "bytes")
+            {
+              valid = utils::parse_size (value, options.window_bytes) && options.window_bytes > 0;
+            }
+          else if (valid && key == "seconds")
+            {
+              valid = utils::parse_number (value, options.window_seconds) && options.window_seconds > 0;
+            }
+          else if (valid && key == "block")
+            {
+              valid = utils::parse_size (value, options.block_size) && options.block_size > 0;
+            }
+          else if (valid && key == "baseline" && !value.empty ())
+            {
+              options.baseline = value;
+            }
+          else if (valid && key == "metric" && (value == "chi2" || value == "kl"))
+            {
+              options.metric = value == "kl" ? Metric::KullbackLeibler : Metric::ChiSquare;
+            }
+          else if (valid && key == "threshold")
+            {
+              valid = utils::parse_number (value, options.threshold);
+            }
+          else
+            {
+              valid = false;
+            }
+
+          if (!valid)
+            {
+              fprintf (stderr, "cfa: invalid option '%s'\n", arg.c_str ());
+              return false;
+            }
+        }
+      return !options.input.empty ();
+    }
+
+    int window_program (int argc, char **argv)
+    {
+      Options options;
+      if (!parse_options (argc, argv, options))
+        {
+          print_usage ();
+          return 1;
+        }
+
+      SlidingWindow window = options.window_seconds > 0
+                             ? SlidingWindow (options.type, std::chrono::duration_cast<SlidingWindow::Clock::duration> (
+              std::chrono::duration<double> (options.window_seconds)))
+                             : SlidingWindow (options.type, options.window_bytes, options.block_size);
+      DriftDetector detector (options.metric, options.threshold);
+
+      if (!options.baseline.empty ())
+        {
+          utils::file::MappedFile baseline (options.baseline);
+          if (!baseline)
+            {
+              fprintf (stderr, "cfa: could not read '%s'\n", options.baseline.c_str ());
+              return 1;
+            }
+          detector.set_baseline (get_byte_histogram (baseline).rank_view (options.type));
+        }
+
+      utils::file::MappedFile input (options.input == "-" ? "/dev/stdin" : options.input);
+      if (!input)
+        {
+          fprintf (stderr, "cfa: could not read '%s'\n", options.input.c_str ());
+          return 1;
+        }
+
+      auto check = [&] (uint64_t offset)
+      {
+          if (!detector.has_baseline ())
+            {
+              if (window.full ())
+                {
+                  detector.set_baseline (window.counts ().ranks ());
+                }
+              return;
+            }
+          bool crossed = detector.check (window.counts ());
+          if (options.threshold <= 0 || crossed)
+            {
+              printf ("offset %llu: %s %.6f\n", (unsigned long long) offset,
+                      options.threshold <= 0 ? "score" : detector.drifting () ? "drift" : "normal",
+                      detector.score ());
+              fflush (stdout);
+            }
+      };
+
+      // Byte windows are scored at every block boundary, time windows after
+      // every read, so a slow stream is still scored as it arrives.
+      size_t step = options.block_size;
+      uint64_t offset = 0;
+      auto feed = [&] (const char *data, size_t size)
+      {
+          if (options.window_seconds > 0)
+            {
+              window.feed (data, size);
+              offset += size;
+              check (offset);
+              return;
+            }
+          while (size > 0)
+            {
+              size_t length = std::min (size, step - offset % step);
+              window.feed (data, length);
+              data += length;
+              size -= length;
+              offset += length;
+              if (offset % step == 0)
+                {
+                  check (offset);
+                }
+            }
+      };
+
+      if (input.is_mapped ())
+        {
+          feed (input.data (), input.size ());
+        }
+      else
+        {
+          utils::file::BlockReader reader;
+          while (size_t size = reader.read (input))
+            {
+              feed (reader.data (), size);
+            }
+        }
+
+      printf ("==> last window (%llu bytes) <==", (unsigned long long) window.bytes ());
+      auto vec = std::make_unique<CharVec<uint64_t>> ();
+      window.counts ().copy_to (*vec);
+      print_char_count (vec);
+      return 0;
+    }
+}